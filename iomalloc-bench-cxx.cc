@@ -0,0 +1,198 @@
+/*
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** IOMalloc - Strict FIFO Memory Allocator
+**
+** Author: Hagen Paul Pfeifer <hagen.pfeifer@protocollabs.com>
+**
+*/
+
+/*
+ * The C calls out of line (iom_push_slow(), iom_shift_slow()), the
+ * inline fast paths of iomalloc.h and iom::ring<>, all on the same
+ * steady state push/shift loop as bench_push_shift() in iomalloc.c.
+ * Linked against libiomalloc.a without LTO, so only what the
+ * headers provide can be inlined.
+ */
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+
+#include "iomalloc.hpp"
+
+static constexpr std::size_t ring_size = 65536;
+
+static double bench_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void bench_report(const char *name, std::size_t chunk, double start,
+			 unsigned long rounds)
+{
+	double ns = (bench_time() - start) * 1e9 / rounds;
+	double mibs = chunk / ns * 1e9 / (1024 * 1024);
+
+	std::printf("%-9s size %7zu chunk %6zu: %8.1f ns/op %9.1f MiB/s\n",
+		    name, ring_size, chunk, ns, mibs);
+}
+
+
+template <bool Inline>
+static int bench_c(const char *name, unsigned flags, std::size_t chunk,
+		   unsigned long rounds)
+{
+	std::vector<unsigned char> buf(chunk), rbuf(chunk);
+	struct iom_buffer *iom_buffer;
+	unsigned int rbuf_len;
+	unsigned long i;
+	double start;
+	int ret;
+
+	ret = iom_init(ring_size, &iom_buffer, flags);
+	if (ret) {
+		std::fprintf(stderr, "Cannot allocate iom_buffer (%d)\n", ret);
+		return EXIT_FAILURE;
+	}
+
+	ret = iom_push(iom_buffer, buf.data(), chunk, IOM_TAIL_DROP);
+	assert(ret == 0);
+
+	start = bench_time();
+	for (i = 0; i < rounds; i++) {
+		if constexpr (Inline) {
+			ret = iom_push(iom_buffer, buf.data(), chunk, IOM_TAIL_DROP);
+			ret |= iom_shift(iom_buffer, rbuf.data(), &rbuf_len, chunk);
+		} else {
+			ret = iom_push_slow(iom_buffer, buf.data(), chunk,
+					    IOM_TAIL_DROP);
+			ret |= iom_shift_slow(iom_buffer, rbuf.data(), &rbuf_len,
+					      chunk);
+		}
+		if (ret) {
+			std::fprintf(stderr, "push/shift failed (%d)\n", ret);
+			return EXIT_FAILURE;
+		}
+	}
+	bench_report(name, chunk, start, rounds);
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+template <iom::sync S>
+static int bench_cxx(const char *name, std::size_t chunk, unsigned long rounds)
+{
+	std::vector<std::byte> buf(chunk), rbuf(chunk);
+	iom::ring<iom::drop::tail, ring_size, S> ring;
+	std::size_t rbuf_len;
+	unsigned long i;
+	double start;
+	int ret;
+
+	ret = ring.push(buf);
+	assert(ret == 0);
+
+	start = bench_time();
+	for (i = 0; i < rounds; i++) {
+		ret = ring.push(buf);
+		ret |= ring.shift(rbuf, rbuf_len);
+		if (ret) {
+			std::fprintf(stderr, "push/shift failed (%d)\n", ret);
+			return EXIT_FAILURE;
+		}
+	}
+	bench_report(name, chunk, start, rounds);
+
+	return 0;
+}
+
+
+/*
+ * The template writes the C format: what one side pushes the other
+ * must shift unchanged, across the end of the ring as well
+ */
+static int bench_check(void)
+{
+	iom::ring<iom::drop::head, 1024> ring;
+	std::byte buf[300], rbuf[300];
+	unsigned char cbuf[300];
+	unsigned int cbuf_len;
+	std::size_t rbuf_len;
+	iom::view v;
+	int i, ret;
+
+	/* the chunks of the previous round stay, so the indices wrap */
+	for (i = 0; i < 40; i++) {
+		std::memset(buf, i, sizeof(buf));
+		ret = ring.push(std::span(buf).first(i * 7));
+		ret |= iom_push(ring.get(), reinterpret_cast<unsigned char *>(buf),
+				i * 5, IOM_TAIL_DROP);
+		if (ret)
+			return EXIT_FAILURE;
+		if (i == 0)
+			continue;
+
+		ret = ring.peek(v);
+		if (ret || v.size() != static_cast<std::size_t>((i - 1) * 7))
+			return EXIT_FAILURE;
+		ret = iom_shift(ring.get(), cbuf, &cbuf_len, sizeof(cbuf));
+		if (ret || cbuf_len != static_cast<unsigned int>((i - 1) * 7) ||
+		    (cbuf_len && cbuf[cbuf_len - 1] != i - 1))
+			return EXIT_FAILURE;
+		ret = ring.shift(rbuf, rbuf_len);
+		if (ret || rbuf_len != static_cast<std::size_t>((i - 1) * 5) ||
+		    (rbuf_len && rbuf[rbuf_len - 1] != std::byte(i - 1)))
+			return EXIT_FAILURE;
+	}
+	while (ring.release() == 0)
+		;
+
+	/* head drop falls back to the C path once full */
+	for (i = 0; i < 10; i++)
+		if (ring.push(std::span(buf).first(200)))
+			return EXIT_FAILURE;
+
+	return ring.chunks() == 5 && ring.shift(rbuf, rbuf_len) == 0 &&
+	       ring.release() == 0 && ring.chunks() == 3 ? 0 : EXIT_FAILURE;
+}
+
+
+int main(void)
+{
+	static const std::size_t chunks[] = { 8, 64, 1000, 4000 };
+	unsigned long rounds;
+	int ret;
+
+	ret = bench_check();
+	if (ret) {
+		std::fputs("iom::ring does not match the C calls\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	for (std::size_t chunk : chunks) {
+		rounds = (1UL << 30) / chunk;
+		if (rounds > (1UL << 26))
+			rounds = 1UL << 26;
+		ret |= bench_c<false>("call", 0, chunk, rounds);
+		ret |= bench_c<true>("inline", 0, chunk, rounds);
+		ret |= bench_cxx<iom::sync::none>("cxx", chunk, rounds);
+		ret |= bench_c<false>("call-spsc", IOM_SPSC, chunk, rounds);
+		ret |= bench_c<true>("inl-spsc", IOM_SPSC, chunk, rounds);
+		ret |= bench_cxx<iom::sync::spsc>("cxx-spsc", chunk, rounds);
+	}
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -9,16 +9,36 @@
 **
 */
 
+/* for memfd_create() */
+#define _GNU_SOURCE
+
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+/* for shm_open() */
+#include <sys/stat.h>
+#include <fcntl.h>
+/* for mbind() and getcpu(), no libnuma needed */
+#include <sys/syscall.h>
+/* for struct iovec */
+#include <sys/uio.h>
 /* for htons() */
 #include <netinet/in.h>
 /* for CHAR_BITS */
 #include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+
+#include "iomalloc.h"
 
 #undef __always_inline
 #if __GNUC_PREREQ (3,2)
@@ -27,25 +47,69 @@
 # define __always_inline __inline
 #endif
 
+#undef __cacheline_aligned
+#define __cacheline_aligned __attribute__ ((__aligned__(IOM_CACHELINE_SIZE)))
+
+/*
+ * Index accessors. The plain variants are for the side owning an
+ * index, the acquire/release pair is used to hand data from producer
+ * to consumer (and free space back) when both run on different CPUs.
+ */
+#define READ_ONCE(x)             __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v)         __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define smp_load_acquire(x)      __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define smp_store_release(x, v)  __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+#define prefetch(x)              __builtin_prefetch(x)
+
+/*
+ * IOM_MAINLY_EMPTY: bytes at the start of buf which stay resident
+ * when the buffer runs empty, and how the rest is given back
+ */
+#ifndef IOM_RECLAIM_KEEP
+# define IOM_RECLAIM_KEEP   (16 * 1024)
+#endif
+#ifndef IOM_RECLAIM_ADVICE
+# define IOM_RECLAIM_ADVICE MADV_DONTNEED
+#endif
+
 /*
- * See if our compiler is known to support flexible array members.
+ * IOM_HUGEPAGE mappings and iom_pool slabs are multiples of it, the
+ * default huge page size on x86-64 and arm64 (4k granule)
  */
-#ifndef FLEX_ARRAY
-#if defined(__STDC_VERSION__) && \
-	(__STDC_VERSION__ >= 199901L) && \
-	(!defined(__SUNPRO_C) || (__SUNPRO_C > 0x580))
-# define FLEX_ARRAY /* empty */
-#elif defined(__GNUC__)
-# if (__GNUC__ >= 3)
-#  define FLEX_ARRAY /* empty */
-# else
-#  define FLEX_ARRAY 0 /* older GNU extension */
-# endif
+#ifndef IOM_HUGEPAGE_SIZE
+# define IOM_HUGEPAGE_SIZE  (2UL * 1024 * 1024)
+#endif
+
+/* from <numaif.h> */
+#ifndef MPOL_PREFERRED
+# define MPOL_PREFERRED     1
 #endif
-#ifndef FLEX_ARRAY
-# define FLEX_ARRAY 1
+
+/* busy waiting rounds before the CPU is given away */
+#define IOM_SPIN_MAX 128
+
+/* iom_wait_*(): busy waiting rounds before parking in the kernel */
+#ifndef IOM_WAIT_SPIN
+# define IOM_WAIT_SPIN 1024
 #endif
+
+static __always_inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	__asm__ __volatile__("" ::: "memory");
 #endif
+}
+
+static void iom_relax(unsigned int spin)
+{
+	if (spin < IOM_SPIN_MAX)
+		cpu_relax();
+	else
+		sched_yield();
+}
 
 #define min(x,y) ({             \
         typeof(x) _x = (x);     \
@@ -63,31 +127,20 @@
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 #define BITSIZEOF(x)  (CHAR_BIT * sizeof(x))
 
-/* iom_init() flags */
-#define	IOM_MAINLY_EMPTY 0x0
-
-/* iom_push() flags */
-#define IOM_HEAD_DROP          0x0
-#define	IOM_TAIL_DROP          0x1
-#define	IOM_DROP_ALL           0x2
-
-/*
- * Implemented as continues chunk to avoid memory
- * dereferences when queue never fills.
- */
-struct iom_buffer {
-	unsigned int size;
-	unsigned int chunks;
-	/* buf index: no pointer, save 8 byte on some arch's */
-	int tail;
-	int head;
-	unsigned char buf[FLEX_ARRAY];
-};
-
-struct iom_iterator {
-	int tail;
-	int head;
-};
+#define	IOM_INIT_FLAGS   (IOM_MAINLY_EMPTY | IOM_SPSC | IOM_MPSC | \
+			  IOM_MAGIC_RING | IOM_NO_SPLIT | IOM_VARINT | \
+			  IOM_ALLOC_FLAGS | IOM_GROW_MASK | IOM_WAIT | \
+			  IOM_BROADCAST)
+#define	IOM_CONCURRENT   (IOM_SPSC | IOM_MPSC)
+/* options which need buf to be a mapping of its own */
+#define	IOM_ALLOC_FLAGS  (IOM_HUGEPAGE | IOM_POPULATE | IOM_NUMA_LOCAL | \
+			  IOM_NUMA_MASK)
+/* iom_notify_fd(): ev_state holds the pending events and */
+#define	IOM_EV_ALL       (IOM_EV_READABLE | IOM_EV_HIGH | IOM_EV_LOW)
+/* the occupancy crossed hi_wm and did not drop to lo_wm since */
+#define	IOM_EV_ABOVE     0x80000000U
+/* iovec entries iom_drain_to_fd() hands to writev() */
+#define	IOM_FD_IOV_MAX         64
 
 union encoder_cookie {
 	uint8_t s[2];
@@ -95,1203 +148,9747 @@ union encoder_cookie {
 	uint16_t l;
 };
 
+/*
+ * IOM_MPSC: set in s[0] while the producer still writes the
+ * payload, which limits the chunk length to 15 bit in this mode
+ */
+#define IOM_COOKIE_BUSY    0x80
+#define IOM_COOKIE_LEN_MAX 0x7fff
+
+/*
+ * IOM_NO_SPLIT: written instead of a cookie if the next chunk does
+ * not fit in front of the end of buf, the chunk starts at 0 then
+ */
+#define IOM_COOKIE_WRAP    0xff
+
+/*
+ * IOM_VARINT: the cookie is replaced by a prefix varint, the leading
+ * one bits of the first byte count the bytes which follow:
+ *
+ *   0xxxxxxx                                 7 bit length
+ *   10xxxxxx xxxxxxxx                       14 bit length
+ *   110xxxxx xxxxxxxx xxxxxxxx              21 bit length
+ *   1110xxxx xxxxxxxx xxxxxxxx xxxxxxxx     28 bit length
+ *
+ * in big endian order. 1111xxxx never starts a header, which keeps
+ * IOM_COOKIE_WRAP unambiguous. A header may be wider than its length
+ * requires - a shortened iom_push_commit() keeps the reserved width.
+ */
+#define IOM_VARINT_LEN_MAX ((1U << 28) - 1)
+
 enum {
 	MODE_SPLITTED,
 	MODE_CONTINUES,
+	MODE_WRAPPED,
 };
 
 
-static unsigned int iom_cnt_int(int head, int tail, unsigned int size)
+/*
+ * Header bytes in front of a payload of len
+ */
+static unsigned int iom_hdr_len(struct iom_buffer *iom_buffer, size_t len)
 {
-	return (head - tail) & (size - 1);
+	if (!(iom_buffer->flags & IOM_VARINT))
+		return sizeof(union encoder_cookie);
+
+	if (len < (1U << 7))
+		return 1;
+	if (len < (1U << 14))
+		return 2;
+	if (len < (1U << 21))
+		return 3;
+	return 4;
 }
 
 
-/**
- * Returns the number of bytes currently occupying iom_buffer
+/*
+ * Largest payload a header can describe
  */
-unsigned int iom_cnt(struct iom_buffer *iom_buffer)
+static size_t iom_len_max(struct iom_buffer *iom_buffer)
 {
-	return iom_cnt_int(iom_buffer->head, iom_buffer->tail, iom_buffer->size);
+	if (iom_buffer->flags & IOM_VARINT)
+		return IOM_VARINT_LEN_MAX;
+	if (iom_buffer->flags & (IOM_MPSC | IOM_NO_SPLIT))
+		return IOM_COOKIE_LEN_MAX;
+	return USHRT_MAX;
 }
 
 
-/**
- * Returns the amount of space left in iom_buffer
+/*
+ * Size buf may reach, IOM_GROW_MAX rings start smaller
  */
-unsigned int iom_space(struct iom_buffer *iom_buffer)
+static size_t iom_cap(struct iom_buffer *iom_buffer)
 {
-	return (iom_buffer->tail - (iom_buffer->head + 1)) & (iom_buffer->size - 1);
+	if (iom_buffer->flags & IOM_GROW_MASK)
+		return (size_t)1 << ((iom_buffer->flags & IOM_GROW_MASK) >> 24);
+	return iom_buffer->size;
 }
 
 
-/**
- * Returns the number of consecutive bytes that can be extracted from
- * the buffer without having to wrap back to the beginning of the buffer.
+/*
+ * Store the header of a payload of len at pos, hdr_len bytes wide
  */
-unsigned int iom_cnt_to_end(struct iom_buffer *iom_buffer)
+static void iom_hdr_put(struct iom_buffer *iom_buffer, int pos, size_t len,
+			unsigned int hdr_len)
 {
-	int n, end = iom_buffer->size - iom_buffer->tail;
-	n = (iom_buffer->head + end) & (iom_buffer->size - 1);
-	return n < end ? n : end;
+	const unsigned int mask = iom_buffer->size - 1;
+	union encoder_cookie cookie;
+	unsigned int i;
+
+	if (!(iom_buffer->flags & IOM_VARINT)) {
+		cookie.l = htons((uint16_t)len);
+		iom_buffer->buf[pos] = cookie.s[0];
+		iom_buffer->buf[(pos + 1) & mask] = cookie.s[1];
+		return;
+	}
+
+	for (i = hdr_len - 1; i > 0; i--, len >>= 8)
+		iom_buffer->buf[(pos + i) & mask] = len & 0xff;
+	/* hdr_len - 1 one bits, a zero bit and the top bits of len */
+	iom_buffer->buf[pos] = ((0xff00 >> (hdr_len - 1)) & 0xff) | len;
 }
 
 
-/**
- * Returns number of chunks in the buffer - not bytes
+/*
+ * Decode the header at pos, returns the payload length
  */
-unsigned int iom_chunks(struct iom_buffer *iom_buffer)
+static unsigned int iom_hdr_get(struct iom_buffer *iom_buffer, int pos,
+				unsigned int *hdr_len)
 {
-	return iom_buffer->chunks;
-}
+	const unsigned int mask = iom_buffer->size - 1;
+	union encoder_cookie cookie;
+	unsigned int len, n, i;
+	uint8_t b;
+
+	if (!(iom_buffer->flags & IOM_VARINT)) {
+		cookie.s[0] = iom_buffer->buf[pos];
+		cookie.s[1] = iom_buffer->buf[(pos + 1) & mask];
+		*hdr_len = sizeof(cookie);
+		return ntohs(cookie.l);
+	}
 
+	b = iom_buffer->buf[pos];
+	n = b < 0x80 ? 1 : b < 0xc0 ? 2 : b < 0xe0 ? 3 : 4;
+	len = b & (0x7f >> (n - 1));
+	for (i = 1; i < n; i++)
+		len = (len << 8) | iom_buffer->buf[(pos + i) & mask];
+	*hdr_len = n;
 
-static int iom_tail_to_end_int(unsigned int size, int tail)
-{
-	return size - tail;
+	return len;
 }
 
 
-static unsigned int iom_tail_to_end(struct iom_buffer *iom_buffer)
-{
-	return (unsigned int)iom_tail_to_end_int(iom_buffer->size, iom_buffer->tail);
-}
+/*
+ * IOM_BROADCAST: readers are cursors in slots, a slot is written by
+ * its reader and read by the producer, which only sets
+ * IOM_CURSOR_GONE to detach one. state 0 is a free slot.
+ */
+#ifndef IOM_CURSOR_MAX
+# define IOM_CURSOR_MAX 16
+#endif
 
+/* attached, the position in the low bits is valid */
+#define	IOM_CURSOR_USED  0x80000000U
+/* taken: detached, or not attached yet */
+#define	IOM_CURSOR_GONE  0x40000000U
+/* IOM_CURSOR_DETACH was given */
+#define	IOM_CURSOR_WEAK  0x20000000U
+#define	IOM_CURSOR_POS   0x1fffffffU
+/* largest ring, positions fit beside the bits above */
+#define	IOM_BCAST_SIZE_MAX (IOM_CURSOR_POS + 1)
+
+struct iom_cursor {
+	unsigned int state __attribute__ ((__aligned__(IOM_CACHELINE_SIZE)));
+	/* reader private */
+	int head_cache;
+	struct iom_buffer *iom_buffer;
+};
 
-static unsigned int iom_space_to_bound(struct iom_buffer *iom_buffer)
-{
-	return iom_buffer->size - iom_buffer->head;
-}
+struct iom_bcast {
+	/* iom_cursor_new() calls under way, tail stands still meanwhile */
+	unsigned int joining;
+	struct iom_cursor cursor[IOM_CURSOR_MAX];
+};
 
 
-/**
- * Returns the amount of consecutive space left in the iom_buffer into which
- * items can be immediately inserted without having to wrap back to the
- * beginning of the buffer.
+/*
+ * IOM_BROADCAST: the attached cursor furthest behind head, NULL if
+ * there is none. tail is set to its position, or head.
  */
-unsigned int iom_space_to_end(struct iom_buffer *iom_buffer)
+static struct iom_cursor *iom_bcast_slowest(struct iom_buffer *iom_buffer,
+					    int *tail)
 {
-	int n, end = iom_buffer->size - 1 - iom_buffer->tail;
-	n = (end + iom_buffer->tail) & (iom_buffer->size - 1);
-	return n < end ? n : end;
+	struct iom_cursor *slow = NULL, *c;
+	unsigned int state, lag, max = 0;
+
+	*tail = iom_buffer->head;
+	for (c = iom_buffer->bcast->cursor;
+	     c < &iom_buffer->bcast->cursor[IOM_CURSOR_MAX]; c++) {
+		state = __atomic_load_n(&c->state, __ATOMIC_ACQUIRE);
+		if ((state & (IOM_CURSOR_USED | IOM_CURSOR_GONE)) != IOM_CURSOR_USED)
+			continue;
+		lag = iom_cnt_int(iom_buffer->head, state & IOM_CURSOR_POS,
+				  iom_buffer->size);
+		if (!slow || lag > max) {
+			slow = c;
+			max = lag;
+			*tail = state & IOM_CURSOR_POS;
+		}
+	}
+
+	return slow;
 }
 
 
-static void iom_head_inc(struct iom_buffer *iom_buffer, int len)
+/*
+ * IOM_BROADCAST: the producer's refresh of tail, which only it
+ * writes in this mode. Space is reclaimed up to the slowest attached
+ * cursor. Cursors created with IOM_CURSOR_DETACH which hold up a
+ * chunk of need bytes are detached instead, slowest first. While a
+ * cursor joins tail stays where it is, see iom_cursor_new().
+ */
+static int iom_bcast_tail(struct iom_buffer *iom_buffer, size_t need)
 {
-	iom_buffer->head = (iom_buffer->head + len) & (iom_buffer->size - 1);
-}
+	struct iom_cursor *slow;
+	unsigned int state;
+	int tail;
+
+	/* order our head store before the read of joining */
+	__atomic_fetch_add(&iom_buffer->pushed, 0, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&iom_buffer->bcast->joining, __ATOMIC_SEQ_CST))
+		return iom_buffer->tail;
+
+	for (;;) {
+		slow = iom_bcast_slowest(iom_buffer, &tail);
+		if (!slow ||
+		    iom_space_int(iom_buffer->head, tail, iom_buffer->size) >= need)
+			break;
+		state = IOM_CURSOR_USED | IOM_CURSOR_WEAK | tail;
+		if (!__atomic_compare_exchange_n(&slow->state, &state,
+						 state | IOM_CURSOR_GONE, 0,
+						 __ATOMIC_SEQ_CST,
+						 __ATOMIC_RELAXED) &&
+		    !(state & IOM_CURSOR_WEAK))
+			break;
+		/* detached or moved on meanwhile, look again */
+	}
 
+	smp_store_release(iom_buffer->tail, tail);
 
-static int iom_tail_inc_int(int tail, unsigned int size, int len)
-{
-	return (tail + len) & (size - 1);
+	return tail;
 }
 
 
-static void iom_tail_inc(struct iom_buffer *iom_buffer, int len)
+/*
+ * Bytes in front of buf in a IOM_MAGIC_RING or IOM_MAINLY_EMPTY
+ * mapping, the header occupies the end of the first page(s) so that
+ * buf is page aligned
+ */
+static size_t iom_map_hdr_size(void)
 {
-	iom_buffer->tail = iom_tail_inc_int(iom_buffer->tail, iom_buffer->size, len);
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	return (offsetof(struct iom_buffer, buf) + page - 1) & ~(page - 1);
 }
 
 
-int iom_continues_chunk_fast(struct iom_buffer *iom_buffer, size_t size)
+/*
+ * IOM_PERSIST: write len bytes of buf from pos back to the file
+ */
+static int iom_file_msync(struct iom_buffer *iom_buffer, unsigned int pos,
+			  unsigned int len)
 {
-	return !!(iom_buffer->size - iom_buffer->head > size);
+	size_t page = sysconf(_SC_PAGESIZE);
+	unsigned int n, start;
+
+	while (len) {
+		n = min(len, iom_buffer->size - pos);
+		start = pos & ~(page - 1);
+		if (msync(&iom_buffer->buf[start], pos + n - start, MS_SYNC))
+			return errno;
+		len -= n;
+		pos = 0;
+	}
+
+	return 0;
 }
 
 
-int iom_init(size_t size, struct iom_buffer **iom_buffer, unsigned flags)
+/*
+ * IOM_PERSIST: write the ring back to its file. Pages reach the disk
+ * in any order, so the chunks pushed since the last sync go first.
+ * Only then head and tail are stored as the synced snapshot and the
+ * header is written: after a power failure the recovery trusts the
+ * chunks of the snapshot and nothing beyond. To be called by the
+ * producer. Also reports the first error of a sync a push triggered
+ * since the last call.
+ */
+int iom_file_sync(struct iom_buffer *iom_buffer)
 {
-	struct iom_buffer *iomb;
+	size_t hdr = iom_map_hdr_size();
+	unsigned int head, prev;
+	int ret;
 
-	assert(size);
-	assert((size & (size - 1)) == 0);
+	assert(iom_buffer->flags & IOM_PERSIST);
+
+	head = iom_buffer->head;
+	prev = iom_buffer->synced >> 32;
+	ret = iom_file_msync(iom_buffer, prev,
+			     iom_cnt_int(head, prev, iom_buffer->size));
+	if (!ret) {
+		__atomic_store_n(&iom_buffer->synced, (unsigned long long)head << 32 |
+				 (unsigned int)smp_load_acquire(iom_buffer->tail),
+				 __ATOMIC_RELEASE);
+		if (msync(iom_buffer->buf - hdr, hdr, MS_SYNC))
+			ret = errno;
+	}
 
-	/*
-	 * Flags are not supported in this version,
-	 * make this API future proof and check flag
-	 * argument
-	 */
-	if (flags != 0)
-		return EINVAL;
+	if (!ret) {
+		ret = iom_buffer->sync_err;
+		iom_buffer->sync_err = 0;
+	}
 
-	if (size == 0)
-		return EINVAL;
+	return ret;
+}
 
-	iomb = malloc(sizeof(*iomb) + size);
-	if (!iomb)
-		return ENOBUFS;
 
-	iomb->tail   = iomb->head = 0;
-	iomb->size   = size;
-	iomb->chunks = 0;
+/*
+ * IOM_PERSIST: tail as far as the producer may reuse the space. The
+ * recovery after a power failure replays from the synced tail, so the
+ * chunks from there on must stay intact until the next sync.
+ */
+static int iom_file_tail(struct iom_buffer *iom_buffer)
+{
+	int ret;
 
-	*iom_buffer = iomb;
+	if ((int)(unsigned int)iom_buffer->synced !=
+	    smp_load_acquire(iom_buffer->tail)) {
+		ret = iom_file_sync(iom_buffer);
+		if (ret && !iom_buffer->sync_err)
+			iom_buffer->sync_err = ret;
+	}
 
-	return 0;
+	return (unsigned int)iom_buffer->synced;
 }
 
 
-void iom_reset(struct iom_buffer *iom_buffer)
+/*
+ * Producer view of the free space. The consumer index is only
+ * fetched if the cached copy cannot satisfy need bytes.
+ */
+static unsigned int iom_prod_space(struct iom_buffer *iom_buffer, size_t need)
 {
-	iom_buffer->chunks = 0;
-	iom_buffer->tail = iom_buffer->head = 0;
+	unsigned int space;
+
+	space = iom_space_int(iom_buffer->head, iom_buffer->tail_cache,
+			      iom_buffer->size);
+	if (space >= need)
+		return space;
+
+	if (iom_buffer->flags & IOM_BROADCAST)
+		iom_buffer->tail_cache = iom_bcast_tail(iom_buffer, need);
+	else if (iom_buffer->flags & IOM_PERSIST)
+		iom_buffer->tail_cache = iom_file_tail(iom_buffer);
+	else
+		iom_buffer->tail_cache = smp_load_acquire(iom_buffer->tail);
+	return iom_space_int(iom_buffer->head, iom_buffer->tail_cache,
+			     iom_buffer->size);
 }
 
 
-void iom_reset_secure(struct iom_buffer *iom_buffer)
+/*
+ * IOM_NOTIFY: add events to ev_state. Coalesced, only the first
+ * event pending since the last iom_notify_read() moves the counter.
+ */
+static void iom_notify_post(struct iom_buffer *iom_buffer, unsigned int old)
 {
-	iom_reset(iom_buffer);
-	memset(iom_buffer->buf, 0, iom_buffer->size);
+	uint64_t one = 1;
+
+	if (!(old & IOM_EV_ALL))
+		(void) !write(iom_buffer->evfd, &one, sizeof(one));
 }
 
 
-void iom_free(struct iom_buffer *iom_buffer)
+/*
+ * IOM_NOTIFY: flip IOM_EV_ABOVE if the occupancy crossed a
+ * watermark. The event replaces a pending one of the other
+ * direction, so the reader always learns the latest crossing.
+ * Producer and consumer both get here while the other side moves
+ * its index, after a flip the count is taken again: whoever flips
+ * last sees the final count and the state cannot get stuck.
+ */
+static void iom_notify_level(struct iom_buffer *iom_buffer)
 {
-	assert(iom_buffer);
-	free(iom_buffer);
+	unsigned int cnt, state, new;
+
+	if (!iom_buffer->hi_wm)
+		return;
+
+	for (;;) {
+		cnt = iom_cnt_int(smp_load_acquire(iom_buffer->head),
+				  smp_load_acquire(iom_buffer->tail),
+				  iom_buffer->size);
+		state = __atomic_load_n(&iom_buffer->ev_state, __ATOMIC_RELAXED);
+		if (!(state & IOM_EV_ABOVE) && cnt > iom_buffer->hi_wm)
+			new = (state & ~IOM_EV_LOW) | IOM_EV_ABOVE | IOM_EV_HIGH;
+		else if ((state & IOM_EV_ABOVE) && cnt <= iom_buffer->lo_wm)
+			new = (state & ~(IOM_EV_ABOVE | IOM_EV_HIGH)) | IOM_EV_LOW;
+		else
+			return;
+		if (__atomic_compare_exchange_n(&iom_buffer->ev_state, &state,
+						new, 0, __ATOMIC_SEQ_CST,
+						__ATOMIC_RELAXED))
+			iom_notify_post(iom_buffer, state);
+	}
 }
 
 
-static int push_mode(struct iom_buffer *iom_buffer, int len)
+/*
+ * IOM_NOTIFY: called after head moved on from prev. Like in
+ * iom_wake() the read-modify-write orders our head store before
+ * the read of tail, the consumer does the same in
+ * iom_notify_empty(). So a consumer which found the ring empty has
+ * its tail seen here and the empty to non-empty edge is not lost.
+ */
+static void iom_notify_head(struct iom_buffer *iom_buffer, int prev)
 {
-	int byte_till_end = iom_space_to_bound(iom_buffer) + 1;
+	unsigned int state;
+	int tail;
+
+	if (iom_buffer->flags & IOM_CONCURRENT)
+		__atomic_fetch_add(&iom_buffer->pushed, 0, __ATOMIC_SEQ_CST);
 
-	if (len + (int)sizeof(union encoder_cookie) > byte_till_end)
-		return MODE_SPLITTED;
+	tail = smp_load_acquire(iom_buffer->tail);
+	if (tail == prev) {
+		state = __atomic_fetch_or(&iom_buffer->ev_state,
+					  IOM_EV_READABLE, __ATOMIC_SEQ_CST);
+		iom_notify_post(iom_buffer, state);
+	}
 
-	return MODE_CONTINUES;
+	/* only a rise above hi_wm may flip the level here */
+	if (iom_buffer->hi_wm &&
+	    !(__atomic_load_n(&iom_buffer->ev_state, __ATOMIC_RELAXED) &
+	      IOM_EV_ABOVE) &&
+	    iom_cnt_int(smp_load_acquire(iom_buffer->head), tail,
+			iom_buffer->size) > iom_buffer->hi_wm)
+		iom_notify_level(iom_buffer);
 }
 
 
-static __always_inline void iom_add_fast(struct iom_buffer *iom_buffer,
-		                         unsigned char *buf, int len)
+/*
+ * IOM_NOTIFY: called after tail moved on. Only a drop to lo_wm may
+ * flip the level here, which head_cache rules out cheaply: head only
+ * moves on, the real count is at least the cached one. A consumer
+ * which misses a fresh IOM_EV_ABOVE catches up in iom_notify_empty()
+ * at the latest.
+ */
+static void iom_notify_tail(struct iom_buffer *iom_buffer)
 {
-	union encoder_cookie cookie;
-	cookie.l = htons((short)len);
+	if (!(__atomic_load_n(&iom_buffer->ev_state, __ATOMIC_RELAXED) &
+	      IOM_EV_ABOVE) ||
+	    iom_cnt_int(iom_buffer->head_cache, iom_buffer->tail,
+			iom_buffer->size) > iom_buffer->lo_wm)
+		return;
+
+	if (iom_buffer->flags & IOM_CONCURRENT)
+		__atomic_fetch_add(&iom_buffer->shifted, 0, __ATOMIC_SEQ_CST);
 
-	iom_buffer->buf[iom_buffer->head] = cookie.s[0];
-	iom_buffer->buf[iom_buffer->head + 1] = cookie.s[1];
-	memcpy(&iom_buffer->buf[iom_buffer->head + 2], buf, len);
-	iom_head_inc(iom_buffer, len + 2);
+	iom_notify_level(iom_buffer);
 }
 
 
-static void iom_add_slow(struct iom_buffer *iom_buffer,
-		         unsigned char *buf, int len)
+/*
+ * IOM_NOTIFY: the consumer found the ring empty by its cached head
+ * and reads the real one next. The read-modify-write pairs with the
+ * one in iom_notify_head(): either the producer sees our tail and
+ * posts IOM_EV_READABLE, or we see its head.
+ */
+static void iom_notify_empty(struct iom_buffer *iom_buffer)
 {
-	union encoder_cookie cookie;
-	int byte_till_end, remaining;
-
-	cookie.l = htons((short)len);
-	byte_till_end = iom_space_to_bound(iom_buffer);
-
-	switch (byte_till_end) {
-	case 0:
-		iom_buffer->buf[0] = cookie.s[0];
-		iom_buffer->buf[1] = cookie.s[1];
-		memcpy(&iom_buffer->buf[2], buf, len);
-		break;
-	case 1:
-		iom_buffer->buf[iom_buffer->head] = cookie.s[0];
-		iom_buffer->buf[0]                = cookie.s[1];
-		memcpy(&iom_buffer->buf[1], buf, len);
-		break;
-	case 2:
-		iom_buffer->buf[iom_buffer->head]     = cookie.s[0];
-		iom_buffer->buf[iom_buffer->head + 1] = cookie.s[1];
-		memcpy(&iom_buffer->buf[0], buf, len);
-		break;
-	default:
-		iom_buffer->buf[iom_buffer->head]     = cookie.s[0];
-		iom_buffer->buf[iom_buffer->head + 1] = cookie.s[1];
-		remaining = (byte_till_end - sizeof(cookie));
-		memcpy(&iom_buffer->buf[iom_buffer->head + 2], buf, remaining);
-		memcpy(&iom_buffer->buf[0], &buf[remaining], len - remaining);
-		break;
-	}
+	if (iom_buffer->flags & IOM_CONCURRENT)
+		__atomic_fetch_add(&iom_buffer->shifted, 0, __ATOMIC_SEQ_CST);
 
-	iom_head_inc(iom_buffer, len + sizeof(cookie));
+	iom_notify_level(iom_buffer);
 }
 
 
-static void purge_next(struct iom_buffer *iom_buffer)
+/*
+ * Consumer view of the occupied bytes. The producer index is only
+ * fetched if the cached copy says the buffer is empty.
+ */
+static unsigned int iom_cons_cnt(struct iom_buffer *iom_buffer)
 {
-	union encoder_cookie cookie;
-	unsigned int tail_to_end;
-	int encoded_len;
-	size_t sc = sizeof(union encoder_cookie);
+	unsigned int cnt;
 
-	tail_to_end = iom_tail_to_end(iom_buffer);
-	switch (tail_to_end) {
-	case 1:
-		cookie.s[0] = iom_buffer->buf[iom_buffer->tail];
-		cookie.s[1] = iom_buffer->buf[0];
-		encoded_len = ntohs(cookie.l);
-		break;
-	case 2:
-		cookie.s[0] = iom_buffer->buf[iom_buffer->tail];
-		cookie.s[1] = iom_buffer->buf[iom_buffer->tail + 1];
-		encoded_len = ntohs(cookie.l);
-		break;
-	default:
-		cookie.s[0] = iom_buffer->buf[iom_buffer->tail];
-		cookie.s[1] = iom_buffer->buf[iom_buffer->tail + 1];
-		encoded_len = ntohs(cookie.l);
-		break;
-	}
+	/* no consumer besides the cursors */
+	if (iom_buffer->flags & IOM_BROADCAST)
+		return 0;
+
+	cnt = iom_cnt_int(iom_buffer->head_cache, iom_buffer->tail,
+			  iom_buffer->size);
+	if (cnt)
+		return cnt;
+
+	if (iom_buffer->flags & IOM_NOTIFY)
+		iom_notify_empty(iom_buffer);
 
-	iom_tail_inc(iom_buffer, encoded_len + sc);
+	iom_buffer->head_cache = smp_load_acquire(iom_buffer->head);
+	return iom_cnt_int(iom_buffer->head_cache, iom_buffer->tail,
+			   iom_buffer->size);
 }
 
 
-static int enforce_buf_policy(struct iom_buffer *iom_buffer,
-		              size_t len, int flags)
+/**
+ * Returns the number of consecutive bytes that can be extracted from
+ * the buffer without having to wrap back to the beginning of the buffer.
+ */
+unsigned int iom_cnt_to_end(struct iom_buffer *iom_buffer)
 {
-	const size_t sc = sizeof(union encoder_cookie);
+	int n, end = iom_buffer->size - iom_buffer->tail;
+	n = (iom_buffer->head + end) & (iom_buffer->size - 1);
+	return n < end ? n : end;
+}
 
-	switch (flags) {
-	case IOM_TAIL_DROP:
-		if (iom_space(iom_buffer) < len + sc)
-			return ENOBUFS;
-		break;
-	case IOM_HEAD_DROP:
-		while (iom_space(iom_buffer) < len + sc) {
-			purge_next(iom_buffer);
-			iom_buffer->chunks--;
-		};
-		break;
-	case IOM_DROP_ALL:
-		iom_buffer->tail = iom_buffer->head = 0;
-		break;
-	default:
-		return ENOTSUP;
-		break;
-	}
 
-	return 0;
+static int iom_tail_to_end_int(unsigned int size, int tail)
+{
+	return size - tail;
 }
 
 
-int iom_push(struct iom_buffer *iom_buffer, unsigned char *buf,
-	     size_t len, int flags)
+static unsigned int iom_space_to_bound(struct iom_buffer *iom_buffer, int head)
 {
-	int ret;
-	const size_t sc = sizeof(union encoder_cookie);
-
-	assert(iom_buffer);
+	return iom_buffer->size - head;
+}
 
-	if (iom_buffer->size < len + sc)
-		return EINVAL;
 
-	ret = enforce_buf_policy(iom_buffer, len, flags);
-	if (ret) /* failure or out of memory */
-		return ret;
+/**
+ * Returns the amount of consecutive space left in the iom_buffer into which
+ * items can be immediately inserted without having to wrap back to the
+ * beginning of the buffer.
+ */
+unsigned int iom_space_to_end(struct iom_buffer *iom_buffer)
+{
+	int n, end = iom_buffer->size - 1 - iom_buffer->tail;
+	n = (end + iom_buffer->tail) & (iom_buffer->size - 1);
+	return n < end ? n : end;
+}
 
-	switch (push_mode(iom_buffer, len + sc)) {
-	case MODE_CONTINUES:
-		iom_add_fast(iom_buffer, buf, len);
-		break;
-	case MODE_SPLITTED:
-		iom_add_slow(iom_buffer, buf, len);
-		break;
-	default:
-		assert(0);
-		break;
-	}
 
-	iom_buffer->chunks++;
+/*
+ * IOM_WAIT: futex on the head or tail word, process private unless
+ * the buffer is shared with other processes
+ */
+static long iom_futex(struct iom_buffer *iom_buffer, int *word, int op,
+		      int val, const struct timespec *timeout)
+{
+	if (!(iom_buffer->flags & IOM_SHARED))
+		op |= FUTEX_PRIVATE_FLAG;
 
-	return 0;
+	return syscall(SYS_futex, word, op, val, timeout, NULL, 0);
 }
 
+
 /*
- * If ring is empty iom_shift return EINVAL, arguments are untouched.
+ * IOM_WAIT: wake everybody parked on word
  */
-int iom_shift(struct iom_buffer *iom_buffer, unsigned char *buf,
-	      unsigned int *buf_len, unsigned int max_size)
+void iom_wake_slow(struct iom_buffer *iom_buffer, int *word)
 {
-	unsigned int tail_to_end;
-	unsigned int encoded_len;
-	int remaining;
-	union encoder_cookie cookie;
-	size_t sc = sizeof(union encoder_cookie);
+	iom_futex(iom_buffer, word, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+
+/*
+ * IOM_WAIT: called after word was published. A waiter increments
+ * waiters before it checks word one last time. Both sides use a
+ * seq_cst read-modify-write on waiters, so either the waiter sees the
+ * new word or we see the waiter - the syscall is only made in the
+ * latter case. The inline paths in iomalloc.h do the same.
+ */
+static void iom_wake(struct iom_buffer *iom_buffer, int *word,
+		     unsigned int *waiters)
+{
+	if (__atomic_fetch_add(waiters, 0, __ATOMIC_SEQ_CST))
+		iom_wake_slow(iom_buffer, word);
+}
+
+
+/*
+ * Publish chunks written up to head to the consumer
+ */
+static void iom_head_publish(struct iom_buffer *iom_buffer, int head,
+			     unsigned int chunks)
+{
+	int prev = iom_buffer->head, ret;
+
+	if (iom_buffer->flags & IOM_MAINLY_EMPTY) {
+		if (head < iom_buffer->head)
+			iom_buffer->hiwat = iom_buffer->size;
+		else if ((unsigned int)head > iom_buffer->hiwat)
+			iom_buffer->hiwat = head;
+	}
+
+	WRITE_ONCE(iom_buffer->pushed, iom_buffer->pushed + chunks);
+	smp_store_release(iom_buffer->head, head);
+	if (iom_buffer->flags & IOM_WAIT)
+		iom_wake(iom_buffer, &iom_buffer->head, &iom_buffer->rd_waiters);
+	if (iom_buffer->flags & IOM_NOTIFY)
+		iom_notify_head(iom_buffer, prev);
+
+	/* batch msync() calls, an error waits for iom_file_sync() */
+	if (iom_buffer->flags & IOM_PERSIST) {
+		iom_buffer->unsynced += iom_cnt_int(head, prev, iom_buffer->size);
+		if (iom_buffer->sync_bytes &&
+		    iom_buffer->unsynced >= iom_buffer->sync_bytes) {
+			iom_buffer->unsynced = 0;
+			ret = iom_file_sync(iom_buffer);
+			if (ret && !iom_buffer->sync_err)
+				iom_buffer->sync_err = ret;
+		}
+	}
+}
+
+
+static int iom_tail_inc_int(int tail, unsigned int size, int len)
+{
+	return (tail + len) & (size - 1);
+}
+
+
+/*
+ * Hand chunks up to tail back to the producer
+ */
+static void iom_tail_publish(struct iom_buffer *iom_buffer, int tail,
+			     unsigned int chunks)
+{
+	smp_store_release(iom_buffer->shifted, iom_buffer->shifted + chunks);
+	smp_store_release(iom_buffer->tail, tail);
+	if (iom_buffer->flags & IOM_WAIT)
+		iom_wake(iom_buffer, &iom_buffer->tail, &iom_buffer->wr_waiters);
+	if (iom_buffer->flags & IOM_NOTIFY)
+		iom_notify_tail(iom_buffer);
+}
+
+
+/*
+ * Hand len bytes (and one chunk) at tail back to the producer
+ */
+static void iom_tail_inc(struct iom_buffer *iom_buffer, int len)
+{
+	iom_tail_publish(iom_buffer,
+			 iom_tail_inc_int(iom_buffer->tail, iom_buffer->size, len),
+			 1);
+}
+
+
+int iom_continues_chunk_fast(struct iom_buffer *iom_buffer, size_t size)
+{
+	return !!(iom_buffer->size - iom_buffer->head > size);
+}
+
+
+/*
+ * Length of a mapping holding header and buf, IOM_MAGIC_RING
+ * mappings add the mirror of buf on top
+ */
+static size_t iom_map_len(size_t size, unsigned flags)
+{
+	size_t len;
+
+	/* IOM_GROW_MAX: address space for the largest size up front */
+	if (flags & IOM_GROW_MASK)
+		size = (size_t)1 << ((flags & IOM_GROW_MASK) >> 24);
+
+	len = iom_map_hdr_size() + size;
+
+	if (flags & IOM_HUGEPAGE)
+		len = (len + IOM_HUGEPAGE_SIZE - 1) & ~(IOM_HUGEPAGE_SIZE - 1);
+
+	return len;
+}
+
+
+/*
+ * Node the memory of a mapping should come from, -1 for the default
+ * policy
+ */
+static int iom_map_node(unsigned flags)
+{
+	unsigned int cpu, node;
+
+	if (flags & IOM_NUMA_MASK)
+		return ((flags & IOM_NUMA_MASK) >> 16) - 1;
+
+	if ((flags & IOM_NUMA_LOCAL) &&
+	    syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+		return node;
+
+	return -1;
+}
+
+
+/*
+ * Apply the IOM_ALLOC_FLAGS to a fresh mapping before anything
+ * touched it. All of them are hints: without transparent huge
+ * pages, NUMA support or a valid node the mapping stays as it is.
+ */
+static void iom_map_advise(void *addr, size_t len, unsigned flags)
+{
+	unsigned long mask[4] = { 0 };
+	size_t page = sysconf(_SC_PAGESIZE), off;
+	int node = iom_map_node(flags);
+
+#ifdef MADV_HUGEPAGE
+	if (flags & IOM_HUGEPAGE)
+		madvise(addr, len, MADV_HUGEPAGE);
+#endif
+
+	if (node >= 0 && (unsigned)node < BITSIZEOF(mask)) {
+		mask[node / BITSIZEOF(mask[0])] |= 1UL << (node % BITSIZEOF(mask[0]));
+		/* preferred, not bound: a full node must not fail a fault */
+		syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask,
+			BITSIZEOF(mask) + 1, 0);
+	}
+
+	if (!(flags & IOM_POPULATE))
+		return;
+
+#ifdef MADV_POPULATE_WRITE
+	if (madvise(addr, len, MADV_POPULATE_WRITE) == 0)
+		return;
+#endif
+	/* before Linux 5.14 */
+	for (off = 0; off < len; off += page)
+		((volatile unsigned char *)addr)[off] = 0;
+}
+
+
+/*
+ * Shared mapping of header + size bytes of fd, with IOM_MAGIC_RING
+ * the ring part is mapped a second time directly behind it
+ */
+static int iom_fd_map(int fd, size_t size, unsigned flags,
+		      struct iom_buffer **iom_buffer)
+{
+	size_t hdr = iom_map_hdr_size();
+	size_t len = hdr + size;
+	unsigned char *base, *p;
+
+	if (flags & IOM_MAGIC_RING)
+		len += size;
+
+	/* reserve the whole range, then replace it piece by piece */
+	base = mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return ENOBUFS;
+
+	p = mmap(base, hdr + size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, fd, 0);
+	if (p != MAP_FAILED && (flags & IOM_MAGIC_RING))
+		p = mmap(base + hdr + size, size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_FIXED, fd, hdr);
+	if (p == MAP_FAILED) {
+		munmap(base, len);
+		return ENOBUFS;
+	}
+
+	*iom_buffer = (struct iom_buffer *)
+		(base + hdr - offsetof(struct iom_buffer, buf));
+
+	return 0;
+}
+
+
+/*
+ * Map a memfd of header + size bytes and then the ring part a second
+ * time directly behind it:
+ *
+ *   [ hdr | buf (size) | buf mirror (size) ]
+ */
+static int iom_magic_alloc(size_t size, struct iom_buffer **iom_buffer,
+			   unsigned flags)
+{
+	size_t hdr = iom_map_hdr_size();
+	int fd, ret = 0;
+
+	if (size & ((size_t)sysconf(_SC_PAGESIZE) - 1))
+		return EINVAL;
+
+	fd = memfd_create("iomalloc", MFD_CLOEXEC);
+	if (fd < 0)
+		return errno;
+
+	if (ftruncate(fd, hdr + size)) {
+		ret = errno;
+		goto out;
+	}
+
+	ret = iom_fd_map(fd, size, flags, iom_buffer);
+	if (ret)
+		goto out;
+
+	/* the mirror shares the pages, advising the first mapping does */
+	iom_map_advise((*iom_buffer)->buf - hdr, hdr + size, flags);
+out:
+	close(fd);
+	return ret;
+}
+
+
+/*
+ * Anonymous mapping of header + buf for IOM_MAINLY_EMPTY and the
+ * IOM_ALLOC_FLAGS. IOM_MAINLY_EMPTY and IOM_GROW_MAX only reserve
+ * address space, pages are committed by the kernel when head first
+ * touches them.
+ * IOM_HUGEPAGE tries reserved huge pages first and falls back to
+ * transparent ones. Without a NUMA node to prefer IOM_POPULATE
+ * leaves the prefaulting to mmap().
+ */
+static int iom_map_alloc(size_t size, struct iom_buffer **iom_buffer,
+			 unsigned flags)
+{
+	size_t hdr = iom_map_hdr_size(), len = iom_map_len(size, flags);
+	int mflags = MAP_PRIVATE | MAP_ANONYMOUS;
+	unsigned char *base = MAP_FAILED;
+
+	if (flags & (IOM_MAINLY_EMPTY | IOM_GROW_MASK))
+		mflags |= MAP_NORESERVE;
+
+	if ((flags & IOM_POPULATE) && iom_map_node(flags) < 0) {
+		mflags |= MAP_POPULATE;
+		flags &= ~IOM_POPULATE;
+	}
+
+#ifdef MAP_HUGETLB
+	if (flags & IOM_HUGEPAGE) {
+		base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			    mflags | MAP_HUGETLB, -1, 0);
+		if (base != MAP_FAILED)
+			flags &= ~IOM_HUGEPAGE;
+	}
+#endif
+	if (base == MAP_FAILED)
+		base = mmap(NULL, len, PROT_READ | PROT_WRITE, mflags, -1, 0);
+	if (base == MAP_FAILED)
+		return ENOBUFS;
+
+	iom_map_advise(base, len, flags);
+
+	*iom_buffer = (struct iom_buffer *)
+		(base + hdr - offsetof(struct iom_buffer, buf));
+
+	return 0;
+}
+
+
+/*
+ * IOM_MAINLY_EMPTY: give the pages of an empty buffer back, except
+ * for the first IOM_RECLAIM_KEEP bytes. Small bursts never leave
+ * them - the buffer restarts at 0 whenever it runs empty - so they
+ * do not cost a system call.
+ */
+static void iom_reclaim(struct iom_buffer *iom_buffer)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t keep = (IOM_RECLAIM_KEEP + page - 1) & ~(page - 1);
+	size_t end = (iom_buffer->hiwat + page - 1) & ~(page - 1);
+
+	if (end <= keep)
+		return;
+
+	madvise(&iom_buffer->buf[keep], end - keep, IOM_RECLAIM_ADVICE);
+	iom_buffer->hiwat = keep;
+}
+
+
+void iom_reset(struct iom_buffer *iom_buffer)
+{
+	iom_buffer->pushed = iom_buffer->shifted = 0;
+	iom_buffer->resv = 0;
+	iom_buffer->fill_pend = iom_buffer->drain_off = 0;
+	iom_buffer->push_pend = 0;
+	iom_buffer->tail = iom_buffer->head = 0;
+	iom_buffer->tail_cache = iom_buffer->head_cache = 0;
+	iom_buffer->unsynced = 0;
+	if (iom_buffer->flags & IOM_NOTIFY)
+		iom_notify_level(iom_buffer);
+
+	/* the old snapshot must not be replayed over the new chunks */
+	if (iom_buffer->flags & IOM_PERSIST) {
+		iom_buffer->synced = 0;
+		if (msync(iom_buffer->buf - iom_map_hdr_size(),
+			  iom_map_hdr_size(), MS_SYNC) && !iom_buffer->sync_err)
+			iom_buffer->sync_err = errno;
+	}
+}
+
+
+/*
+ * IOM_SPSC: one producer thread (iom_push) and one consumer
+ * thread (iom_shift, iom_peek, iom_peek_update, iterators) may
+ * operate concurrently without any further locking. The producer
+ * cannot touch tail in this mode, so only IOM_TAIL_DROP is
+ * supported. iom_reset() is not synchronized and requires both
+ * sides to be quiescent.
+ *
+ * IOM_MPSC: like IOM_SPSC, but any number of threads may call
+ * iom_push() concurrently. Chunks are limited to IOM_COOKIE_LEN_MAX
+ * bytes. Readers return EAGAIN if the oldest chunk is not yet
+ * completely written by its producer.
+ *
+ * IOM_BROADCAST: with IOM_SPSC, several readers each see every chunk.
+ * They read through cursors (iom_cursor_new()) at their own pace,
+ * space is reclaimed behind the slowest one. iom_shift() and the
+ * other consumer calls find the ring empty, iom_chunks() counts all
+ * chunks ever pushed. Up to IOM_BCAST_SIZE_MAX bytes, not in shared
+ * memory or an iom_pool.
+ *
+ * IOM_MAGIC_RING: buf is followed by a second mapping of the same
+ * memory, so every chunk is contiguous in virtual memory and never
+ * split. size must be a multiple of the page size.
+ *
+ * IOM_NO_SPLIT: portable alternative to IOM_MAGIC_RING. A chunk
+ * which does not fit in front of the end of buf is stored at the
+ * start of buf, the bytes in between stay unused until the consumer
+ * passed them. Chunks are limited to IOM_COOKIE_LEN_MAX bytes, not
+ * available together with IOM_MPSC.
+ *
+ * IOM_VARINT: the 2 byte cookie in front of each chunk becomes a 1
+ * to 4 byte varint, chunks up to 127 bytes carry a single header
+ * byte and chunks up to IOM_VARINT_LEN_MAX are possible. Without it
+ * chunks are limited to 65535 bytes. Not available together with
+ * IOM_MPSC.
+ *
+ * IOM_MAINLY_EMPTY: buf is only reserved address space, pages are
+ * committed as head first reaches them. Whenever the buffer runs
+ * empty all but the first IOM_RECLAIM_KEEP bytes are given back to
+ * the kernel, so resident memory follows the occupancy. Reclaim
+ * happens at the reset to 0, i.e. not in the concurrent modes. Not
+ * available together with IOM_MAGIC_RING.
+ *
+ * IOM_HUGEPAGE: back buf by huge pages to save TLB misses on large
+ * rings. Reserved huge pages (MAP_HUGETLB) are used if there are
+ * any, transparent huge pages are requested otherwise. With
+ * IOM_MAGIC_RING only the latter, for shmem.
+ *
+ * IOM_POPULATE: fault in all of buf during iom_init() instead of on
+ * first touch in the hot path.
+ *
+ * IOM_NUMA_NODE(n), IOM_NUMA_LOCAL: prefer memory of node n or of
+ * the node the calling thread runs on. Combine with IOM_POPULATE
+ * when the consumer thread is not the one touching buf first.
+ *
+ * The last three are hints and silently degrade on systems without
+ * huge pages or NUMA. None of them is available together with
+ * IOM_MAINLY_EMPTY, except the NUMA ones.
+ *
+ * IOM_GROW_MAX(shift): reserve address space for 2^shift bytes and
+ * let a push which does not fit double size (see iom_resize())
+ * instead of dropping, as long as it stays within 2^shift. Memory is
+ * committed as with IOM_MAINLY_EMPTY. Not available in the
+ * concurrent modes, with IOM_MAGIC_RING and with IOM_POPULATE.
+ */
+static int iom_check_flags(unsigned flags)
+{
+	/*
+	 * make this API future proof and check flag
+	 * argument
+	 */
+	if (flags & ~IOM_INIT_FLAGS)
+		return EINVAL;
+
+	if ((flags & IOM_CONCURRENT) == IOM_CONCURRENT)
+		return EINVAL;
+
+	if ((flags & IOM_NO_SPLIT) && (flags & (IOM_MPSC | IOM_MAGIC_RING)))
+		return EINVAL;
+
+	/* the busy flag lives in the first cookie byte */
+	if ((flags & IOM_VARINT) && (flags & IOM_MPSC))
+		return EINVAL;
+
+	if ((flags & IOM_MAINLY_EMPTY) && (flags & IOM_MAGIC_RING))
+		return EINVAL;
+
+	/* would commit what IOM_MAINLY_EMPTY tries to keep uncommitted */
+	if ((flags & IOM_MAINLY_EMPTY) && (flags & (IOM_HUGEPAGE | IOM_POPULATE)))
+		return EINVAL;
+
+	if ((flags & IOM_NUMA_LOCAL) && (flags & IOM_NUMA_MASK))
+		return EINVAL;
+
+	/* the consumer reads size, a grown ring has no mirror */
+	if ((flags & IOM_GROW_MASK) &&
+	    (flags & (IOM_CONCURRENT | IOM_MAGIC_RING | IOM_POPULATE)))
+		return EINVAL;
+
+	if ((flags & IOM_GROW_MASK) > IOM_GROW_MAX(30))
+		return EINVAL;
+
+	/* nobody to wait for in a single thread */
+	if ((flags & IOM_WAIT) && !(flags & IOM_CONCURRENT))
+		return EINVAL;
+
+	/* one producer, tail belongs to it; readers do not wait on it */
+	if ((flags & IOM_BROADCAST) &&
+	    ((flags & IOM_CONCURRENT) != IOM_SPSC || (flags & IOM_WAIT)))
+		return EINVAL;
+
+	return 0;
+}
+
+
+static void iom_setup(struct iom_buffer *iomb, size_t size, unsigned flags)
+{
+	iomb->size  = size;
+	iomb->flags = flags;
+	iomb->hiwat = 0;
+	iomb->sync_bytes = 0;
+	iomb->rd_waiters = iomb->wr_waiters = 0;
+	iomb->evfd = -1;
+	iomb->lo_wm = iomb->hi_wm = iomb->ev_state = 0;
+	iomb->bcast = NULL;
+	iom_reset(iomb);
+}
+
+
+int iom_init(size_t size, struct iom_buffer **iom_buffer, unsigned flags)
+{
+	struct iom_buffer *iomb = NULL;
+	int ret;
+
+	assert(size);
+	assert((size & (size - 1)) == 0);
+
+	ret = iom_check_flags(flags);
+	if (ret)
+		return ret;
+
+	if (size == 0)
+		return EINVAL;
+
+	if ((flags & IOM_GROW_MASK) && size > (1UL << ((flags & IOM_GROW_MASK) >> 24)))
+		return EINVAL;
+
+	if ((flags & IOM_BROADCAST) && size > IOM_BCAST_SIZE_MAX)
+		return EINVAL;
+
+	if (flags & IOM_MAGIC_RING) {
+		ret = iom_magic_alloc(size, &iomb, flags);
+		if (ret)
+			return ret;
+	} else if (flags & (IOM_MAINLY_EMPTY | IOM_ALLOC_FLAGS | IOM_GROW_MASK)) {
+		ret = iom_map_alloc(size, &iomb, flags);
+		if (ret)
+			return ret;
+	} else if (posix_memalign((void **)&iomb, IOM_CACHELINE_SIZE,
+				  sizeof(*iomb) + size)) {
+		return ENOBUFS;
+	}
+
+	iom_setup(iomb, size, flags);
+
+	if (flags & IOM_BROADCAST) {
+		if (posix_memalign((void **)&iomb->bcast, IOM_CACHELINE_SIZE,
+				   sizeof(*iomb->bcast))) {
+			iom_free(iomb);
+			return ENOBUFS;
+		}
+		memset(iomb->bcast, 0, sizeof(*iomb->bcast));
+	}
+
+	*iom_buffer = iomb;
+
+	return 0;
+}
+
+
+void iom_reset_secure(struct iom_buffer *iom_buffer)
+{
+	iom_reset(iom_buffer);
+
+	/* private anonymous pages read back as zero, without committing */
+	if (iom_buffer->flags & IOM_MAINLY_EMPTY) {
+		madvise(iom_buffer->buf, iom_buffer->size, MADV_DONTNEED);
+		iom_buffer->hiwat = 0;
+		return;
+	}
+
+	memset(iom_buffer->buf, 0, iom_buffer->size);
+}
+
+
+void iom_free(struct iom_buffer *iom_buffer)
+{
+	size_t hdr;
 
 	assert(iom_buffer);
-	assert(max_size);
-	assert(buf_len);
+	/* pool rings go back with iom_pool_put() */
+	assert(!(iom_buffer->flags & IOM_POOLED));
+
+	if (iom_buffer->flags & IOM_NOTIFY)
+		close(iom_buffer->evfd);
+
+	free(iom_buffer->bcast);
+
+	if (iom_buffer->flags & IOM_PERSIST)
+		iom_file_sync(iom_buffer);
+
+	if (iom_buffer->flags & IOM_MAGIC_RING) {
+		hdr = iom_map_hdr_size();
+		munmap(iom_buffer->buf - hdr, hdr + 2 * iom_buffer->size);
+		return;
+	}
+
+	if (iom_buffer->flags & IOM_SHARED) {
+		hdr = iom_map_hdr_size();
+		munmap(iom_buffer->buf - hdr, hdr + iom_buffer->size);
+		return;
+	}
+
+	if (iom_buffer->flags & (IOM_MAINLY_EMPTY | IOM_ALLOC_FLAGS | IOM_GROW_MASK)) {
+		hdr = iom_map_hdr_size();
+		munmap(iom_buffer->buf - hdr,
+		       iom_map_len(iom_buffer->size, iom_buffer->flags));
+		return;
+	}
+
+	free(iom_buffer);
+}
+
+
+/*
+ * Cross process rings: header and buf live in a POSIX shared memory
+ * object (or a memfd shared by fork()), laid out as
+ *
+ *   [ iom_shm_hdr ... struct iom_buffer | buf (size) ]
+ *
+ * struct iom_buffer holds no pointers, only indices into buf, so it
+ * is valid at whatever address each process maps it. The index
+ * protocol of IOM_SPSC and IOM_MPSC is lock free and works between
+ * processes as between threads, one of them is always set.
+ */
+#define	IOM_SHM_MAGIC    0x494f4d52	/* "IOMR" */
+#define	IOM_FILE_MAGIC   0x494f4d46	/* "IOMF" */
+#define	IOM_SHM_VERSION  3
+
+struct iom_shm_hdr {
+	/* written last, attach fails with EAGAIN until it is set */
+	uint32_t magic;
+	uint32_t version;
+	/* ABI of the creator, must match the one of every peer */
+	uint32_t map_hdr_size;
+	uint32_t buf_off;
+	/* IOM_PERSIST: the boot the ring was last opened in */
+	char boot_id[40];
+};
+
+
+static struct iom_shm_hdr *iom_shm_hdr(struct iom_buffer *iom_buffer)
+{
+	return (struct iom_shm_hdr *)(iom_buffer->buf - iom_map_hdr_size());
+}
+
+
+/*
+ * iom_shm_create() creates a ring in the shared memory object name
+ * (see shm_open(3), e.g. "/capture"), which must not exist yet.
+ * Other processes get at it with iom_shm_attach(). Without a name
+ * the ring is only shared with children forked afterwards. flags
+ * are those of iom_init() but IOM_MAINLY_EMPTY, IOM_SPSC is added
+ * if neither IOM_SPSC nor IOM_MPSC is given. iom_free() unmaps the
+ * ring, the object itself stays until shm_unlink(name).
+ */
+int iom_shm_create(const char *name, size_t size,
+		   struct iom_buffer **iom_buffer, unsigned flags)
+{
+	size_t hdr = iom_map_hdr_size();
+	struct iom_buffer *iomb;
+	struct iom_shm_hdr *sh;
+	int fd, ret;
+
+	assert(iom_buffer);
+	assert(sizeof(*sh) + offsetof(struct iom_buffer, buf) <= hdr);
+
+	if (!(flags & IOM_CONCURRENT))
+		flags |= IOM_SPSC;
+
+	ret = iom_check_flags(flags);
+	if (ret)
+		return ret;
+
+	/* the cursor slots are not part of the mapping */
+	if (flags & (IOM_MAINLY_EMPTY | IOM_GROW_MASK | IOM_BROADCAST))
+		return EINVAL;
+
+	if (size == 0 || (size & (size - 1)) || size > INT_MAX / 2)
+		return EINVAL;
+
+	if (size & ((size_t)sysconf(_SC_PAGESIZE) - 1))
+		return EINVAL;
+
+	if (name)
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	else
+		fd = memfd_create("iomalloc", MFD_CLOEXEC);
+	if (fd < 0)
+		return errno;
+
+	if (ftruncate(fd, hdr + size)) {
+		ret = errno;
+		goto err;
+	}
+
+	ret = iom_fd_map(fd, size, flags, &iomb);
+	if (ret)
+		goto err;
+	close(fd);
+
+	iom_map_advise(iomb->buf - hdr, hdr + size, flags);
+	iom_setup(iomb, size, flags | IOM_SHARED);
+
+	sh = iom_shm_hdr(iomb);
+	sh->version = IOM_SHM_VERSION;
+	sh->map_hdr_size = hdr;
+	sh->buf_off = offsetof(struct iom_buffer, buf);
+	smp_store_release(sh->magic, IOM_SHM_MAGIC);
+
+	*iom_buffer = iomb;
+
+	return 0;
+err:
+	close(fd);
+	if (name)
+		shm_unlink(name);
+	return ret;
+}
+
+
+/*
+ * iom_shm_attach() maps a ring created by iom_shm_create(). EAGAIN
+ * if its creator did not finish yet, EPROTO if it was built with an
+ * incompatible version or layout.
+ */
+int iom_shm_attach(const char *name, struct iom_buffer **iom_buffer)
+{
+	size_t hdr = iom_map_hdr_size();
+	struct iom_shm_hdr *sh;
+	struct iom_buffer *iomb;
+	struct stat st;
+	unsigned int size, flags;
+	int fd, ret = 0;
+
+	assert(name);
+	assert(iom_buffer);
+
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return errno;
+
+	if (fstat(fd, &st)) {
+		ret = errno;
+		goto out;
+	}
+	if ((size_t)st.st_size < hdr) {
+		ret = EAGAIN;
+		goto out;
+	}
+
+	/* the header page tells the size and mode of the ring */
+	sh = mmap(NULL, hdr, PROT_READ, MAP_SHARED, fd, 0);
+	if (sh == MAP_FAILED) {
+		ret = ENOBUFS;
+		goto out;
+	}
+	iomb = (struct iom_buffer *)
+		((unsigned char *)sh + hdr - offsetof(struct iom_buffer, buf));
+	if (smp_load_acquire(sh->magic) != IOM_SHM_MAGIC)
+		ret = EAGAIN;
+	else if (sh->version != IOM_SHM_VERSION || sh->map_hdr_size != hdr ||
+		 sh->buf_off != offsetof(struct iom_buffer, buf))
+		ret = EPROTO;
+	size  = iomb->size;
+	flags = iomb->flags;
+	munmap(sh, hdr);
+	if (ret)
+		goto out;
+
+	if ((size_t)st.st_size != hdr + size || !(flags & IOM_SHARED)) {
+		ret = EPROTO;
+		goto out;
+	}
+
+	ret = iom_fd_map(fd, size, flags, iom_buffer);
+out:
+	close(fd);
+	return ret;
+}
+
+
+/*
+ * IOM_PERSIST: the kernel's id of the running boot, empty if unknown
+ */
+static void iom_boot_id(char id[40])
+{
+	ssize_t n = 0;
+	int fd;
+
+	memset(id, 0, 40);
+	fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	n = read(fd, id, 39);
+	close(fd);
+	if (n < 0)
+		memset(id, 0, 40);
+}
+
+
+/*
+ * IOM_PERSIST: restore a consistent ring after a crash. Data is
+ * written before head is published and read before tail is, so after
+ * a process crash in the same boot the page cache holds complete
+ * chunks up to head. After a power failure pages may have reached the
+ * disk in any order, only the chunks of the synced snapshot are known
+ * to be there, and those consumed after it are delivered again. In
+ * both cases head is truncated to the last chunk whose header chain
+ * from tail still adds up.
+ */
+static void iom_file_recover(struct iom_buffer *iom_buffer, int same_boot)
+{
+	const unsigned int mask = iom_buffer->size - 1;
+	unsigned int left, len, hdr_len, chunks = 0;
+	int pos = iom_buffer->tail & mask, end = iom_buffer->head & mask;
+	int synced_head = (iom_buffer->synced >> 32) & mask;
+
+	if (!same_boot) {
+		pos = (unsigned int)iom_buffer->synced & mask;
+		end = synced_head;
+	}
+	iom_buffer->tail = pos;
+
+	left = iom_cnt_int(end, pos, iom_buffer->size);
+	while (left) {
+		if ((iom_buffer->flags & IOM_NO_SPLIT) &&
+		    iom_buffer->buf[pos] == IOM_COOKIE_WRAP) {
+			if (iom_buffer->size - pos > left)
+				break;
+			left -= iom_buffer->size - pos;
+			pos = 0;
+			continue;
+		}
+		len = iom_hdr_get(iom_buffer, pos, &hdr_len);
+		if (len > iom_len_max(iom_buffer) || hdr_len + len > left)
+			break;
+		left -= hdr_len + len;
+		pos = (pos + hdr_len + len) & mask;
+		chunks++;
+	}
+
+	iom_buffer->head = pos;
+	iom_buffer->tail_cache = iom_buffer->tail;
+	iom_buffer->head_cache = pos;
+	iom_buffer->rd_waiters = iom_buffer->wr_waiters = 0;
+	iom_buffer->resv = pos;
+	iom_buffer->pushed = chunks;
+	iom_buffer->shifted = 0;
+	iom_buffer->fill_pend = iom_buffer->drain_off = 0;
+	iom_buffer->push_pend = 0;
+	iom_buffer->unsynced = 0;
+	iom_buffer->sync_err = 0;
+	/* the data up to pos is on disk or written with the next sync */
+	iom_buffer->synced = (unsigned long long)synced_head << 32 |
+			     (unsigned int)iom_buffer->tail;
+}
+
+
+/*
+ * iom_file_open() keeps a ring in the file at path, so its chunks
+ * survive a restart. A missing or empty file is created with a ring
+ * of size bytes and flags as for iom_init() but IOM_MPSC and
+ * IOM_MAINLY_EMPTY. An existing ring is recovered and draining
+ * continues at its tail, size must then be 0 or the ring size and
+ * flags must match. After every sync_bytes pushed bytes the producer
+ * calls iom_file_sync(), 0 leaves that to the caller - a full ring
+ * syncs before it reuses space in any case. Chunks pushed since the
+ * last sync survive a process crash but not a power failure.
+ * iom_free() syncs and unmaps the ring.
+ */
+int iom_file_open(const char *path, size_t size, struct iom_buffer **iom_buffer,
+		  unsigned flags, size_t sync_bytes)
+{
+	size_t hdr = iom_map_hdr_size();
+	struct iom_shm_hdr *sh;
+	struct iom_buffer *iomb;
+	struct stat st;
+	unsigned char *page;
+	char boot_id[40];
+	int fd, ret = 0, create;
+
+	assert(path);
+	assert(iom_buffer);
+
+	ret = iom_check_flags(flags);
+	if (ret)
+		return ret;
+
+	if ((flags & (IOM_MPSC | IOM_MAINLY_EMPTY | IOM_GROW_MASK |
+		      IOM_BROADCAST)) || sync_bytes > UINT_MAX)
+		return EINVAL;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return errno;
+
+	if (fstat(fd, &st)) {
+		ret = errno;
+		goto out;
+	}
+
+	/* a crash while creating leaves a file without magic */
+	create = (size_t)st.st_size < hdr;
+	if (!create) {
+		page = malloc(hdr);
+		if (!page) {
+			ret = ENOBUFS;
+			goto out;
+		}
+		if (pread(fd, page, hdr, 0) != (ssize_t)hdr) {
+			free(page);
+			ret = EIO;
+			goto out;
+		}
+		sh = (struct iom_shm_hdr *)page;
+		iomb = (struct iom_buffer *)
+			(page + hdr - offsetof(struct iom_buffer, buf));
+		create = sh->magic != IOM_FILE_MAGIC;
+		if (!create && (sh->version != IOM_SHM_VERSION ||
+				sh->map_hdr_size != hdr ||
+				sh->buf_off != offsetof(struct iom_buffer, buf) ||
+				(size_t)st.st_size != hdr + iomb->size))
+			ret = EPROTO;
+		/* the placement hints may differ from run to run */
+		else if (!create && ((size && size != iomb->size) ||
+				     ((iomb->flags ^ flags) & IOM_INIT_FLAGS &
+				      ~IOM_ALLOC_FLAGS)))
+			ret = EINVAL;
+		if (!create)
+			size = iomb->size;
+		free(page);
+		if (ret)
+			goto out;
+	}
+
+	if (size == 0 || (size & (size - 1)) || size > INT_MAX / 2 ||
+	    (size & ((size_t)sysconf(_SC_PAGESIZE) - 1))) {
+		ret = EINVAL;
+		goto out;
+	}
+
+	if (create && ftruncate(fd, hdr + size)) {
+		ret = errno;
+		goto out;
+	}
+
+	ret = iom_fd_map(fd, size, flags, &iomb);
+	if (ret)
+		goto out;
+
+	iom_map_advise(iomb->buf - hdr, hdr + size, flags);
+
+	sh = iom_shm_hdr(iomb);
+	iom_boot_id(boot_id);
+	if (create) {
+		iom_setup(iomb, size, flags | IOM_SHARED | IOM_PERSIST);
+		sh->version = IOM_SHM_VERSION;
+		sh->map_hdr_size = hdr;
+		sh->buf_off = offsetof(struct iom_buffer, buf);
+		sh->magic = IOM_FILE_MAGIC;
+	} else {
+		iomb->flags = (iomb->flags & ~IOM_ALLOC_FLAGS) |
+			      (flags & IOM_ALLOC_FLAGS);
+		iom_file_recover(iomb, boot_id[0] &&
+				 !memcmp(sh->boot_id, boot_id, sizeof(boot_id)));
+	}
+	memcpy(sh->boot_id, boot_id, sizeof(boot_id));
+	iomb->sync_bytes = sync_bytes;
+
+	/* what recovery kept becomes the snapshot on disk */
+	ret = iom_file_sync(iomb);
+	if (ret) {
+		iom_free(iomb);
+		goto out;
+	}
+
+	*iom_buffer = iomb;
+out:
+	close(fd);
+	return ret;
+}
+
+
+static int push_mode(struct iom_buffer *iom_buffer, int head,
+		     unsigned int need)
+{
+	/* the mirror mapping continues buf beyond its end */
+	if (iom_buffer->flags & IOM_MAGIC_RING)
+		return MODE_CONTINUES;
+
+	if (need <= iom_space_to_bound(iom_buffer, head))
+		return MODE_CONTINUES;
+
+	if (iom_buffer->flags & IOM_NO_SPLIT)
+		return MODE_WRAPPED;
+
+	return MODE_SPLITTED;
+}
+
+
+/*
+ * Copy len bytes to pos, wrapping around the end of buf if required
+ */
+static void iom_put(struct iom_buffer *iom_buffer, int pos,
+		    const unsigned char *buf, size_t len)
+{
+	size_t to_end = iom_buffer->size - pos;
+
+	if (len <= to_end) {
+		memcpy(&iom_buffer->buf[pos], buf, len);
+	} else {
+		memcpy(&iom_buffer->buf[pos], buf, to_end);
+		memcpy(&iom_buffer->buf[0], &buf[to_end], len - to_end);
+	}
+}
+
+
+/*
+ * The iom_add_*() functions store a chunk at head and return the
+ * new head. Publishing it to the consumer is up to the caller.
+ */
+static __always_inline int iom_add_fast(struct iom_buffer *iom_buffer,
+					int head, const unsigned char *buf,
+					size_t len, unsigned int hdr_len)
+{
+	iom_hdr_put(iom_buffer, head, len, hdr_len);
+	memcpy(&iom_buffer->buf[head + hdr_len], buf, len);
+
+	return (head + hdr_len + len) & (iom_buffer->size - 1);
+}
+
+
+static int iom_add_slow(struct iom_buffer *iom_buffer, int head,
+			const unsigned char *buf, size_t len,
+			unsigned int hdr_len)
+{
+	const unsigned int mask = iom_buffer->size - 1;
+
+	/* header, payload or both may wrap around the end */
+	iom_hdr_put(iom_buffer, head, len, hdr_len);
+	iom_put(iom_buffer, (head + hdr_len) & mask, buf, len);
+
+	return (head + hdr_len + len) & mask;
+}
+
+
+/*
+ * IOM_NO_SPLIT: mark the rest of buf as skipped and store the chunk
+ * at its start
+ */
+static int iom_add_wrapped(struct iom_buffer *iom_buffer, int head,
+			   const unsigned char *buf, size_t len,
+			   unsigned int hdr_len)
+{
+	iom_buffer->buf[head] = IOM_COOKIE_WRAP;
+
+	return iom_add_fast(iom_buffer, 0, buf, len, hdr_len);
+}
+
+
+static int iom_add(struct iom_buffer *iom_buffer, int head,
+		   const unsigned char *buf, size_t len)
+{
+	unsigned int hdr_len = iom_hdr_len(iom_buffer, len);
+
+	switch (push_mode(iom_buffer, head, hdr_len + len)) {
+	case MODE_CONTINUES:
+		return iom_add_fast(iom_buffer, head, buf, len, hdr_len);
+	case MODE_SPLITTED:
+		return iom_add_slow(iom_buffer, head, buf, len, hdr_len);
+	case MODE_WRAPPED:
+		return iom_add_wrapped(iom_buffer, head, buf, len, hdr_len);
+	default:
+		assert(0);
+		break;
+	}
+
+	return head;
+}
+
+
+/*
+ * Describe the payload of the chunk at pos as one or two segments
+ * within buf. Returns the payload length, the header length in
+ * hdr_len.
+ */
+static unsigned int iom_chunk_iov(struct iom_buffer *iom_buffer, int pos,
+				  struct iovec *iov, int *iovcnt,
+				  unsigned int *hdr_len)
+{
+	unsigned int encoded_len, to_end;
+	int data;
+
+	encoded_len = iom_hdr_get(iom_buffer, pos, hdr_len);
+	*iovcnt = 1;
+
+	/* the mirror mapping continues buf beyond its end */
+	if (iom_buffer->flags & IOM_MAGIC_RING) {
+		iov[0].iov_base = &iom_buffer->buf[pos + *hdr_len];
+		iov[0].iov_len  = encoded_len;
+		return encoded_len;
+	}
+
+	data = (pos + *hdr_len) & (iom_buffer->size - 1);
+	to_end = iom_tail_to_end_int(iom_buffer->size, data);
+	iov[0].iov_base = &iom_buffer->buf[data];
+	if (encoded_len <= to_end) {
+		iov[0].iov_len = encoded_len;
+	} else {
+		iov[0].iov_len  = to_end;
+		iov[1].iov_base = &iom_buffer->buf[0];
+		iov[1].iov_len  = encoded_len - to_end;
+		*iovcnt = 2;
+	}
+
+	return encoded_len;
+}
+
+
+/*
+ * Copy the payload of the chunk at pos to buf
+ */
+static int iom_chunk_copy(struct iom_buffer *iom_buffer, int pos,
+			  unsigned char *buf, unsigned int *buf_len,
+			  unsigned int max_size, unsigned int *hdr_len)
+{
+	struct iovec iov[2];
+	unsigned int encoded_len;
+	int iovcnt;
+
+	encoded_len = iom_chunk_iov(iom_buffer, pos, iov, &iovcnt, hdr_len);
+	if (encoded_len > max_size)
+		return ENOBUFS;
+
+	memcpy(buf, iov[0].iov_base, iov[0].iov_len);
+	if (iovcnt == 2)
+		memcpy(&buf[iov[0].iov_len], iov[1].iov_base, iov[1].iov_len);
+
+	*buf_len = encoded_len;
+
+	return 0;
+}
+
+
+/*
+ * Decode the length of the chunk at pos
+ */
+static unsigned int iom_chunk_len(struct iom_buffer *iom_buffer, int pos)
+{
+	unsigned int hdr_len;
+
+	return iom_hdr_get(iom_buffer, pos, &hdr_len);
+}
+
+
+/*
+ * Bytes the chunk at pos occupies in buf, header included
+ */
+static unsigned int iom_chunk_size(struct iom_buffer *iom_buffer, int pos)
+{
+	unsigned int hdr_len, len;
+
+	len = iom_hdr_get(iom_buffer, pos, &hdr_len);
+
+	return hdr_len + len;
+}
+
+
+/*
+ * IOM_NO_SPLIT: a chunk at pos may in fact start at 0. Only valid
+ * for a pos within the occupied part of the buffer.
+ */
+static int iom_chunk_pos(struct iom_buffer *iom_buffer, int pos)
+{
+	if ((iom_buffer->flags & IOM_NO_SPLIT) &&
+	    iom_buffer->buf[pos] == IOM_COOKIE_WRAP)
+		return 0;
+
+	return pos;
+}
+
+
+/*
+ * Step tail over a wrap marker, the skipped bytes are free again
+ */
+static void iom_tail_skip_wrap(struct iom_buffer *iom_buffer)
+{
+	int pos = iom_chunk_pos(iom_buffer, iom_buffer->tail);
+
+	if (pos != iom_buffer->tail)
+		smp_store_release(iom_buffer->tail, pos);
+}
+
+
+static void purge_next(struct iom_buffer *iom_buffer)
+{
+	iom_tail_skip_wrap(iom_buffer);
+	iom_tail_inc(iom_buffer, iom_chunk_size(iom_buffer, iom_buffer->tail));
+
+	/* tail may have passed the consumer's copy of head */
+	iom_buffer->head_cache = iom_buffer->head;
+}
+
+
+/*
+ * Bytes the chunks in iov consume at head, for IOM_NO_SPLIT this
+ * includes the skipped bytes up to the end of buf
+ */
+static unsigned int iom_needv(struct iom_buffer *iom_buffer,
+			      const struct iovec *iov, int iovcnt)
+{
+	unsigned int need = 0, n, to_end;
+	int i, head = iom_buffer->head;
+
+	for (i = 0; i < iovcnt; i++) {
+		n = iov[i].iov_len + iom_hdr_len(iom_buffer, iov[i].iov_len);
+		if (iom_buffer->flags & IOM_NO_SPLIT) {
+			to_end = iom_space_to_bound(iom_buffer, head);
+			if (n > to_end) {
+				need += to_end;
+				head = 0;
+			}
+		}
+		need += n;
+		head = (head + n) & (iom_buffer->size - 1);
+	}
+
+	return need;
+}
+
+
+/*
+ * End of the chunks from tail up to the end of buf if the occupied
+ * bytes wrap around, the IOM_NO_SPLIT wrap marker is not included
+ */
+static int iom_wrap_end(struct iom_buffer *iom_buffer)
+{
+	int pos = iom_buffer->tail;
+
+	if (!(iom_buffer->flags & IOM_NO_SPLIT))
+		return iom_buffer->size;
+
+	while ((unsigned int)pos < iom_buffer->size &&
+	       iom_buffer->buf[pos] != IOM_COOKIE_WRAP)
+		pos += iom_chunk_size(iom_buffer, pos);
+
+	return pos;
+}
+
+
+/*
+ * Copy the occupied bytes to dst in FIFO order, returns their number
+ */
+static unsigned int iom_linearize(struct iom_buffer *iom_buffer,
+				  unsigned char *dst)
+{
+	int head = iom_buffer->head, tail = iom_buffer->tail, end;
+
+	if (head >= tail || (iom_buffer->flags & IOM_MAGIC_RING)) {
+		end = tail + iom_cnt_int(head, tail, iom_buffer->size);
+		memcpy(dst, &iom_buffer->buf[tail], end - tail);
+		return end - tail;
+	}
+
+	end = iom_wrap_end(iom_buffer);
+	memcpy(dst, &iom_buffer->buf[tail], end - tail);
+	memcpy(&dst[end - tail], iom_buffer->buf, head);
+
+	return end - tail + head;
+}
+
+
+/*
+ * Bytes the chunks occupy once linearized
+ */
+static unsigned int iom_used(struct iom_buffer *iom_buffer)
+{
+	int head = iom_buffer->head, tail = iom_buffer->tail;
+
+	if (head >= tail || (iom_buffer->flags & IOM_MAGIC_RING))
+		return iom_cnt_int(head, tail, iom_buffer->size);
+
+	return iom_wrap_end(iom_buffer) - tail + head;
+}
+
+
+/*
+ * Switch to size with the chunks between tail and head, indices
+ * already valid for the new size
+ */
+static void iom_relocate(struct iom_buffer *iom_buffer, size_t size,
+			 int tail, int head)
+{
+	iom_buffer->size = size;
+	iom_buffer->tail = iom_buffer->tail_cache = tail;
+	iom_buffer->head = iom_buffer->head_cache = head;
+	iom_buffer->resv = head;
+	/* reservations do not survive a resize */
+	iom_buffer->push_pend = 0;
+	if (iom_buffer->flags & IOM_MAINLY_EMPTY) {
+		iom_buffer->hiwat = max(iom_buffer->hiwat, (unsigned int)head);
+		iom_buffer->hiwat = min(iom_buffer->hiwat, (unsigned int)size);
+	}
+}
+
+
+/*
+ * Change size of a buffer whose buf has room for both sizes. Growing
+ * moves the part in front of tail behind the rest, i.e. the split
+ * region is copied once and the chunk crossing the old end becomes
+ * contiguous. Shrinking moves everything to the start of buf.
+ */
+static int iom_resize_inplace(struct iom_buffer *iom_buffer, size_t size)
+{
+	int head = iom_buffer->head, tail = iom_buffer->tail, end;
+	unsigned char *tmp;
+	unsigned int used;
+
+	if (size > iom_buffer->size) {
+		if (head < tail) {
+			end = iom_wrap_end(iom_buffer);
+			memcpy(&iom_buffer->buf[end], iom_buffer->buf, head);
+			head += end;
+		}
+		iom_relocate(iom_buffer, size, tail, head);
+		return 0;
+	}
+
+	used = iom_used(iom_buffer);
+	tmp = malloc(used + 1);
+	if (!tmp)
+		return ENOBUFS;
+	iom_linearize(iom_buffer, tmp);
+	memcpy(iom_buffer->buf, tmp, used);
+	free(tmp);
+
+	/* give the pages beyond the new end back */
+	if (iom_buffer->flags & (IOM_MAINLY_EMPTY | IOM_GROW_MASK))
+		madvise(&iom_buffer->buf[size], iom_buffer->size - size,
+			IOM_RECLAIM_ADVICE);
+
+	iom_relocate(iom_buffer, size, 0, used);
+
+	return 0;
+}
+
+
+/*
+ * iom_resize() changes the size of a buffer to the power of two
+ * size, keeping all chunks in FIFO order. ENOBUFS if they do not fit
+ * in size. The buffer may move, *iom_buffer is updated:
+ *
+ * - IOM_GROW_MAX rings never move, size may not exceed the maximum
+ * - other mmap()ed rings grow with mremap(), the kernel moves pages
+ *   instead of bytes
+ * - everything else is copied once to a new buffer
+ *
+ * Not available in the concurrent modes, for rings from iom_pool,
+ * iom_shm_create() or iom_file_open() (ENOTSUP) and while
+ * iom_fill_from_fd() holds a partial frame (EBUSY). Outstanding
+ * views and reservations become invalid.
+ */
+int iom_resize(struct iom_buffer **iom_buffer, size_t size)
+{
+	struct iom_buffer *iomb, *n;
+	size_t hdr = iom_map_hdr_size(), len;
+	unsigned char *base;
+	unsigned int used;
+	int ret;
+
+	assert(iom_buffer && *iom_buffer);
+	iomb = *iom_buffer;
+
+	if (iomb->flags & (IOM_CONCURRENT | IOM_POOLED | IOM_SHARED))
+		return ENOTSUP;
+
+	if (size == 0 || (size & (size - 1)) || size > (1U << 30) ||
+	    ((iomb->flags & IOM_GROW_MASK) && size > iom_cap(iomb)))
+		return EINVAL;
+
+	if (iomb->fill_pend)
+		return EBUSY;
+
+	if (size == iomb->size)
+		return 0;
+
+	used = iom_used(iomb);
+	if (used > size - 1)
+		return ENOBUFS;
+
+	if (iomb->flags & IOM_GROW_MASK)
+		return iom_resize_inplace(iomb, size);
+
+	if ((iomb->flags & (IOM_MAINLY_EMPTY | IOM_ALLOC_FLAGS)) &&
+	    !(iomb->flags & IOM_MAGIC_RING) && size > iomb->size) {
+		len = iom_map_len(iomb->size, iomb->flags);
+		base = mremap(iomb->buf - hdr, len, iom_map_len(size, iomb->flags),
+			      MREMAP_MAYMOVE);
+		/* e.g. huge pages the kernel cannot remap, copy below */
+		if (base != MAP_FAILED) {
+			iomb = (struct iom_buffer *)
+				(base + hdr - offsetof(struct iom_buffer, buf));
+			/* the pages added behind the old end are fresh */
+			iom_map_advise(base, iom_map_len(size, iomb->flags),
+				       iomb->flags);
+			*iom_buffer = iomb;
+			return iom_resize_inplace(iomb, size);
+		}
+	}
+
+	ret = iom_init(size, &n, iomb->flags & ~IOM_NOTIFY);
+	if (ret)
+		return ret;
+
+	iom_linearize(iomb, n->buf);
+	iom_relocate(n, size, 0, used);
+	n->pushed = iomb->pushed;
+	n->shifted = iomb->shifted;
+	n->drain_off = iomb->drain_off;
+
+	/* the eventfd moves over, the caller may have it in an epoll set */
+	if (iomb->flags & IOM_NOTIFY) {
+		n->evfd = iomb->evfd;
+		n->lo_wm = iomb->lo_wm;
+		n->hi_wm = iomb->hi_wm;
+		n->ev_state = iomb->ev_state;
+		n->flags |= IOM_NOTIFY;
+		iomb->flags &= ~IOM_NOTIFY;
+	}
+
+	iom_free(iomb);
+	*iom_buffer = n;
+
+	return 0;
+}
+
+
+/*
+ * IOM_GROW_MAX: double size until the chunks in iov fit at head or
+ * the maximum is reached
+ */
+static void iom_grow(struct iom_buffer *iom_buffer, const struct iovec *iov,
+		     int iovcnt)
+{
+	unsigned int need;
+
+	do {
+		if (iom_buffer->size == iom_cap(iom_buffer) ||
+		    iom_resize_inplace(iom_buffer, iom_buffer->size * 2))
+			return;
+		need = iom_needv(iom_buffer, iov, iovcnt);
+	} while (iom_prod_space(iom_buffer, need) < need);
+}
+
+
+/*
+ * Make room for all chunks in iov, or for none
+ */
+static int enforce_buf_policy(struct iom_buffer *iom_buffer,
+			      const struct iovec *iov, int iovcnt, int flags)
+{
+	unsigned int need;
+
+	/* the consumer owns tail, the producer must not drop for it */
+	if ((iom_buffer->flags & IOM_CONCURRENT) && flags != IOM_TAIL_DROP)
+		return ENOTSUP;
+
+	/* rather grow than drop */
+	if (iom_buffer->flags & IOM_GROW_MASK) {
+		need = iom_needv(iom_buffer, iov, iovcnt);
+		if (iom_prod_space(iom_buffer, need) < need)
+			iom_grow(iom_buffer, iov, iovcnt);
+	}
+
+	switch (flags) {
+	case IOM_TAIL_DROP:
+		need = iom_needv(iom_buffer, iov, iovcnt);
+		if (iom_prod_space(iom_buffer, need) < need)
+			return ENOBUFS;
+		break;
+	case IOM_HEAD_DROP:
+		for (;;) {
+			need = iom_needv(iom_buffer, iov, iovcnt);
+			if (iom_prod_space(iom_buffer, need) >= need)
+				break;
+			if (iom_buffer->tail == iom_buffer->head) {
+				/* empty but no fit, start over to lose the slack */
+				if (iom_buffer->head == 0)
+					return ENOBUFS;
+				iom_reset(iom_buffer);
+				continue;
+			}
+			purge_next(iom_buffer);
+		}
+		break;
+	case IOM_DROP_ALL:
+		iom_reset(iom_buffer);
+		need = iom_needv(iom_buffer, iov, iovcnt);
+		if (iom_prod_space(iom_buffer, need) < need)
+			return ENOBUFS;
+		break;
+	default:
+		return ENOTSUP;
+		break;
+	}
+
+	return 0;
+}
+
+
+/*
+ * IOM_MPSC: a producer claims bytes by advancing resv, stamps the
+ * cookies of its chunks busy and publishes head in reservation
+ * order. So a producer only waits for its predecessors to write
+ * their cookies - not their payload. The payload is copied
+ * afterwards and each chunk is committed by clearing its busy flag.
+ */
+static int iom_mp_claim(struct iom_buffer *iom_buffer, unsigned int need,
+			int *start)
+{
+	const unsigned int mask = iom_buffer->size - 1;
+	unsigned int resv;
+
+	resv = READ_ONCE(iom_buffer->resv);
+	do {
+		/*
+		 * No tail_cache here: producers would overwrite each
+		 * others copy with older values
+		 */
+		if (iom_space_int(resv & mask, smp_load_acquire(iom_buffer->tail),
+				  iom_buffer->size) < need)
+			return ENOBUFS;
+	} while (!__atomic_compare_exchange_n(&iom_buffer->resv, &resv,
+					      resv + need, 1, __ATOMIC_ACQUIRE,
+					      __ATOMIC_RELAXED));
+
+	*start = resv & mask;
+
+	return 0;
+}
+
+
+static void iom_mp_stamp(struct iom_buffer *iom_buffer, int pos, size_t len)
+{
+	union encoder_cookie cookie;
+
+	cookie.l = htons((short)len);
+	iom_buffer->buf[pos] = cookie.s[0] | IOM_COOKIE_BUSY;
+	iom_buffer->buf[(pos + 1) & (iom_buffer->size - 1)] = cookie.s[1];
+}
+
+
+static void iom_mp_publish(struct iom_buffer *iom_buffer, int start, int end)
+{
+	unsigned int spin;
+
+	for (spin = 0; smp_load_acquire(iom_buffer->head) != start; spin++)
+		iom_relax(spin);
+	smp_store_release(iom_buffer->head, end);
+	if (iom_buffer->flags & IOM_WAIT)
+		iom_wake(iom_buffer, &iom_buffer->head, &iom_buffer->rd_waiters);
+	if (iom_buffer->flags & IOM_NOTIFY)
+		iom_notify_head(iom_buffer, start);
+}
+
+
+/*
+ * IOM_MPSC: claim, stamp and publish a single chunk
+ */
+static int iom_mp_reserve(struct iom_buffer *iom_buffer, size_t len, int *pos)
+{
+	const unsigned int need = len + sizeof(union encoder_cookie);
+	int ret;
+
+	ret = iom_mp_claim(iom_buffer, need, pos);
+	if (ret)
+		return ret;
+
+	iom_mp_stamp(iom_buffer, *pos, len);
+	iom_mp_publish(iom_buffer, *pos, (*pos + need) & (iom_buffer->size - 1));
+
+	return 0;
+}
+
+
+/*
+ * IOM_MPSC: payload is written, clear the busy flag
+ */
+static void iom_mp_commit(struct iom_buffer *iom_buffer, int pos, size_t len)
+{
+	union encoder_cookie cookie;
+
+	cookie.l = htons((short)len);
+	__atomic_fetch_add(&iom_buffer->pushed, 1, __ATOMIC_RELAXED);
+	smp_store_release(iom_buffer->buf[pos], cookie.s[0]);
+}
+
+
+/*
+ * IOM_MPSC: copy the payload of the chunk at pos
+ */
+static void iom_mp_put(struct iom_buffer *iom_buffer, int pos,
+		       const unsigned char *buf, size_t len)
+{
+	const size_t sc = sizeof(union encoder_cookie);
+
+	if (iom_buffer->flags & IOM_MAGIC_RING)
+		memcpy(&iom_buffer->buf[pos + sc], buf, len);
+	else
+		iom_put(iom_buffer, (pos + sc) & (iom_buffer->size - 1), buf, len);
+}
+
+
+static int iom_push_mp(struct iom_buffer *iom_buffer, unsigned char *buf,
+		       size_t len, int flags)
+{
+	int ret, pos;
+
+	if (flags != IOM_TAIL_DROP)
+		return ENOTSUP;
+
+	ret = iom_mp_reserve(iom_buffer, len, &pos);
+	if (ret)
+		return ret;
+
+	iom_mp_put(iom_buffer, pos, buf, len);
+	iom_mp_commit(iom_buffer, pos, len);
+
+	return 0;
+}
+
+
+static int iom_pushv_mp(struct iom_buffer *iom_buffer, const struct iovec *iov,
+			int iovcnt, int flags)
+{
+	const unsigned int mask = iom_buffer->size - 1;
+	const size_t sc = sizeof(union encoder_cookie);
+	unsigned int need = 0;
+	int ret, i, start, pos;
+
+	if (flags != IOM_TAIL_DROP)
+		return ENOTSUP;
+
+	for (i = 0; i < iovcnt; i++)
+		need += iov[i].iov_len + sc;
+
+	ret = iom_mp_claim(iom_buffer, need, &start);
+	if (ret)
+		return ret;
+
+	for (i = 0, pos = start; i < iovcnt; i++) {
+		iom_mp_stamp(iom_buffer, pos, iov[i].iov_len);
+		pos = (pos + iov[i].iov_len + sc) & mask;
+	}
+	iom_mp_publish(iom_buffer, start, pos);
+
+	for (i = 0, pos = start; i < iovcnt; i++) {
+		iom_mp_put(iom_buffer, pos, iov[i].iov_base, iov[i].iov_len);
+		iom_mp_commit(iom_buffer, pos, iov[i].iov_len);
+		pos = (pos + iov[i].iov_len + sc) & mask;
+	}
+
+	return 0;
+}
+
+
+/*
+ * IOM_MPSC: a chunk is visible at head before its producer finished
+ * writing it, readers must not pass a chunk which is still busy
+ */
+static int iom_chunk_busy(struct iom_buffer *iom_buffer, int pos)
+{
+	if (!(iom_buffer->flags & IOM_MPSC))
+		return 0;
+
+	return !!(smp_load_acquire(iom_buffer->buf[pos]) & IOM_COOKIE_BUSY);
+}
+
+
+static void iom_reservation_fill(struct iom_buffer *iom_buffer,
+				 struct iom_reservation *res, int pos, size_t len,
+				 unsigned int hdr_len)
+{
+	int data = (pos + hdr_len) & (iom_buffer->size - 1);
+	size_t to_end = iom_buffer->size - data;
+
+	res->pos = pos;
+	res->len = len;
+	res->hdr_len = hdr_len;
+	if (iom_buffer->flags & IOM_MAGIC_RING) {
+		res->iov[0].iov_base = &iom_buffer->buf[pos + hdr_len];
+		res->iov[0].iov_len = len;
+		res->iovcnt = 1;
+		return;
+	}
+
+	res->iov[0].iov_base = &iom_buffer->buf[data];
+	if (len <= to_end) {
+		res->iov[0].iov_len = len;
+		res->iovcnt = 1;
+	} else {
+		res->iov[0].iov_len = to_end;
+		res->iov[1].iov_base = &iom_buffer->buf[0];
+		res->iov[1].iov_len = len - to_end;
+		res->iovcnt = 2;
+	}
+}
+
+
+/*
+ * Reset to 0 if empty to keep memory reference local. Not done in
+ * the concurrent modes, where tail and head belong to different
+ * threads, and not while iom_fill_from_fd() holds a partial frame
+ * or iom_push_reserve() a reservation beyond head. Neither for a
+ * file, where a reset costs a msync().
+ */
+static void iom_reset_if_empty(struct iom_buffer *iom_buffer)
+{
+	if (!(iom_buffer->flags & (IOM_CONCURRENT | IOM_PERSIST)) &&
+	    !iom_buffer->fill_pend && !iom_buffer->push_pend &&
+	    iom_space(iom_buffer) == iom_buffer->size - 1) {
+		if (iom_buffer->flags & IOM_MAINLY_EMPTY)
+			iom_reclaim(iom_buffer);
+		iom_reset(iom_buffer);
+	}
+}
+
+
+/*
+ * iom_push_reserve() hands out len bytes of payload space directly
+ * within the buffer, so the caller can serialize into the buffer
+ * without an intermediate copy. The drop policy (flags) is
+ * enforced now, like with iom_push(). The chunk becomes visible to
+ * the consumer with iom_push_commit().
+ *
+ * Without IOM_MPSC there can be only one outstanding reservation
+ * and no other push in between. The consumer may shift in between,
+ * the buffer does not start over at 0 until the commit. A
+ * reservation that is not committed is abandoned with
+ * iom_push_cancel(). With IOM_MPSC every reservation
+ * MUST be committed with exactly the reserved length, otherwise
+ * the consumer stalls.
+ */
+int iom_push_reserve(struct iom_buffer *iom_buffer, struct iom_reservation *res,
+		     size_t len, int flags)
+{
+	struct iovec iov;
+	int ret, pos;
+	unsigned int hdr_len;
+
+	assert(iom_buffer);
+	assert(res);
+
+	hdr_len = iom_hdr_len(iom_buffer, len);
+	if (iom_cap(iom_buffer) < len + hdr_len || len > iom_len_max(iom_buffer))
+		return EINVAL;
+
+	if (iom_buffer->flags & IOM_MPSC) {
+		if (flags != IOM_TAIL_DROP)
+			return ENOTSUP;
+		ret = iom_mp_reserve(iom_buffer, len, &pos);
+	} else {
+		iov.iov_base = NULL;
+		iov.iov_len  = len;
+		ret = enforce_buf_policy(iom_buffer, &iov, 1, flags);
+		pos = iom_buffer->head;
+		if (!ret && push_mode(iom_buffer, pos, len + hdr_len) == MODE_WRAPPED) {
+			iom_buffer->buf[pos] = IOM_COOKIE_WRAP;
+			pos = 0;
+		}
+	}
+	if (ret)
+		return ret;
+
+	if (!(iom_buffer->flags & IOM_MPSC))
+		iom_buffer->push_pend = 1;
+	iom_reservation_fill(iom_buffer, res, pos, len, hdr_len);
+
+	return 0;
+}
+
+
+/*
+ * Finish a reservation, len may be shorter than the reserved length
+ * (but not with IOM_MPSC). Returns EINVAL if len is too large.
+ */
+int iom_push_commit(struct iom_buffer *iom_buffer, struct iom_reservation *res,
+		    size_t len)
+{
+	assert(iom_buffer);
+	assert(res);
+
+	if (iom_buffer->flags & IOM_MPSC) {
+		if (len != res->len)
+			return EINVAL;
+		iom_mp_commit(iom_buffer, res->pos, len);
+		return 0;
+	}
+
+	if (len > res->len)
+		return EINVAL;
+
+	/* IOM_NO_SPLIT may have moved the chunk to the start */
+	assert(res->pos == iom_buffer->head || res->pos == 0);
+
+	iom_buffer->push_pend = 0;
+
+	/* IOM_VARINT: a shorter len keeps the reserved header width */
+	iom_hdr_put(iom_buffer, res->pos, len, res->hdr_len);
+	iom_head_publish(iom_buffer, (res->pos + res->hdr_len + len) &
+			 (iom_buffer->size - 1), 1);
+
+	return 0;
+}
+
+
+/*
+ * Abandon a reservation without publishing anything. Not possible
+ * with IOM_MPSC (ENOTSUP), where later reservations wait for this
+ * one - commit it instead.
+ */
+int iom_push_cancel(struct iom_buffer *iom_buffer, struct iom_reservation *res)
+{
+	assert(iom_buffer);
+	assert(res);
+
+	if (iom_buffer->flags & IOM_MPSC)
+		return ENOTSUP;
+
+	iom_buffer->push_pend = 0;
+	iom_reset_if_empty(iom_buffer);
+
+	return 0;
+}
+
+
+/*
+ * The complete iom_push(), the inline version in iomalloc.h calls
+ * it for everything but the plain case
+ */
+int iom_push_slow(struct iom_buffer *iom_buffer, unsigned char *buf,
+		  size_t len, int flags)
+{
+	struct iovec iov;
+	int ret;
+
+	assert(iom_buffer);
+
+	if (iom_cap(iom_buffer) < len + iom_hdr_len(iom_buffer, len) ||
+	    len > iom_len_max(iom_buffer))
+		return EINVAL;
+
+	if (iom_buffer->flags & IOM_MPSC)
+		return iom_push_mp(iom_buffer, buf, len, flags);
+
+	iov.iov_base = buf;
+	iov.iov_len  = len;
+	ret = enforce_buf_policy(iom_buffer, &iov, 1, flags);
+	if (ret) /* failure or out of memory */
+		return ret;
+
+	iom_head_publish(iom_buffer, iom_add(iom_buffer, iom_buffer->head, buf, len), 1);
+
+	return 0;
+}
+
+
+/*
+ * iom_pushv() stores one chunk per iovec, with a single policy
+ * check and a single publication of head for the whole batch. The
+ * batch is all or nothing: with IOM_TAIL_DROP ENOBUFS is returned
+ * if it does not fit as a whole, IOM_HEAD_DROP purges old chunks
+ * until it does.
+ */
+int iom_pushv(struct iom_buffer *iom_buffer, const struct iovec *iov,
+	      int iovcnt, int flags)
+{
+	size_t total = 0;
+	int ret, i, head;
+
+	assert(iom_buffer);
+	assert(iov);
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > iom_len_max(iom_buffer))
+			return EINVAL;
+		total += iov[i].iov_len + iom_hdr_len(iom_buffer, iov[i].iov_len);
+	}
+
+	/* would purge everything and still not fit */
+	if (total > iom_cap(iom_buffer) - 1)
+		return EINVAL;
+
+	if (iom_buffer->flags & IOM_MPSC)
+		return iom_pushv_mp(iom_buffer, iov, iovcnt, flags);
+
+	ret = enforce_buf_policy(iom_buffer, iov, iovcnt, flags);
+	if (ret)
+		return ret;
+
+	head = iom_buffer->head;
+	for (i = 0; i < iovcnt; i++)
+		head = iom_add(iom_buffer, head, iov[i].iov_base, iov[i].iov_len);
+	iom_head_publish(iom_buffer, head, iovcnt);
+
+	return 0;
+}
+
+/*
+ * If ring is empty iom_shift return EINVAL, arguments are untouched.
+ * With IOM_MPSC EAGAIN signals that the next chunk is not committed yet.
+ * The complete iom_shift(), see iom_push_slow().
+ */
+int iom_shift_slow(struct iom_buffer *iom_buffer, unsigned char *buf,
+		   unsigned int *buf_len, unsigned int max_size)
+{
+	unsigned int encoded_len, hdr_len;
+	int ret;
+
+	assert(iom_buffer);
+	assert(max_size);
+	assert(buf_len);
+
+	if (!iom_cons_cnt(iom_buffer))
+		return EINVAL;
+
+	iom_tail_skip_wrap(iom_buffer);
+
+	if (iom_chunk_busy(iom_buffer, iom_buffer->tail))
+		return EAGAIN;
+
+	ret = iom_chunk_copy(iom_buffer, iom_buffer->tail, buf, &encoded_len,
+			     max_size, &hdr_len);
+	if (ret)
+		return ret;
+
+	*buf_len = encoded_len;
+	iom_tail_inc(iom_buffer, hdr_len + encoded_len);
+
+	iom_reset_if_empty(iom_buffer);
+
+	return 0;
+}
+
+
+int iom_peek(struct iom_buffer *iom_buffer, unsigned char *buf,
+	     unsigned int *buf_len, unsigned int max_size)
+{
+	unsigned int hdr_len;
+
+	assert(iom_buffer);
+	assert(buf_len);
+	assert(max_size > 0);
+
+	if (!iom_cons_cnt(iom_buffer))
+		return EINVAL;
+
+	iom_tail_skip_wrap(iom_buffer);
+
+	if (iom_chunk_busy(iom_buffer, iom_buffer->tail))
+		return EAGAIN;
+
+	return iom_chunk_copy(iom_buffer, iom_buffer->tail, buf, buf_len,
+			      max_size, &hdr_len);
+}
+
+
+/*
+ * iom_peek_update() can be used after iom_peek() to
+ * remove the still remaining chunk from the buffer.
+ * A iom_peek() followed by a iom_peek_update() is
+ * functional identical to iom_shift().
+ *
+ * This function return 0 for success or any other value
+ * to indicate an error.
+ *
+ * o EINVAL indicates that no chunk was saved.
+ */
+int iom_peek_update(struct iom_buffer *iom_buffer)
+{
+	assert(iom_buffer);
+
+	if (!iom_cons_cnt(iom_buffer))
+		return EINVAL;
+
+	iom_tail_skip_wrap(iom_buffer);
+
+	if (iom_chunk_busy(iom_buffer, iom_buffer->tail))
+		return EAGAIN;
+
+	iom_tail_inc(iom_buffer, iom_chunk_size(iom_buffer, iom_buffer->tail));
+
+	iom_reset_if_empty(iom_buffer);
+
+	return 0;
+}
+
+
+/*
+ * iom_shift_view() is the zero copy variant of iom_peek(): iov[0]
+ * and, for a chunk wrapping around the end of the buffer, iov[1]
+ * point directly to the payload of the oldest chunk. The memory is
+ * valid until the chunk is removed with iom_shift_release() (or
+ * iom_peek_update()), which is the only consumer call allowed in
+ * between.
+ *
+ * Returns EINVAL if the buffer is empty and EAGAIN if the chunk is
+ * not committed yet (IOM_MPSC).
+ */
+int iom_shift_view(struct iom_buffer *iom_buffer, struct iovec iov[2],
+		   int *iovcnt)
+{
+	unsigned int hdr_len;
+
+	assert(iom_buffer);
+	assert(iov);
+	assert(iovcnt);
+
+	if (!iom_cons_cnt(iom_buffer))
+		return EINVAL;
+
+	iom_tail_skip_wrap(iom_buffer);
+
+	if (iom_chunk_busy(iom_buffer, iom_buffer->tail))
+		return EAGAIN;
+
+	iom_chunk_iov(iom_buffer, iom_buffer->tail, iov, iovcnt, &hdr_len);
+
+	return 0;
+}
+
+
+int iom_shift_release(struct iom_buffer *iom_buffer)
+{
+	return iom_peek_update(iom_buffer);
+}
+
+
+/*
+ * iom_shift_batch() hands up to max_chunks chunks to cb, zero copy
+ * like iom_shift_view(). The walk stops before the chunk which would
+ * exceed max_bytes - the first chunk is always passed - and when cb
+ * returns non-zero, that chunk is left in the buffer. Tail and the
+ * chunk count are updated once for the whole batch, *chunks is set
+ * to the number of chunks consumed.
+ *
+ * Returns EINVAL if the buffer is empty, EAGAIN if the first chunk is
+ * not committed yet (IOM_MPSC) or the value cb returned.
+ */
+int iom_shift_batch(struct iom_buffer *iom_buffer, unsigned int max_chunks,
+		    size_t max_bytes,
+		    int (*cb)(const struct iovec *iov, int iovcnt, void *arg),
+		    void *arg, unsigned int *chunks)
+{
+	const unsigned int mask = iom_buffer->size - 1;
+	struct iovec iov[2];
+	unsigned int len, hdr_len, n = 0;
+	size_t bytes = 0;
+	int ret = 0, iovcnt, pos, next, end;
+
+	assert(iom_buffer);
+	assert(cb);
+	assert(chunks);
+
+	*chunks = 0;
+
+	if (!iom_cons_cnt(iom_buffer))
+		return EINVAL;
+
+	end = iom_buffer->head_cache;
+	pos = iom_buffer->tail;
+	while (n < max_chunks && pos != end) {
+		pos = iom_chunk_pos(iom_buffer, pos);
+
+		if (iom_chunk_busy(iom_buffer, pos)) {
+			ret = n ? 0 : EAGAIN;
+			break;
+		}
+
+		len = iom_chunk_iov(iom_buffer, pos, iov, &iovcnt, &hdr_len);
+		if (n && bytes + len > max_bytes)
+			break;
+
+		/* the next cookie is needed right after cb returns */
+		next = (pos + hdr_len + len) & mask;
+		prefetch(&iom_buffer->buf[next]);
+
+		ret = cb(iov, iovcnt, arg);
+		if (ret)
+			break;
+
+		pos = next;
+		bytes += len;
+		n++;
+	}
+
+	if (pos != iom_buffer->tail)
+		iom_tail_publish(iom_buffer, pos, n);
+	*chunks = n;
+
+	iom_reset_if_empty(iom_buffer);
+
+	return ret;
+}
+
+
+struct iom_shiftv_ctx {
+	struct iovec *iov;
+	int n;
+};
+
+static int iom_shiftv_copy(const struct iovec *iov, int iovcnt, void *arg)
+{
+	struct iom_shiftv_ctx *ctx = arg;
+	struct iovec *dst = &ctx->iov[ctx->n];
+
+	if (iov[0].iov_len + (iovcnt == 2 ? iov[1].iov_len : 0) > dst->iov_len)
+		return ENOBUFS;
+
+	memcpy(dst->iov_base, iov[0].iov_base, iov[0].iov_len);
+	dst->iov_len = iov[0].iov_len;
+	if (iovcnt == 2) {
+		memcpy((unsigned char *)dst->iov_base + iov[0].iov_len,
+		       iov[1].iov_base, iov[1].iov_len);
+		dst->iov_len += iov[1].iov_len;
+	}
+	ctx->n++;
+
+	return 0;
+}
+
+
+/*
+ * iom_shift_batchv() copies one chunk into each of the iovcnt caller
+ * buffers and sets their iov_len to the chunk length. The batch ends
+ * at the first chunk which does not fit into its buffer, ENOBUFS is
+ * only returned if this is the very first one. Other return values
+ * as with iom_shift_batch().
+ */
+int iom_shift_batchv(struct iom_buffer *iom_buffer, struct iovec *iov,
+		     int iovcnt, unsigned int *chunks)
+{
+	struct iom_shiftv_ctx ctx;
+	int ret;
+
+	assert(iov);
+
+	ctx.iov = iov;
+	ctx.n   = 0;
+
+	ret = iom_shift_batch(iom_buffer, iovcnt, (size_t)-1, iom_shiftv_copy,
+			      &ctx, chunks);
+	if (ret == ENOBUFS && *chunks)
+		return 0;
+
+	return ret;
+}
+
+
+/*
+ * IOM_WAIT: sleep on word while it reads val, until deadline if set
+ */
+static int iom_park(struct iom_buffer *iom_buffer, int *word, int val,
+		    unsigned int *waiters, const struct timespec *deadline)
+{
+	struct timespec now, left, *timeout = NULL;
+	int ret = 0;
+
+	if (deadline) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left.tv_sec  = deadline->tv_sec - now.tv_sec;
+		left.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+		if (left.tv_nsec < 0) {
+			left.tv_sec--;
+			left.tv_nsec += 1000000000L;
+		}
+		if (left.tv_sec < 0)
+			return ETIMEDOUT;
+		timeout = &left;
+	}
+
+	/* see iom_wake() */
+	__atomic_fetch_add(waiters, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == val &&
+	    iom_futex(iom_buffer, word, FUTEX_WAIT, val, timeout) < 0)
+		ret = errno;
+	__atomic_fetch_sub(waiters, 1, __ATOMIC_RELAXED);
+
+	/* EAGAIN: word changed before we got to sleep */
+	return ret == EAGAIN ? 0 : ret;
+}
+
+
+static void iom_deadline(struct timespec *deadline, int timeout_ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec  += timeout_ms / 1000;
+	deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+
+/*
+ * IOM_WAIT: wait until a chunk can be shifted, for at most timeout_ms
+ * (-1: no limit). The consumer spins IOM_WAIT_SPIN rounds first and
+ * then sleeps on head in the kernel. Producers only make the wakeup
+ * syscall while a consumer sleeps.
+ *
+ * Returns 0, ETIMEDOUT, EINTR if a signal arrived, or EINVAL without
+ * IOM_WAIT. With IOM_MPSC the chunk may still be written, iom_shift()
+ * returns EAGAIN for that short moment.
+ */
+int iom_wait_readable(struct iom_buffer *iom_buffer, int timeout_ms)
+{
+	struct timespec deadline;
+	unsigned int spin;
+	int head, ret;
+
+	assert(iom_buffer);
+
+	if (!(iom_buffer->flags & IOM_WAIT))
+		return EINVAL;
+
+	for (spin = 0; spin < IOM_WAIT_SPIN; spin++) {
+		if (iom_cons_cnt(iom_buffer))
+			return 0;
+		if (!timeout_ms)
+			return ETIMEDOUT;
+		cpu_relax();
+	}
+
+	if (timeout_ms > 0)
+		iom_deadline(&deadline, timeout_ms);
+
+	for (;;) {
+		head = smp_load_acquire(iom_buffer->head);
+		if (iom_cnt_int(head, iom_buffer->tail, iom_buffer->size)) {
+			iom_buffer->head_cache = head;
+			return 0;
+		}
+
+		ret = iom_park(iom_buffer, &iom_buffer->head, head,
+			       &iom_buffer->rd_waiters,
+			       timeout_ms > 0 ? &deadline : NULL);
+		if (ret == ETIMEDOUT)
+			return iom_cons_cnt(iom_buffer) ? 0 : ETIMEDOUT;
+		if (ret)
+			return ret;
+	}
+}
+
+
+/*
+ * Space left for the next chunk, a producer's view
+ */
+static unsigned int iom_wait_space(struct iom_buffer *iom_buffer, int tail)
+{
+	int head = iom_buffer->head;
+
+	if (iom_buffer->flags & IOM_MPSC)
+		head = READ_ONCE(iom_buffer->resv) & (iom_buffer->size - 1);
+
+	return iom_space_int(head, tail, iom_buffer->size);
+}
+
+
+/*
+ * IOM_WAIT: wait until a chunk of len bytes can be pushed without
+ * dropping, the counterpart of iom_wait_readable() for producers,
+ * which sleep on tail. Returns EINVAL as well if len never fits.
+ * With IOM_MPSC another producer may take the space first.
+ */
+int iom_wait_writable(struct iom_buffer *iom_buffer, size_t len, int timeout_ms)
+{
+	struct timespec deadline;
+	struct iovec iov;
+	unsigned int spin, need;
+	int tail, ret;
+
+	assert(iom_buffer);
+
+	if (!(iom_buffer->flags & IOM_WAIT) || len > iom_len_max(iom_buffer))
+		return EINVAL;
+
+	/* IOM_NO_SPLIT may skip the end of buf, never with IOM_MPSC */
+	need = len + iom_hdr_len(iom_buffer, len);
+	if (iom_buffer->flags & IOM_NO_SPLIT) {
+		iov.iov_base = NULL;
+		iov.iov_len  = len;
+		need = iom_needv(iom_buffer, &iov, 1);
+	}
+	if (need > iom_buffer->size - 1)
+		return EINVAL;
+
+	for (spin = 0; spin < IOM_WAIT_SPIN; spin++) {
+		tail = smp_load_acquire(iom_buffer->tail);
+		if (iom_wait_space(iom_buffer, tail) >= need)
+			return 0;
+		if (!timeout_ms)
+			return ETIMEDOUT;
+		cpu_relax();
+	}
+
+	if (timeout_ms > 0)
+		iom_deadline(&deadline, timeout_ms);
+
+	for (;;) {
+		tail = smp_load_acquire(iom_buffer->tail);
+		if (iom_wait_space(iom_buffer, tail) >= need)
+			return 0;
+
+		ret = iom_park(iom_buffer, &iom_buffer->tail, tail,
+			       &iom_buffer->wr_waiters,
+			       timeout_ms > 0 ? &deadline : NULL);
+		if (ret == ETIMEDOUT) {
+			tail = smp_load_acquire(iom_buffer->tail);
+			return iom_wait_space(iom_buffer, tail) >= need ?
+			       0 : ETIMEDOUT;
+		}
+		if (ret)
+			return ret;
+	}
+}
+
+
+/*
+ * Attach an eventfd to the ring for epoll driven loops and return
+ * it in fd, readable (EPOLLIN) while events are pending. Events are
+ * edge triggered:
+ *
+ *   IOM_EV_READABLE  a push made the empty ring non-empty
+ *   IOM_EV_HIGH      the occupancy (iom_cnt()) rose above high
+ *   IOM_EV_LOW       it dropped to low or below after IOM_EV_HIGH
+ *
+ * HIGH and LOW alternate, a producer can stop at HIGH and resume at
+ * LOW before IOM_HEAD_DROP has to discard anything. high 0 leaves
+ * the watermarks off. Events are coalesced until iom_notify_read()
+ * collects them; a pending HIGH or LOW is replaced by a later
+ * crossing in the other direction.
+ *
+ * Call it before producer and consumer threads start, a second call
+ * sets new watermarks and returns the same fd. A ring which already
+ * holds data (or more than high) reports that right away. Closed by
+ * iom_free(). Not for rings shared between processes, the inline
+ * fast paths are not taken while attached.
+ */
+int iom_notify_fd(struct iom_buffer *iom_buffer, unsigned int low,
+		  unsigned int high, int *fd)
+{
+	unsigned int state;
+
+	assert(iom_buffer);
+	assert(fd);
+
+	/* an eventfd is only valid in this process, tail is no consumer */
+	if (iom_buffer->flags & (IOM_SHARED | IOM_BROADCAST))
+		return ENOTSUP;
+
+	if (high && (low >= high || high >= iom_cap(iom_buffer)))
+		return EINVAL;
+
+	if (!(iom_buffer->flags & IOM_NOTIFY)) {
+		iom_buffer->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (iom_buffer->evfd < 0)
+			return errno;
+		iom_buffer->ev_state = 0;
+		iom_buffer->flags |= IOM_NOTIFY;
+		if (iom_cnt(iom_buffer)) {
+			state = __atomic_fetch_or(&iom_buffer->ev_state,
+						  IOM_EV_READABLE,
+						  __ATOMIC_SEQ_CST);
+			iom_notify_post(iom_buffer, state);
+		}
+	}
+	iom_buffer->lo_wm = low;
+	iom_buffer->hi_wm = high;
+	iom_notify_level(iom_buffer);
+
+	*fd = iom_buffer->evfd;
+
+	return 0;
+}
+
+
+/*
+ * Collect the events pending since the last call and clear the
+ * eventfd. events may be 0 after a wakeup whose events an earlier
+ * call already took. EINVAL without iom_notify_fd().
+ */
+int iom_notify_read(struct iom_buffer *iom_buffer, unsigned int *events)
+{
+	uint64_t cnt;
+
+	assert(iom_buffer);
+	assert(events);
+
+	if (!(iom_buffer->flags & IOM_NOTIFY))
+		return EINVAL;
+
+	/* counter first: a post after the read finds nothing pending */
+	if (read(iom_buffer->evfd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		return errno;
+
+	*events = __atomic_fetch_and(&iom_buffer->ev_state, ~IOM_EV_ALL,
+				     __ATOMIC_SEQ_CST) & IOM_EV_ALL;
+
+	return 0;
+}
+
+
+/*
+ * Add len bytes of buf at pos to iov, split at the end of buf. The
+ * first *skip bytes are left out.
+ */
+static void iom_raw_iov(struct iom_buffer *iom_buffer, int pos, size_t len,
+			struct iovec *iov, int *iovcnt, unsigned int *skip)
+{
+	size_t to_end, n;
+
+	pos = (pos + *skip) & (iom_buffer->size - 1);
+	len -= *skip;
+	*skip = 0;
+
+	to_end = iom_buffer->size - pos;
+	if (iom_buffer->flags & IOM_MAGIC_RING)
+		to_end = len;
+
+	n = min(len, to_end);
+	iov[*iovcnt].iov_base = &iom_buffer->buf[pos];
+	iov[*iovcnt].iov_len  = n;
+	(*iovcnt)++;
+	if (n < len) {
+		iov[*iovcnt].iov_base = &iom_buffer->buf[0];
+		iov[*iovcnt].iov_len  = len - n;
+		(*iovcnt)++;
+	}
+}
+
+
+/*
+ * iom_drain_to_fd() writes as many chunks as fit into one writev()
+ * to fd - the payload only or, with IOM_FD_FRAMED, each payload
+ * behind its header in the encoding of buf. Tail advances by
+ * exactly what fd accepted, a partially written chunk is continued
+ * by the next call. Until then no other consumer call may be used.
+ * *written is set to the number of bytes written.
+ *
+ * Returns EINVAL if the buffer is empty, EAGAIN if the first chunk is
+ * not committed yet (IOM_MPSC) or the errno of writev().
+ */
+int iom_drain_to_fd(struct iom_buffer *iom_buffer, int fd, int flags,
+		    size_t *written)
+{
+	const unsigned int mask = iom_buffer->size - 1;
+	struct iovec iov[IOM_FD_IOV_MAX];
+	unsigned int len, size, hdr_len, n, chunks = 0, skip;
+	size_t bytes;
+	ssize_t ret;
+	int iovcnt = 0, segcnt, pos, end;
+
+	assert(iom_buffer);
+	assert(written);
+
+	*written = 0;
+
+	if (!iom_cons_cnt(iom_buffer))
+		return EINVAL;
+
+	end  = iom_buffer->head_cache;
+	pos  = iom_buffer->tail;
+	skip = iom_buffer->drain_off;
+	while (pos != end && iovcnt <= IOM_FD_IOV_MAX - 2) {
+		pos = iom_chunk_pos(iom_buffer, pos);
+		if (iom_chunk_busy(iom_buffer, pos))
+			break;
+
+		len = iom_chunk_iov(iom_buffer, pos, &iov[iovcnt], &segcnt,
+				    &hdr_len);
+		if (flags & IOM_FD_FRAMED) {
+			iom_raw_iov(iom_buffer, pos, hdr_len + len, iov, &iovcnt,
+				    &skip);
+		} else if (skip) {
+			/* payload bytes, skip is below len */
+			iom_raw_iov(iom_buffer, (pos + hdr_len) & mask, len,
+				    iov, &iovcnt, &skip);
+		} else {
+			iovcnt += segcnt;
+		}
+		pos = (pos + hdr_len + len) & mask;
+	}
+
+	if (!iovcnt)
+		return EAGAIN;
+
+	do {
+		ret = writev(fd, iov, iovcnt);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return errno;
+	*written = ret;
+
+	/* walk the written chunks again, tail only moves chunk wise */
+	bytes = ret + iom_buffer->drain_off;
+	pos = iom_buffer->tail;
+	while (pos != end) {
+		pos = iom_chunk_pos(iom_buffer, pos);
+		size = iom_chunk_size(iom_buffer, pos);
+		n = (flags & IOM_FD_FRAMED) ? size : iom_chunk_len(iom_buffer, pos);
+		if (bytes < n || iom_chunk_busy(iom_buffer, pos))
+			break;
+		bytes -= n;
+		pos = (pos + size) & mask;
+		chunks++;
+	}
+
+	iom_buffer->drain_off = bytes;
+	if (pos != iom_buffer->tail)
+		iom_tail_publish(iom_buffer, pos, chunks);
+
+	iom_reset_if_empty(iom_buffer);
+
+	return 0;
+}
+
+
+/*
+ * Largest payload a single chunk can take right now
+ */
+static size_t iom_fill_room(struct iom_buffer *iom_buffer)
+{
+	size_t space, to_end, room, hdr_len;
+
+	space = iom_prod_space(iom_buffer, iom_buffer->size);
+	/* the header for space is at least as wide as for any room */
+	hdr_len = iom_hdr_len(iom_buffer, space);
+	if (space <= hdr_len)
+		return 0;
+	room = space - hdr_len;
+
+	if (iom_buffer->flags & IOM_NO_SPLIT) {
+		/* in front of the end or after a wrap marker at the start */
+		to_end = iom_space_to_bound(iom_buffer, iom_buffer->head);
+		room = min(to_end, space);
+		room = room > hdr_len ? room - hdr_len : 0;
+		if (space > to_end + hdr_len)
+			room = max(room, space - to_end - hdr_len);
+	}
+
+	return min(room, iom_len_max(iom_buffer));
+}
+
+
+/*
+ * IOM_FD_FRAMED: the stream uses the encoding of buf, read straight
+ * into the free space and publish every complete frame
+ */
+static int iom_fill_framed(struct iom_buffer *iom_buffer, int fd,
+			   size_t max_len, size_t *nread)
+{
+	const unsigned int mask = iom_buffer->size - 1;
+	struct iovec iov[2];
+	unsigned int chunks = 0, pend, len, hdr_len, skip = 0;
+	size_t space;
+	ssize_t ret;
+	int iovcnt = 0, head, err = 0;
+
+	space = iom_prod_space(iom_buffer, iom_buffer->size);
+	if (space <= iom_buffer->fill_pend)
+		return ENOBUFS;
+	space = min(space - iom_buffer->fill_pend, max_len);
+
+	iom_raw_iov(iom_buffer, iom_buffer->head + iom_buffer->fill_pend,
+		    space, iov, &iovcnt, &skip);
+	do {
+		ret = readv(fd, iov, iovcnt);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return errno;
+	*nread = ret;
+
+	head = iom_buffer->head;
+	pend = iom_buffer->fill_pend + ret;
+	while (pend) {
+		/* the first byte tells the header width */
+		if ((iom_buffer->flags & IOM_VARINT) && iom_buffer->buf[head] >= 0xf0) {
+			err = EPROTO;
+			break;
+		}
+		len = iom_hdr_get(iom_buffer, head, &hdr_len);
+		if (pend < hdr_len)
+			break;
+		if (len + hdr_len > iom_buffer->size - 1) {
+			err = EPROTO;
+			break;
+		}
+		if (pend < len + hdr_len)
+			break;
+		pend -= len + hdr_len;
+		head = (head + len + hdr_len) & mask;
+		chunks++;
+	}
+
+	/* the frames in front of a broken one are good */
+	iom_buffer->fill_pend = pend;
+	if (chunks)
+		iom_head_publish(iom_buffer, head, chunks);
+
+	return err;
+}
+
+
+/*
+ * iom_fill_from_fd() reads up to max_len bytes from fd with readv()
+ * straight into the free space. By default whatever one read returns
+ * becomes one chunk. With IOM_FD_FRAMED fd delivers the stream
+ * iom_drain_to_fd() writes with that flag: each complete frame
+ * becomes a chunk, an incomplete one is kept beyond head until the
+ * rest arrives - no other push may be used in between. *nread is set
+ * to the number of bytes read, 0 is end of file.
+ *
+ * Returns ENOBUFS if there is no free space, EPROTO for a frame which
+ * can never fit into the buffer - the frames in front of it are
+ * published, ENOTSUP for IOM_MPSC (and framed
+ * with IOM_NO_SPLIT) or the errno of readv().
+ */
+int iom_fill_from_fd(struct iom_buffer *iom_buffer, int fd, size_t max_len,
+		     int flags, size_t *nread)
+{
+	struct iom_reservation res;
+	size_t room;
+	ssize_t ret;
+	int err;
+
+	assert(iom_buffer);
+	assert(nread);
+
+	*nread = 0;
+
+	if (iom_buffer->flags & IOM_MPSC)
+		return ENOTSUP;
+
+	if (flags & IOM_FD_FRAMED) {
+		if (iom_buffer->flags & IOM_NO_SPLIT)
+			return ENOTSUP;
+		return iom_fill_framed(iom_buffer, fd, max_len, nread);
+	}
+
+	room = min(iom_fill_room(iom_buffer), max_len);
+	if (!room)
+		return ENOBUFS;
+
+	err = iom_push_reserve(iom_buffer, &res, room, IOM_TAIL_DROP);
+	if (err)
+		return err;
+
+	do {
+		ret = readv(fd, res.iov, res.iovcnt);
+	} while (ret < 0 && errno == EINTR);
+	if (ret <= 0) {
+		err = ret < 0 ? errno : 0;
+		iom_push_cancel(iom_buffer, &res);
+		return err;
+	}
+
+	*nread = ret;
+
+	return iom_push_commit(iom_buffer, &res, ret);
+}
+
+
+struct iom_iterator *iom_iterator_new(struct iom_buffer *iom_buffer)
+{
+	struct iom_iterator *iom_iterator;
+
+	iom_iterator = malloc(sizeof(*iom_iterator));
+	if (!iom_iterator)
+		return NULL;
+
+	memset(iom_iterator, 0, sizeof(*iom_iterator));
+	iom_iterator->head = smp_load_acquire(iom_buffer->head);
+	iom_iterator->tail = iom_buffer->tail;
+
+	return iom_iterator;
+}
+
+
+void iom_iterator_free(struct iom_iterator *iom_iterator)
+{
+	free(iom_iterator);
+}
+
+
+int iom_iterator_peek_next(struct iom_iterator *iom_iterator,
+			   struct iom_buffer *iom_buffer,
+			   unsigned char *buf, int *buf_len, int max_size)
+{
+	unsigned int encoded_len, hdr_len;
+	int ret;
+
+	assert(iom_buffer);
+	assert(max_size);
+	assert(buf_len);
+
+	if (!iom_cnt_int(iom_iterator->head, iom_iterator->tail, iom_buffer->size))
+		return EINVAL;
+
+	iom_iterator->tail = iom_chunk_pos(iom_buffer, iom_iterator->tail);
+
+	if (iom_chunk_busy(iom_buffer, iom_iterator->tail))
+		return EAGAIN;
+
+	ret = iom_chunk_copy(iom_buffer, iom_iterator->tail, buf, &encoded_len,
+			     max_size, &hdr_len);
+	if (ret)
+		return ret;
+
+	*buf_len = encoded_len;
+	iom_iterator->tail = iom_tail_inc_int(iom_iterator->tail,
+					      iom_buffer->size,
+					      hdr_len + encoded_len);
+
+	return 0;
+}
+
+
+/*
+ * IOM_BROADCAST: attach a reader. The cursor starts at head, it
+ * sees the chunks pushed from now on and holds back the producer
+ * (ENOBUFS) until it read them. With IOM_CURSOR_DETACH a cursor
+ * which holds up a push is detached instead, then every call on it
+ * returns EPIPE and iom_cursor_free() is all that is left to do.
+ *
+ * Up to IOM_CURSOR_MAX cursors, ENOBUFS beyond. Cursors may be
+ * created and freed on any thread at any time, each is used by a
+ * single thread.
+ */
+int iom_cursor_new(struct iom_buffer *iom_buffer, unsigned flags,
+		   struct iom_cursor **cursor)
+{
+	struct iom_bcast *bcast;
+	struct iom_cursor *c;
+	unsigned int state;
+	int head;
+
+	assert(iom_buffer);
+	assert(cursor);
+
+	if (!(iom_buffer->flags & IOM_BROADCAST) || (flags & ~IOM_CURSOR_DETACH))
+		return EINVAL;
+
+	bcast = iom_buffer->bcast;
+	for (c = bcast->cursor; c < &bcast->cursor[IOM_CURSOR_MAX]; c++) {
+		state = 0;
+		if (__atomic_compare_exchange_n(&c->state, &state,
+						IOM_CURSOR_GONE, 0,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			break;
+	}
+	if (c == &bcast->cursor[IOM_CURSOR_MAX])
+		return ENOBUFS;
+
+	/*
+	 * A producer which does not see the slot yet may move tail up
+	 * to its head. It either reads joining and leaves tail alone,
+	 * or its head is what we read here - a position at or after
+	 * its tail. All later refreshes see the slot.
+	 */
+	__atomic_fetch_add(&bcast->joining, 1, __ATOMIC_SEQ_CST);
+	head = __atomic_load_n(&iom_buffer->head, __ATOMIC_SEQ_CST);
+	state = IOM_CURSOR_USED | head;
+	if (flags & IOM_CURSOR_DETACH)
+		state |= IOM_CURSOR_WEAK;
+	__atomic_store_n(&c->state, state, __ATOMIC_SEQ_CST);
+	__atomic_fetch_sub(&bcast->joining, 1, __ATOMIC_SEQ_CST);
+
+	c->head_cache = head;
+	c->iom_buffer = iom_buffer;
+	*cursor = c;
+
+	return 0;
+}
+
+
+/*
+ * Detach the reader and give the slot back
+ */
+void iom_cursor_free(struct iom_cursor *cursor)
+{
+	assert(cursor);
+
+	__atomic_store_n(&cursor->state, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Position of the next chunk for the cursor. EINVAL if it read all
+ * there is, EPIPE if it was detached.
+ */
+static int iom_cursor_pos(struct iom_cursor *cursor, unsigned int state,
+			  int *pos)
+{
+	struct iom_buffer *iom_buffer = cursor->iom_buffer;
+	int p = state & IOM_CURSOR_POS;
+
+	if (state & IOM_CURSOR_GONE)
+		return EPIPE;
+
+	if (!iom_cnt_int(cursor->head_cache, p, iom_buffer->size)) {
+		cursor->head_cache = smp_load_acquire(iom_buffer->head);
+		if (!iom_cnt_int(cursor->head_cache, p, iom_buffer->size))
+			return EINVAL;
+	}
+
+	*pos = iom_chunk_pos(iom_buffer, p);
+
+	return 0;
+}
+
+
+/*
+ * Move the cursor past the chunk of size bytes at pos. Fails if the
+ * producer detached it meanwhile, what was read may have been
+ * overwritten then.
+ */
+static int iom_cursor_move(struct iom_cursor *cursor, unsigned int state,
+			   int pos, unsigned int size)
+{
+	unsigned int new;
+
+	new = (state & ~IOM_CURSOR_POS) |
+	      iom_tail_inc_int(pos, cursor->iom_buffer->size, size);
+	if (!__atomic_compare_exchange_n(&cursor->state, &state, new, 0,
+					 __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		return EPIPE;
+
+	return 0;
+}
+
+
+/*
+ * Describe the chunk at pos like iom_chunk_iov(). The producer may
+ * already have overwritten the header for a detached cursor, so the
+ * length is checked against what was pushed and the detach is
+ * checked again before the iovec is used: EPIPE for either.
+ */
+static int iom_cursor_chunk(struct iom_cursor *cursor, int pos,
+			    struct iovec iov[2], int *iovcnt,
+			    unsigned int *encoded_len, unsigned int *hdr_len)
+{
+	struct iom_buffer *iom_buffer = cursor->iom_buffer;
+
+	*encoded_len = iom_chunk_iov(iom_buffer, pos, iov, iovcnt, hdr_len);
+
+	/* the header above is read before the detach flag */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&cursor->state, __ATOMIC_RELAXED) & IOM_CURSOR_GONE)
+		return EPIPE;
+
+	if (*hdr_len + *encoded_len >
+	    iom_cnt_int(cursor->head_cache, pos, iom_buffer->size))
+		return EPIPE;
+
+	return 0;
+}
+
+
+/*
+ * Like iom_shift() for one reader. EINVAL if the cursor read all
+ * chunks, EPIPE if it is detached - the chunk copied last is void.
+ */
+int iom_cursor_shift(struct iom_cursor *cursor, unsigned char *buf,
+		     unsigned int *buf_len, unsigned int max_size)
+{
+	unsigned int state, encoded_len, hdr_len;
+	struct iovec iov[2];
+	int pos, ret, iovcnt;
+
+	assert(cursor);
+	assert(buf_len);
+	assert(max_size);
+
+	state = __atomic_load_n(&cursor->state, __ATOMIC_RELAXED);
+	ret = iom_cursor_pos(cursor, state, &pos);
+	if (ret)
+		return ret;
+
+	ret = iom_cursor_chunk(cursor, pos, iov, &iovcnt, &encoded_len,
+			       &hdr_len);
+	if (ret)
+		return ret;
+
+	if (encoded_len > max_size)
+		return ENOBUFS;
+
+	memcpy(buf, iov[0].iov_base, iov[0].iov_len);
+	if (iovcnt == 2)
+		memcpy(&buf[iov[0].iov_len], iov[1].iov_base, iov[1].iov_len);
+
+	ret = iom_cursor_move(cursor, state, pos, hdr_len + encoded_len);
+	if (ret)
+		return ret;
+
+	*buf_len = encoded_len;
+
+	return 0;
+}
+
+
+/*
+ * Zero copy read of the next chunk, see iom_shift_view(). Valid until
+ * iom_cursor_release(), which returns EPIPE if the cursor has been
+ * detached in between - the payload may have been overwritten then.
+ */
+int iom_cursor_view(struct iom_cursor *cursor, struct iovec iov[2],
+		    int *iovcnt)
+{
+	unsigned int encoded_len, hdr_len;
+	int pos, ret;
+
+	assert(cursor);
+	assert(iov);
+	assert(iovcnt);
+
+	ret = iom_cursor_pos(cursor,
+			     __atomic_load_n(&cursor->state, __ATOMIC_RELAXED),
+			     &pos);
+	if (ret)
+		return ret;
+
+	return iom_cursor_chunk(cursor, pos, iov, iovcnt, &encoded_len,
+				&hdr_len);
+}
+
+
+int iom_cursor_release(struct iom_cursor *cursor)
+{
+	unsigned int state;
+	int pos, ret;
+
+	assert(cursor);
+
+	state = __atomic_load_n(&cursor->state, __ATOMIC_RELAXED);
+	ret = iom_cursor_pos(cursor, state, &pos);
+	if (ret)
+		return ret;
+
+	return iom_cursor_move(cursor, state, pos,
+			       iom_chunk_size(cursor->iom_buffer, pos));
+}
+
+
+/*
+ * Bytes pushed but not yet read by the cursor, how far the reader
+ * lags behind the producer. May be called from any thread, e.g. to
+ * watch all readers. EPIPE once detached.
+ */
+int iom_cursor_lag(struct iom_cursor *cursor, unsigned int *lag)
+{
+	struct iom_buffer *iom_buffer;
+	unsigned int state;
+
+	assert(cursor);
+	assert(lag);
+
+	state = __atomic_load_n(&cursor->state, __ATOMIC_ACQUIRE);
+	if (state & IOM_CURSOR_GONE)
+		return EPIPE;
+
+	iom_buffer = cursor->iom_buffer;
+	*lag = iom_cnt_int(smp_load_acquire(iom_buffer->head),
+			   state & IOM_CURSOR_POS, iom_buffer->size);
+
+	return 0;
+}
+
+
+size_t iom_nearest_power_two(size_t k)
+{
+	size_t i;
+
+	if (k == 1) return 2;
+	k--;
+	for (i = 1; i < sizeof(size_t) * CHAR_BIT; i <<= 1)
+		k = k | k >> i;
+	return k + 1;
+}
+
+
+/*
+ * iom_pool: rings of power of two size classes carved out of large
+ * slabs. Each thread keeps a small magazine of free rings per class
+ * and only takes the class lock to exchange IOM_POOL_BATCH rings
+ * with the shared freelist, or to carve a new slab.
+ */
+#define	IOM_POOL_CLASSES  16
+#define	IOM_POOL_BATCH    32
+#define	IOM_POOL_CACHE    (2 * IOM_POOL_BATCH)
+
+struct iom_pool_item {
+	struct iom_pool_item *next;
+};
+
+struct iom_pool_slab {
+	struct iom_pool_slab *next;
+	size_t len;
+};
+
+struct iom_pool_class {
+	pthread_mutex_t lock;
+	struct iom_pool_item *free;
+	size_t size;
+	size_t stride;
+} __cacheline_aligned;
+
+struct iom_pool_cache {
+	struct iom_pool *pool;
+	struct iom_pool_cache *next, *prev;
+	struct iom_pool_item *free[IOM_POOL_CLASSES];
+	unsigned int cnt[IOM_POOL_CLASSES];
+};
+
+struct iom_pool {
+	unsigned int flags;
+	unsigned int nclasses;
+	size_t slab_size;
+	pthread_key_t key;
+	pthread_mutex_t lock;
+	struct iom_pool_slab *slabs;
+	struct iom_pool_cache *caches;
+	struct iom_pool_class class[IOM_POOL_CLASSES];
+};
+
+
+static void *iom_pool_map(struct iom_pool *pool, size_t len)
+{
+	void *p = MAP_FAILED;
+
+	if (pool->flags & IOM_POOL_HUGEPAGE) {
+#ifdef MAP_HUGETLB
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+		if (p != MAP_FAILED)
+			return p;
+	}
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+#ifdef MADV_HUGEPAGE
+	/* no reserved huge pages, transparent ones may still do */
+	if (pool->flags & IOM_POOL_HUGEPAGE)
+		madvise(p, len, MADV_HUGEPAGE);
+#endif
+
+	return p;
+}
+
+
+/*
+ * Carve a new slab for class c into its shared freelist, called
+ * with the class lock held
+ */
+static int iom_pool_grow(struct iom_pool *pool, unsigned int c)
+{
+	struct iom_pool_class *cl = &pool->class[c];
+	struct iom_pool_slab *slab;
+	struct iom_pool_item *item;
+	size_t hdr = IOM_CACHELINE_SIZE, len, off;
+
+	len = max(pool->slab_size, hdr + cl->stride);
+	/* huge page mappings need a multiple of the huge page size */
+	len = (len + IOM_HUGEPAGE_SIZE - 1) & ~(IOM_HUGEPAGE_SIZE - 1);
+
+	slab = iom_pool_map(pool, len);
+	if (!slab)
+		return ENOBUFS;
+	slab->len = len;
+
+	pthread_mutex_lock(&pool->lock);
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	pthread_mutex_unlock(&pool->lock);
+
+	for (off = hdr; off + cl->stride <= len; off += cl->stride) {
+		item = (struct iom_pool_item *)((unsigned char *)slab + off);
+		item->next = cl->free;
+		cl->free = item;
+	}
+
+	return 0;
+}
+
+
+static void iom_pool_cache_flush(struct iom_pool_cache *cache, unsigned int c,
+				 unsigned int n)
+{
+	struct iom_pool_class *cl = &cache->pool->class[c];
+	struct iom_pool_item *item;
+
+	pthread_mutex_lock(&cl->lock);
+	while (n-- && cache->free[c]) {
+		item = cache->free[c];
+		cache->free[c] = item->next;
+		cache->cnt[c]--;
+		item->next = cl->free;
+		cl->free = item;
+	}
+	pthread_mutex_unlock(&cl->lock);
+}
+
+
+/*
+ * Thread exit: hand the magazines back to the shared freelists
+ */
+static void iom_pool_cache_release(void *arg)
+{
+	struct iom_pool_cache *cache = arg;
+	struct iom_pool *pool = cache->pool;
+	unsigned int c;
+
+	for (c = 0; c < pool->nclasses; c++)
+		iom_pool_cache_flush(cache, c, UINT_MAX);
+
+	pthread_mutex_lock(&pool->lock);
+	if (cache->prev)
+		cache->prev->next = cache->next;
+	else
+		pool->caches = cache->next;
+	if (cache->next)
+		cache->next->prev = cache->prev;
+	pthread_mutex_unlock(&pool->lock);
+
+	free(cache);
+}
+
+
+static struct iom_pool_cache *iom_pool_cache(struct iom_pool *pool)
+{
+	struct iom_pool_cache *cache = pthread_getspecific(pool->key);
+
+	if (cache)
+		return cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+	cache->pool = pool;
+
+	if (pthread_setspecific(pool->key, cache)) {
+		free(cache);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	cache->next = pool->caches;
+	if (pool->caches)
+		pool->caches->prev = cache;
+	pool->caches = cache;
+	pthread_mutex_unlock(&pool->lock);
+
+	return cache;
+}
+
+
+/*
+ * iom_pool_new() prepares size classes from min_size up to max_size
+ * (both rounded up to a power of two). slab_size is the amount of
+ * memory mapped at once, rounded up to IOM_HUGEPAGE_SIZE. With IOM_POOL_HUGEPAGE
+ * slabs are backed by huge pages if the system has any reserved,
+ * transparent huge pages are requested otherwise.
+ */
+int iom_pool_new(struct iom_pool **iom_pool, size_t min_size,
+		 size_t max_size, size_t slab_size, unsigned flags)
+{
+	struct iom_pool *pool;
+	unsigned int c;
+	size_t size;
+
+	assert(iom_pool);
+
+	if ((flags & ~IOM_POOL_HUGEPAGE) || !min_size || !max_size)
+		return EINVAL;
+
+	min_size = iom_nearest_power_two(min_size);
+	max_size = iom_nearest_power_two(max_size);
+	if (max_size < min_size || max_size / min_size >= (1U << IOM_POOL_CLASSES))
+		return EINVAL;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return ENOBUFS;
+
+	if (pthread_key_create(&pool->key, iom_pool_cache_release)) {
+		free(pool);
+		return ENOBUFS;
+	}
+
+	pool->flags = flags;
+	pool->slab_size = slab_size;
+	pthread_mutex_init(&pool->lock, NULL);
+	for (c = 0, size = min_size; size <= max_size; c++, size <<= 1) {
+		pthread_mutex_init(&pool->class[c].lock, NULL);
+		pool->class[c].size = size;
+		pool->class[c].stride = (sizeof(struct iom_buffer) + size +
+					 IOM_CACHELINE_SIZE - 1) &
+					~(size_t)(IOM_CACHELINE_SIZE - 1);
+	}
+	pool->nclasses = c;
+
+	*iom_pool = pool;
+
+	return 0;
+}
+
+
+/*
+ * iom_pool_get() is the pool counterpart of iom_init(): a ring of at
+ * least size bytes, flags as with iom_init() except IOM_MAGIC_RING,
+ * IOM_MAINLY_EMPTY and the IOM_ALLOC_FLAGS which need a mapping of
+ * their own (the pool has IOM_POOL_HUGEPAGE for its slabs).
+ */
+int iom_pool_get(struct iom_pool *pool, size_t size,
+		 struct iom_buffer **iom_buffer, unsigned flags)
+{
+	struct iom_pool_cache *cache;
+	struct iom_pool_class *cl;
+	struct iom_pool_item *item;
+	unsigned int c, n;
+	int ret;
+
+	assert(pool);
+	assert(iom_buffer);
+
+	ret = iom_check_flags(flags);
+	if (ret)
+		return ret;
+
+	if (flags & (IOM_MAGIC_RING | IOM_MAINLY_EMPTY | IOM_ALLOC_FLAGS |
+		     IOM_GROW_MASK | IOM_BROADCAST))
+		return EINVAL;
+
+	for (c = 0; c < pool->nclasses && pool->class[c].size < size; c++)
+		;
+	if (c == pool->nclasses)
+		return EINVAL;
+
+	cache = iom_pool_cache(pool);
+	if (!cache)
+		return ENOBUFS;
+
+	if (!cache->free[c]) {
+		/* refill the magazine from the shared freelist */
+		cl = &pool->class[c];
+		pthread_mutex_lock(&cl->lock);
+		if (!cl->free && iom_pool_grow(pool, c)) {
+			pthread_mutex_unlock(&cl->lock);
+			return ENOBUFS;
+		}
+		for (n = 0; n < IOM_POOL_BATCH && cl->free; n++) {
+			item = cl->free;
+			cl->free = item->next;
+			item->next = cache->free[c];
+			cache->free[c] = item;
+			cache->cnt[c]++;
+		}
+		pthread_mutex_unlock(&cl->lock);
+	}
+
+	item = cache->free[c];
+	cache->free[c] = item->next;
+	cache->cnt[c]--;
+
+	*iom_buffer = (struct iom_buffer *)item;
+	iom_setup(*iom_buffer, pool->class[c].size, flags | IOM_POOLED);
+
+	return 0;
+}
+
+
+/*
+ * iom_pool_put() is the pool counterpart of iom_free(), any thread
+ * may return a ring
+ */
+void iom_pool_put(struct iom_pool *pool, struct iom_buffer *iom_buffer)
+{
+	struct iom_pool_cache *cache;
+	struct iom_pool_item *item = (struct iom_pool_item *)iom_buffer;
+	unsigned int c;
+
+	assert(pool);
+	assert(iom_buffer);
+	assert(iom_buffer->flags & IOM_POOLED);
+
+	for (c = 0; c < pool->nclasses; c++)
+		if (pool->class[c].size == iom_buffer->size)
+			break;
+	assert(c < pool->nclasses);
+	if (c == pool->nclasses)
+		return;
+
+	if (iom_buffer->flags & IOM_NOTIFY)
+		close(iom_buffer->evfd);
+
+	cache = iom_pool_cache(pool);
+	if (!cache) {
+		pthread_mutex_lock(&pool->class[c].lock);
+		item->next = pool->class[c].free;
+		pool->class[c].free = item;
+		pthread_mutex_unlock(&pool->class[c].lock);
+		return;
+	}
+
+	item->next = cache->free[c];
+	cache->free[c] = item;
+	if (++cache->cnt[c] > IOM_POOL_CACHE)
+		iom_pool_cache_flush(cache, c, IOM_POOL_BATCH);
+}
+
+
+/*
+ * Unmap all slabs. Every ring of the pool must have been returned,
+ * or at least be out of use.
+ */
+void iom_pool_free(struct iom_pool *pool)
+{
+	struct iom_pool_slab *slab;
+	struct iom_pool_cache *cache;
+	unsigned int c;
+
+	assert(pool);
+
+	pthread_key_delete(pool->key);
+
+	while ((cache = pool->caches)) {
+		pool->caches = cache->next;
+		free(cache);
+	}
+
+	while ((slab = pool->slabs)) {
+		pool->slabs = slab->next;
+		munmap(slab, slab->len);
+	}
+
+	for (c = 0; c < pool->nclasses; c++)
+		pthread_mutex_destroy(&pool->class[c].lock);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+
+/*
+ * iom_segq: FIFO without a fixed bound, built from iom_buffer
+ * segments of equal size. The producer links a new segment behind
+ * the full one, the consumer hands every segment it drained back to
+ * a freelist of up to keep segments. Only these segment changes
+ * take the lock, so push and shift cost the same as on a single ring
+ * and memory follows the backlog. With IOM_SPSC one producer and one
+ * consumer thread may work concurrently, as with iom_buffer.
+ */
+struct iom_segq_seg {
+	struct iom_segq_seg *next;
+	struct iom_buffer *ring;
+};
+
+struct iom_segq {
+	size_t seg_size;
+	unsigned int flags;
+	unsigned int keep;
+
+	/* producer side */
+	struct iom_segq_seg *head __cacheline_aligned;
+	unsigned int pushed;
+
+	/* consumer side */
+	struct iom_segq_seg *tail __cacheline_aligned;
+	unsigned int shifted;
+
+	pthread_mutex_t lock __cacheline_aligned;
+	struct iom_segq_seg *free;
+	unsigned int nfree;
+};
+
+struct iom_segq_iterator {
+	struct iom_segq_seg *seg;
+	struct iom_iterator it;
+};
+
+
+static struct iom_segq_seg *iom_segq_seg_get(struct iom_segq *q)
+{
+	struct iom_segq_seg *seg;
+
+	pthread_mutex_lock(&q->lock);
+	seg = q->free;
+	if (seg) {
+		q->free = seg->next;
+		q->nfree--;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	if (!seg) {
+		seg = malloc(sizeof(*seg));
+		if (!seg)
+			return NULL;
+		if (iom_init(q->seg_size, &seg->ring, q->flags)) {
+			free(seg);
+			return NULL;
+		}
+	}
+	seg->next = NULL;
+
+	return seg;
+}
+
+
+static void iom_segq_seg_put(struct iom_segq *q, struct iom_segq_seg *seg)
+{
+	iom_reset(seg->ring);
+
+	pthread_mutex_lock(&q->lock);
+	if (q->nfree < q->keep) {
+		seg->next = q->free;
+		q->free = seg;
+		q->nfree++;
+		seg = NULL;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	if (seg) {
+		iom_free(seg->ring);
+		free(seg);
+	}
+}
+
+
+/*
+ * iom_segq_init() creates a queue of segments of seg_size bytes
+ * (a power of two), keeping up to keep drained segments for reuse.
+ * flags are those of iom_init() except IOM_MPSC and IOM_GROW_MAX.
+ * Chunks must fit into a single segment.
+ */
+int iom_segq_init(struct iom_segq **iom_segq, size_t seg_size,
+		  unsigned int keep, unsigned flags)
+{
+	struct iom_segq *q;
+	int ret;
+
+	assert(iom_segq);
+
+	ret = iom_check_flags(flags);
+	if (ret)
+		return ret;
+
+	if (flags & (IOM_MPSC | IOM_GROW_MASK | IOM_BROADCAST))
+		return EINVAL;
+
+	if (seg_size == 0 || (seg_size & (seg_size - 1)))
+		return EINVAL;
+
+	if (posix_memalign((void **)&q, IOM_CACHELINE_SIZE, sizeof(*q)))
+		return ENOBUFS;
+	memset(q, 0, sizeof(*q));
+
+	q->seg_size = seg_size;
+	q->flags = flags;
+	q->keep = keep;
+	pthread_mutex_init(&q->lock, NULL);
+
+	q->head = q->tail = iom_segq_seg_get(q);
+	if (!q->head) {
+		pthread_mutex_destroy(&q->lock);
+		free(q);
+		return ENOBUFS;
+	}
+
+	*iom_segq = q;
+
+	return 0;
+}
+
+
+void iom_segq_free(struct iom_segq *q)
+{
+	struct iom_segq_seg *seg;
+
+	assert(q);
+
+	q->keep = 0;
+	while (q->free) {
+		seg = q->free;
+		q->free = seg->next;
+		iom_free(seg->ring);
+		free(seg);
+	}
+
+	while ((seg = q->tail)) {
+		q->tail = seg->next;
+		iom_free(seg->ring);
+		free(seg);
+	}
+
+	pthread_mutex_destroy(&q->lock);
+	free(q);
+}
+
+
+/*
+ * Never drops: ENOBUFS only if no new segment can be allocated,
+ * EINVAL for a chunk that does not fit into an empty segment
+ */
+int iom_segq_push(struct iom_segq *q, unsigned char *buf, size_t len)
+{
+	struct iom_segq_seg *seg;
+	int ret;
+
+	assert(q);
+
+	/* a ring holds one byte less than its size */
+	if (len + iom_hdr_len(q->head->ring, len) > q->seg_size - 1)
+		return EINVAL;
+
+	ret = iom_push(q->head->ring, buf, len, IOM_TAIL_DROP);
+	if (ret == ENOBUFS) {
+		seg = iom_segq_seg_get(q);
+		if (!seg)
+			return ENOBUFS;
+		ret = iom_push(seg->ring, buf, len, IOM_TAIL_DROP);
+		if (ret) {
+			iom_segq_seg_put(q, seg);
+			return ret;
+		}
+		/* the old segment is complete before the consumer sees next */
+		smp_store_release(q->head->next, seg);
+		q->head = seg;
+	}
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(q->pushed, q->pushed + 1);
+
+	return 0;
+}
+
+
+/*
+ * Move the consumer to the next segment if the current one is
+ * drained, returns 0 if there is none
+ */
+static int iom_segq_next(struct iom_segq *q)
+{
+	struct iom_segq_seg *seg = q->tail;
+	struct iom_segq_seg *next = smp_load_acquire(seg->next);
+
+	if (!next)
+		return 0;
+
+	/* chunks pushed before next was linked are visible now */
+	if (iom_chunks(seg->ring))
+		return 1;
+
+	q->tail = next;
+	iom_segq_seg_put(q, seg);
+
+	return 1;
+}
+
+
+int iom_segq_shift(struct iom_segq *q, unsigned char *buf,
+		   unsigned int *buf_len, unsigned int max_size)
+{
+	int ret;
+
+	assert(q);
+
+	do {
+		ret = iom_shift(q->tail->ring, buf, buf_len, max_size);
+	} while (ret == EINVAL && iom_segq_next(q));
+
+	if (!ret)
+		smp_store_release(q->shifted, q->shifted + 1);
+
+	return ret;
+}
+
+
+int iom_segq_peek(struct iom_segq *q, unsigned char *buf,
+		  unsigned int *buf_len, unsigned int max_size)
+{
+	int ret;
+
+	assert(q);
+
+	do {
+		ret = iom_peek(q->tail->ring, buf, buf_len, max_size);
+	} while (ret == EINVAL && iom_segq_next(q));
+
+	return ret;
+}
+
+
+int iom_segq_peek_update(struct iom_segq *q)
+{
+	int ret;
+
+	assert(q);
+
+	do {
+		ret = iom_peek_update(q->tail->ring);
+	} while (ret == EINVAL && iom_segq_next(q));
+
+	if (!ret)
+		smp_store_release(q->shifted, q->shifted + 1);
+
+	return ret;
+}
+
+
+unsigned int iom_segq_chunks(struct iom_segq *q)
+{
+	return READ_ONCE(q->pushed) - READ_ONCE(q->shifted);
+}
+
+
+/*
+ * Segments of the queue, in use and kept for reuse. Consumer side.
+ */
+unsigned int iom_segq_segments(struct iom_segq *q)
+{
+	struct iom_segq_seg *seg;
+	unsigned int n;
+
+	pthread_mutex_lock(&q->lock);
+	n = q->nfree;
+	pthread_mutex_unlock(&q->lock);
+
+	for (seg = q->tail; seg; seg = smp_load_acquire(seg->next))
+		n++;
+
+	return n;
+}
+
+
+/*
+ * Like iom_iterator, on the consumer side: chunks are walked from
+ * the oldest on, segments are entered with the chunks they hold at
+ * that moment. The consumer must not remove chunks meanwhile.
+ */
+struct iom_segq_iterator *iom_segq_iterator_new(struct iom_segq *q)
+{
+	struct iom_segq_iterator *it;
+
+	it = malloc(sizeof(*it));
+	if (!it)
+		return NULL;
+
+	it->seg = q->tail;
+	it->it.head = smp_load_acquire(it->seg->ring->head);
+	it->it.tail = it->seg->ring->tail;
+
+	return it;
+}
+
+
+void iom_segq_iterator_free(struct iom_segq_iterator *it)
+{
+	free(it);
+}
+
+
+int iom_segq_iterator_peek_next(struct iom_segq_iterator *it,
+				unsigned char *buf, int *buf_len, int max_size)
+{
+	struct iom_segq_seg *next;
+	int ret;
+
+	assert(it);
+
+	for (;;) {
+		ret = iom_iterator_peek_next(&it->it, it->seg->ring, buf,
+					     buf_len, max_size);
+		if (ret != EINVAL)
+			return ret;
+
+		next = smp_load_acquire(it->seg->next);
+		if (!next)
+			return EINVAL;
+
+		/* the rest of a segment the producer has left */
+		it->it.head = smp_load_acquire(it->seg->ring->head);
+		if (iom_cnt_int(it->it.head, it->it.tail, it->seg->ring->size))
+			continue;
+
+		it->seg = next;
+		it->it.head = smp_load_acquire(next->ring->head);
+		it->it.tail = next->ring->tail;
+	}
+}
+
+
+
+/*
+ * iom_shardq: one IOM_MPSC ring per shard. A producer pushes into
+ * the shard of the CPU it runs on (sched_getcpu()) or, with
+ * IOM_SHARDQ_THREAD, into the shard its thread was bound to on its
+ * first push, so producers on different shards share no cache line.
+ * The single consumer takes the shards in turn. With
+ * IOM_SHARDQ_ORDERED every chunk carries a stamp of the producer
+ * clock and the consumer takes the oldest of the chunks at the front
+ * of the shards: the order is approximate, a chunk which is still
+ * written is passed over.
+ *
+ * Each shard holds shard_size bytes: a producer whose shard is full
+ * gets ENOBUFS, even if other shards have room. The chunks of one
+ * producer stay in order as long as it pushes into the same shard,
+ * which IOM_SHARDQ_THREAD guarantees. IOM_SHARDQ_ORDERED restores
+ * the order after a migration, unless the consumer looked at the
+ * old shard before the earlier chunk arrived.
+ */
+#define IOM_SHARDQ_QFLAGS (IOM_SHARDQ_ORDERED | IOM_SHARDQ_THREAD)
+#define IOM_SHARDQ_STAMP  sizeof(uint64_t)
+
+struct iom_shardq_front {
+	uint64_t stamp;
+	int valid;
+};
+
+struct iom_shardq {
+	unsigned int nshards;
+	unsigned int qflags;
+	pthread_key_t key;
+	struct iom_buffer **shard;
+
+	/* producer side, IOM_SHARDQ_THREAD binding */
+	unsigned int bind __cacheline_aligned;
+
+	/* consumer side */
+	unsigned int next __cacheline_aligned;
+	struct iom_shardq_front *front;
+};
+
+
+static uint64_t iom_shardq_stamp(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	/* invariant TSC, synchronized across CPUs by the kernel */
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+
+/* copy between buf and the payload iovecs of a chunk, starting at off */
+static void iom_shardq_iov_copy(const struct iovec *iov, size_t off,
+				unsigned char *buf, size_t len, int to_iov)
+{
+	unsigned char *p;
+	size_t n;
+	int i;
+
+	for (i = 0; len; i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+		p = (unsigned char *)iov[i].iov_base + off;
+		n = min(len, iov[i].iov_len - off);
+		if (to_iov)
+			memcpy(p, buf, n);
+		else
+			memcpy(buf, p, n);
+		buf += n;
+		len -= n;
+		off = 0;
+	}
+}
+
+
+/*
+ * iom_shardq_init() creates a queue of shards rings of shard_size
+ * bytes, shards 0 means one per configured CPU. qflags are
+ * IOM_SHARDQ_ORDERED and IOM_SHARDQ_THREAD, flags those of
+ * iom_init() except the sync modes (the shards are IOM_MPSC),
+ * IOM_WAIT and IOM_BROADCAST. With IOM_SHARDQ_ORDERED a chunk takes
+ * 8 bytes more.
+ */
+int iom_shardq_init(struct iom_shardq **iom_shardq, unsigned int shards,
+		    size_t shard_size, unsigned int qflags, unsigned flags)
+{
+	struct iom_shardq *q;
+	unsigned int i;
+	long cpus;
+	int ret;
+
+	assert(iom_shardq);
+
+	if (qflags & ~IOM_SHARDQ_QFLAGS)
+		return EINVAL;
+
+	if (flags & (IOM_CONCURRENT | IOM_WAIT | IOM_BROADCAST))
+		return EINVAL;
+
+	flags |= IOM_MPSC;
+	ret = iom_check_flags(flags);
+	if (ret)
+		return ret;
+
+	if (!shards) {
+		cpus = sysconf(_SC_NPROCESSORS_CONF);
+		shards = cpus > 0 ? cpus : 1;
+	}
+
+	if (posix_memalign((void **)&q, IOM_CACHELINE_SIZE, sizeof(*q)))
+		return ENOBUFS;
+	memset(q, 0, sizeof(*q));
+
+	if (pthread_key_create(&q->key, NULL)) {
+		free(q);
+		return ENOBUFS;
+	}
+
+	q->nshards = shards;
+	q->qflags = qflags;
+	q->shard = calloc(shards, sizeof(*q->shard));
+	q->front = calloc(shards, sizeof(*q->front));
+	if (!q->shard || !q->front) {
+		iom_shardq_free(q);
+		return ENOBUFS;
+	}
+
+	for (i = 0; i < shards; i++) {
+		ret = iom_init(shard_size, &q->shard[i], flags);
+		if (ret) {
+			q->shard[i] = NULL;
+			iom_shardq_free(q);
+			return ret;
+		}
+	}
+
+	*iom_shardq = q;
+
+	return 0;
+}
+
+
+void iom_shardq_free(struct iom_shardq *q)
+{
+	unsigned int i;
+
+	assert(q);
+
+	for (i = 0; q->shard && i < q->nshards; i++)
+		if (q->shard[i])
+			iom_free(q->shard[i]);
+
+	pthread_key_delete(q->key);
+	free(q->front);
+	free(q->shard);
+	free(q);
+}
+
+
+static struct iom_buffer *iom_shardq_pick(struct iom_shardq *q)
+{
+	unsigned int i;
+	void *bound;
+	int cpu;
+
+	if (!(q->qflags & IOM_SHARDQ_THREAD)) {
+		cpu = sched_getcpu();
+		if (cpu >= 0)
+			return q->shard[(unsigned int)cpu % q->nshards];
+	}
+
+	/* no CPU number: bound to the thread like IOM_SHARDQ_THREAD */
+	bound = pthread_getspecific(q->key);
+	if (bound)
+		return q->shard[(uintptr_t)bound - 1];
+
+	i = __atomic_fetch_add(&q->bind, 1, __ATOMIC_RELAXED) % q->nshards;
+	pthread_setspecific(q->key, (void *)(uintptr_t)(i + 1));
+
+	return q->shard[i];
+}
+
+
+/*
+ * ENOBUFS if the shard of the caller is full, EINVAL for a chunk
+ * larger than a shard
+ */
+int iom_shardq_push(struct iom_shardq *q, unsigned char *buf, size_t len)
+{
+	struct iom_reservation res;
+	struct iom_buffer *ring;
+	uint64_t stamp;
+	int ret;
+
+	assert(q);
+
+	ring = iom_shardq_pick(q);
+	if (!(q->qflags & IOM_SHARDQ_ORDERED))
+		return iom_push(ring, buf, len, IOM_TAIL_DROP);
+
+	ret = iom_push_reserve(ring, &res, len + IOM_SHARDQ_STAMP,
+			       IOM_TAIL_DROP);
+	if (ret)
+		return ret;
+
+	/* after the claim, so the stamps within a shard mostly ascend */
+	stamp = iom_shardq_stamp();
+	iom_shardq_iov_copy(res.iov, 0, (unsigned char *)&stamp,
+			    IOM_SHARDQ_STAMP, 1);
+	iom_shardq_iov_copy(res.iov, IOM_SHARDQ_STAMP, buf, len, 1);
+
+	return iom_push_commit(ring, &res, len + IOM_SHARDQ_STAMP);
+}
+
+
+static int iom_shardq_shift_rr(struct iom_shardq *q, unsigned char *buf,
+			       unsigned int *buf_len, unsigned int max_size)
+{
+	unsigned int i, s = q->next;
+	int ret, busy = 0;
+
+	for (i = 0; i < q->nshards; i++) {
+		ret = iom_shift(q->shard[s], buf, buf_len, max_size);
+		if (++s == q->nshards)
+			s = 0;
+		if (ret == EINVAL || ret == EAGAIN) {
+			busy |= ret == EAGAIN;
+			continue;
+		}
+		if (!ret)
+			q->next = s;
+		return ret;
+	}
+
+	return busy ? EAGAIN : EINVAL;
+}
+
+
+/*
+ * Merge by stamp. The stamp of the chunk at the front of a shard is
+ * kept until the chunk is taken, so only shards which moved on are
+ * looked at again.
+ */
+static int iom_shardq_shift_ordered(struct iom_shardq *q, unsigned char *buf,
+				    unsigned int *buf_len,
+				    unsigned int max_size)
+{
+	struct iom_shardq_front *f, *best = NULL;
+	struct iovec iov[2];
+	unsigned int i, b = 0;
+	int ret, iovcnt, busy = 0;
+	size_t len;
+
+	for (i = 0; i < q->nshards; i++) {
+		f = &q->front[i];
+		if (!f->valid) {
+			ret = iom_shift_view(q->shard[i], iov, &iovcnt);
+			if (ret) {
+				busy |= ret == EAGAIN;
+				continue;
+			}
+			iom_shardq_iov_copy(iov, 0, (unsigned char *)&f->stamp,
+					    IOM_SHARDQ_STAMP, 0);
+			f->valid = 1;
+		}
+		if (!best || (int64_t)(f->stamp - best->stamp) < 0) {
+			best = f;
+			b = i;
+		}
+	}
+
+	if (!best)
+		return busy ? EAGAIN : EINVAL;
+
+	ret = iom_shift_view(q->shard[b], iov, &iovcnt);
+	assert(ret == 0);
+
+	len = iov[0].iov_len - IOM_SHARDQ_STAMP;
+	if (iovcnt > 1)
+		len += iov[1].iov_len;
+	if (len > max_size)
+		return ENOBUFS;
+
+	iom_shardq_iov_copy(iov, IOM_SHARDQ_STAMP, buf, len, 0);
+	*buf_len = len;
+	best->valid = 0;
+
+	return iom_shift_release(q->shard[b]);
+}
+
+
+/*
+ * Single consumer. EINVAL if all shards are empty, EAGAIN if the
+ * only chunks are still written, ENOBUFS if the next chunk is
+ * larger than max_size.
+ */
+int iom_shardq_shift(struct iom_shardq *q, unsigned char *buf,
+		     unsigned int *buf_len, unsigned int max_size)
+{
+	assert(q);
+	assert(buf_len);
+
+	if (q->qflags & IOM_SHARDQ_ORDERED)
+		return iom_shardq_shift_ordered(q, buf, buf_len, max_size);
+
+	return iom_shardq_shift_rr(q, buf, buf_len, max_size);
+}
+
+
+unsigned int iom_shardq_chunks(struct iom_shardq *q)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < q->nshards; i++)
+		n += iom_chunks(q->shard[i]);
+
+	return n;
+}
+
+
+unsigned int iom_shardq_shards(struct iom_shardq *q)
+{
+	return q->nshards;
+}
+
+
+/*
+ * iom_prioq: a ring per traffic class, each with its own drop policy,
+ * and a scheduler in the shift path. IOM_PRIOQ_STRICT always serves
+ * the lowest class number with a chunk. IOM_PRIOQ_DRR is deficit
+ * round robin: on its turn a class is credited its quantum and sends
+ * chunks as long as the credit covers them, an empty class loses its
+ * credit. So a class gets about its quantum's share of the bytes
+ * whenever others are backlogged, and a small control chunk waits for
+ * at most one quantum of every other class instead of all bulk chunks
+ * queued in front of it.
+ *
+ * Producers push with the sync mode of the rings (IOM_MPSC for
+ * several of them), the scheduler state is the single consumer's.
+ */
+struct iom_prioq_cls {
+	struct iom_buffer *ring;
+	unsigned int quantum;
+	unsigned int deficit;
+	int drop;
+	/* IOM_PRIOQ_DRR: bytes still missing for the chunk at the front */
+	unsigned int short_by;
+};
+
+struct iom_prioq {
+	unsigned int nclasses;
+	unsigned int sched;
+	/* IOM_PRIOQ_DRR: class on turn, credited already or not */
+	unsigned int cur;
+	int credited;
+	struct iom_prioq_cls cls[FLEX_ARRAY];
+};
+
+
+/*
+ * iom_prioq_init() creates a queue of nclasses classes, class 0 is
+ * the most urgent one for IOM_PRIOQ_STRICT. flags are those of
+ * iom_init() except IOM_WAIT and IOM_BROADCAST, they apply to every
+ * class ring. IOM_HEAD_DROP and IOM_DROP_ALL need a ring without
+ * IOM_SPSC or IOM_MPSC.
+ */
+int iom_prioq_init(struct iom_prioq **iom_prioq,
+		   const struct iom_prioq_class *classes, unsigned int nclasses,
+		   unsigned int sched, unsigned flags)
+{
+	struct iom_prioq *q;
+	unsigned int i;
+	int ret;
+
+	assert(iom_prioq);
+	assert(classes);
+
+	if (!nclasses || sched > IOM_PRIOQ_STRICT)
+		return EINVAL;
+
+	if (flags & (IOM_WAIT | IOM_BROADCAST))
+		return EINVAL;
+
+	ret = iom_check_flags(flags);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < nclasses; i++) {
+		if (classes[i].drop != IOM_HEAD_DROP &&
+		    classes[i].drop != IOM_TAIL_DROP &&
+		    classes[i].drop != IOM_DROP_ALL)
+			return EINVAL;
+		if ((flags & IOM_CONCURRENT) && classes[i].drop != IOM_TAIL_DROP)
+			return EINVAL;
+		if (sched == IOM_PRIOQ_DRR && !classes[i].quantum)
+			return EINVAL;
+	}
+
+	q = calloc(1, sizeof(*q) + nclasses * sizeof(q->cls[0]));
+	if (!q)
+		return ENOBUFS;
+
+	q->nclasses = nclasses;
+	q->sched = sched;
+
+	for (i = 0; i < nclasses; i++) {
+		q->cls[i].quantum = classes[i].quantum;
+		q->cls[i].drop = classes[i].drop;
+		ret = iom_init(classes[i].size, &q->cls[i].ring, flags);
+		if (ret) {
+			q->cls[i].ring = NULL;
+			iom_prioq_free(q);
+			return ret;
+		}
+	}
+
+	*iom_prioq = q;
+
+	return 0;
+}
+
+
+void iom_prioq_free(struct iom_prioq *q)
+{
+	unsigned int i;
+
+	assert(q);
+
+	for (i = 0; i < q->nclasses; i++)
+		if (q->cls[i].ring)
+			iom_free(q->cls[i].ring);
+
+	free(q);
+}
+
+
+/*
+ * Pushes into class cls with the drop policy of the class. EINVAL
+ * for an unknown class, otherwise what iom_push() returns.
+ */
+int iom_prioq_push(struct iom_prioq *q, unsigned int cls,
+		   unsigned char *buf, size_t len)
+{
+	assert(q);
+
+	if (cls >= q->nclasses)
+		return EINVAL;
+
+	return iom_push(q->cls[cls].ring, buf, len, q->cls[cls].drop);
+}
+
+
+static int iom_prioq_shift_strict(struct iom_prioq *q, unsigned char *buf,
+				  unsigned int *buf_len, unsigned int max_size,
+				  unsigned int *cls)
+{
+	unsigned int i;
+	int ret, busy = 0;
+
+	for (i = 0; i < q->nclasses; i++) {
+		ret = iom_shift(q->cls[i].ring, buf, buf_len, max_size);
+		if (ret == EINVAL || ret == EAGAIN) {
+			busy |= ret == EAGAIN;
+			continue;
+		}
+		if (!ret && cls)
+			*cls = i;
+		return ret;
+	}
+
+	return busy ? EAGAIN : EINVAL;
+}
+
+
+/* payload length of the chunk at the front of ring */
+static int iom_prioq_front_len(struct iom_buffer *ring, unsigned int *len)
+{
+	struct iovec iov[2];
+	int ret, iovcnt;
+
+	ret = iom_shift_view(ring, iov, &iovcnt);
+	if (ret)
+		return ret;
+
+	*len = iov[0].iov_len;
+	if (iovcnt > 1)
+		*len += iov[1].iov_len;
+
+	return 0;
+}
+
+
+/*
+ * A round in which no class can send only adds credit. Rather than
+ * looping through such rounds, the credit of as many of them as the
+ * class closest to its chunk needs is granted at once.
+ */
+static int iom_prioq_shift_drr(struct iom_prioq *q, unsigned char *buf,
+			       unsigned int *buf_len, unsigned int max_size,
+			       unsigned int *cls)
+{
+	struct iom_prioq_cls *c;
+	unsigned int i, len, rounds, min_rounds;
+	int ret, busy;
+
+	for (;;) {
+		min_rounds = UINT_MAX;
+		busy = 0;
+
+		for (i = 0; i < q->nclasses; i++) {
+			c = &q->cls[q->cur];
+			c->short_by = 0;
+
+			ret = iom_prioq_front_len(c->ring, &len);
+			if (ret == EINVAL)
+				c->deficit = 0;
+			if (!ret) {
+				if (!q->credited) {
+					c->deficit += c->quantum;
+					q->credited = 1;
+				}
+				if (len <= c->deficit) {
+					ret = iom_shift(c->ring, buf, buf_len, max_size);
+					if (ret)
+						return ret;
+					c->deficit -= len;
+					if (cls)
+						*cls = q->cur;
+					return 0;
+				}
+				c->short_by = len - c->deficit;
+				rounds = (c->short_by - 1) / c->quantum + 1;
+				min_rounds = min(min_rounds, rounds);
+			}
+			busy |= ret == EAGAIN;
+
+			if (++q->cur == q->nclasses)
+				q->cur = 0;
+			q->credited = 0;
+		}
+
+		if (min_rounds == UINT_MAX)
+			return busy ? EAGAIN : EINVAL;
+
+		/* the next round credits once more */
+		for (i = 0; min_rounds > 1 && i < q->nclasses; i++)
+			if (q->cls[i].short_by)
+				q->cls[i].deficit += (min_rounds - 1) *
+						     q->cls[i].quantum;
+	}
+}
+
+
+/*
+ * Single consumer: the next chunk according to the scheduler, *cls
+ * (if not NULL) is set to its class. EINVAL if all classes are empty,
+ * EAGAIN if the only chunks are still written, ENOBUFS if the chunk
+ * on turn is larger than max_size - it stays at the front.
+ */
+int iom_prioq_shift(struct iom_prioq *q, unsigned char *buf,
+		    unsigned int *buf_len, unsigned int max_size,
+		    unsigned int *cls)
+{
+	assert(q);
+	assert(buf_len);
+
+	if (q->sched == IOM_PRIOQ_STRICT)
+		return iom_prioq_shift_strict(q, buf, buf_len, max_size, cls);
+
+	return iom_prioq_shift_drr(q, buf, buf_len, max_size, cls);
+}
+
+
+/* chunks queued in class cls, 0 for an unknown class */
+unsigned int iom_prioq_chunks(struct iom_prioq *q, unsigned int cls)
+{
+	assert(q);
+
+	if (cls >= q->nclasses)
+		return 0;
+
+	return iom_chunks(q->cls[cls].ring);
+}
+
+#if defined(TEST_BUILD)
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+
+int space_test(void)
+{
+	int ret, i, j;
+	unsigned int rbuf_len;
+	struct iom_buffer *iom_buffer;
+	unsigned char buf[2048] = { 0 };
+	unsigned char rbuf[2048];
+	size_t size = 16;
+
+	ret = iom_init(size, &iom_buffer, 0);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	srand(time(NULL));
+
+	i = 1000;
+	while (i--) {
+		int iter;
+		unsigned int cnt = (rand() % 10) + 1;
+		iter = (rand() % 100) + 1;
+		fprintf(stderr, "push %d\n", cnt);
+
+		for (j = 0; j < iter; j++) {
+			ret = iom_push(iom_buffer, buf, cnt, IOM_TAIL_DROP);
+			if (ret) {
+				if (ret == ENOBUFS) {
+					/* reach limit with IOM_TAIL_DROP */
+					iter = j;
+					break;
+				}
+				fprintf(stderr, "ERROR (ret: %d)\n", ret);
+				return EXIT_FAILURE;
+			}
+			fprintf(stderr, "  push iteration: %d\n", j);
+		}
+
+		for (j = 0; j < iter; j++) {
+			ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+			if (ret) {
+				fprintf(stderr, "Failed to get buffer (%d)\n", ret);
+				return EXIT_FAILURE;
+			}
+			fprintf(stderr, "  shift iteration: %d, %d byte\n", j, rbuf_len);
+
+			assert(rbuf_len == cnt);
+		}
+
+		fprintf(stderr, "rbuf: %d\n", rbuf_len);
+		if (iom_space(iom_buffer) != size - 1) {
+			fprintf(stderr, "wrong capacity %d\n", iom_space(iom_buffer));
+			assert(0);
+		}
+
+		fputs("\n\n", stderr);
+	}
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+int space_test2(void)
+{
+	int ret, i, j;
+	unsigned int rbuf_len;
+	struct iom_buffer *iom_buffer;
+	unsigned char buf[2048] = { 0 };
+	unsigned char rbuf[2048];
+	size_t size = iom_nearest_power_two(32000);
+
+	ret = iom_init(size, &iom_buffer, 0);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	i = 1000;
+	while (i--) {
+		int iter;
+		unsigned int cnt = (rand() % 1500) + 1;
+		iter = (rand() % 100) + 1;
+		fprintf(stderr, "push %d byte\n", cnt);
+
+		for (j = 0; j < iter; j++) {
+			ret = iom_push(iom_buffer, buf, cnt, IOM_TAIL_DROP);
+			if (ret) {
+				if (ret == ENOBUFS) {
+					/* reach limit with IOM_TAIL_DROP */
+					iter = j;
+					break;
+				}
+				fprintf(stderr, "ERROR (ret: %d)\n", ret);
+				return EXIT_FAILURE;
+			}
+			fprintf(stderr, "  push iteration: %d\n", j);
+		}
+
+		ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+		if (ret) {
+			fprintf(stderr, "Failed to get buffer (%d)\n", ret);
+			return EXIT_FAILURE;
+		}
+		fprintf(stderr, "  shift iteration: %d, %d byte\n", j, rbuf_len);
+
+		ret = iom_push(iom_buffer, buf, cnt, IOM_TAIL_DROP);
+		if (ret) {
+			if (ret == ENOBUFS) {
+				/* reach limit with IOM_TAIL_DROP */
+				iter = j;
+				break;
+			}
+			fprintf(stderr, "ERROR (ret: %d)\n", ret);
+			return EXIT_FAILURE;
+		}
+		fprintf(stderr, "  push iteration: %d\n", j);
+
+		for (j = 0; j < iter; j++) {
+			ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+			if (ret) {
+				fprintf(stderr, "Failed to get buffer (%d)\n", ret);
+				return EXIT_FAILURE;
+			}
+			fprintf(stderr, "  shift iteration: %d, %d byte\n", j, rbuf_len);
+
+			assert(rbuf_len == cnt);
+		}
+
+		fprintf(stderr, "rbuf: %d\n", rbuf_len);
+		if (iom_space(iom_buffer) != size - 1) {
+			fprintf(stderr, "wrong capacity %d\n", iom_space(iom_buffer));
+			assert(0);
+		}
+
+		fputs("\n\n", stderr);
+	}
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+int space_test3(void)
+{
+	int ret;
+	struct iom_buffer *iom_buffer;
+	unsigned char buf;
+
+	ret = iom_init(8, &iom_buffer, 0);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	buf = 0;
+	ret = iom_push(iom_buffer, &buf, sizeof(buf), IOM_TAIL_DROP);
+	assert(ret == 0);
+
+	buf = 1;
+	ret = iom_push(iom_buffer, &buf, sizeof(buf), IOM_TAIL_DROP);
+	assert(ret == 0);
+
+	/* the following test MUST fail! Why, because local
+	 * accouning requires 2 byte for each chunk. If we save
+	 * 2 x 1byte we require 6 byte. If we want to save another
+	 * byte (with additional overhead of 2 bytes), the operation
+	 * MUST fail
+	 */
+	buf = 23;
+	ret = iom_push(iom_buffer, &buf, sizeof(buf), IOM_TAIL_DROP);
+	assert(ret != 0);
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+int space_test4(void)
+{
+	int ret;
+	unsigned int rbuf_len;
+	struct iom_buffer *iom_buffer;
+	unsigned char *buf;
+	unsigned char rbuf[3];
+
+	ret = iom_init(8, &iom_buffer, 0);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	buf = (unsigned char *)"AAA";
+	ret = iom_push(iom_buffer, buf, 3, IOM_TAIL_DROP);
+	assert(ret == 0);
+
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	if (ret) {
+		fprintf(stderr, "Failed to get buffer (%d)\n", ret);
+		return EXIT_FAILURE;
+	}
+
+	/* ok, head is now 3 + 2 byte shifted within iom_buffer */
+
+	buf = (unsigned char *)"BB";
+	ret = iom_push(iom_buffer, buf, 3, IOM_TAIL_DROP);
+	assert(ret == 0);
+
+
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	if (ret) {
+		fprintf(stderr, "Failed to get buffer (%d)\n", ret);
+		return EXIT_FAILURE;
+	}
+	assert(rbuf_len == 3);
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+#define SPSC_TEST_CHUNKS 1000000
+
+static void *spsc_test_producer(void *arg)
+{
+	struct iom_buffer *iom_buffer = arg;
+	unsigned char buf[256];
+	uint32_t seq;
+	size_t len;
+	int ret;
+
+	for (seq = 0; seq < SPSC_TEST_CHUNKS; seq++) {
+		len = sizeof(seq) + seq % (sizeof(buf) - sizeof(seq));
+		memcpy(buf, &seq, sizeof(seq));
+		memset(&buf[sizeof(seq)], seq & 0xff, len - sizeof(seq));
+
+		while ((ret = iom_push(iom_buffer, buf, len, IOM_TAIL_DROP)) == ENOBUFS)
+			sched_yield();
+		assert(ret == 0);
+	}
+
+	return NULL;
+}
+
+
+static int spsc_test_flags(unsigned flags)
+{
+	int ret;
+	unsigned int rbuf_len, i;
+	struct iom_buffer *iom_buffer;
+	unsigned char rbuf[256];
+	pthread_t producer;
+	uint32_t seq, rseq;
+
+	ret = iom_init(4096, &iom_buffer, flags);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	/* the producer cannot drop at the consumer side */
+	ret = iom_push(iom_buffer, rbuf, 1, IOM_HEAD_DROP);
+	assert(ret == ENOTSUP);
+
+	ret = pthread_create(&producer, NULL, spsc_test_producer, iom_buffer);
+	if (ret) {
+		fprintf(stderr, "Cannot create producer thread (%d)\n", ret);
+		return EXIT_FAILURE;
+	}
+
+	for (seq = 0; seq < SPSC_TEST_CHUNKS; seq++) {
+		while ((ret = iom_shift(iom_buffer, rbuf, &rbuf_len,
+					sizeof(rbuf))) == EINVAL)
+			sched_yield();
+		if (ret) {
+			fprintf(stderr, "Failed to get buffer (%d)\n", ret);
+			return EXIT_FAILURE;
+		}
+
+		memcpy(&rseq, rbuf, sizeof(rseq));
+		assert(rseq == seq);
+		assert(rbuf_len == sizeof(seq) + seq % (sizeof(rbuf) - sizeof(seq)));
+		for (i = sizeof(seq); i < rbuf_len; i++)
+			assert(rbuf[i] == (seq & 0xff));
+	}
+
+	pthread_join(producer, NULL);
+
+	assert(iom_chunks(iom_buffer) == 0);
+	assert(iom_space(iom_buffer) == 4096 - 1);
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == EINVAL);
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+int spsc_test(void)
+{
+	int ret;
+
+	ret = spsc_test_flags(IOM_SPSC);
+	if (ret)
+		return ret;
+
+	return spsc_test_flags(IOM_SPSC | IOM_NO_SPLIT);
+}
+
+
+#define MPSC_TEST_PRODUCERS 4
+#define MPSC_TEST_CHUNKS    200000
+
+struct mpsc_test_arg {
+	struct iom_buffer *iom_buffer;
+	uint32_t id;
+};
+
+static void *mpsc_test_producer(void *arg)
+{
+	struct mpsc_test_arg *a = arg;
+	unsigned char buf[128];
+	uint32_t seq;
+	size_t len;
+	int ret;
+
+	for (seq = 0; seq < MPSC_TEST_CHUNKS; seq++) {
+		len = 2 * sizeof(seq) + (seq + a->id) % (sizeof(buf) - 2 * sizeof(seq));
+		memcpy(buf, &a->id, sizeof(a->id));
+		memcpy(&buf[sizeof(seq)], &seq, sizeof(seq));
+		memset(&buf[2 * sizeof(seq)], seq & 0xff, len - 2 * sizeof(seq));
+
+		while ((ret = iom_push(a->iom_buffer, buf, len, IOM_TAIL_DROP)) == ENOBUFS)
+			sched_yield();
+		assert(ret == 0);
+	}
+
+	return NULL;
+}
+
+
+int mpsc_test(void)
+{
+	int ret;
+	unsigned int rbuf_len, i, n;
+	struct iom_buffer *iom_buffer;
+	unsigned char rbuf[128];
+	pthread_t producer[MPSC_TEST_PRODUCERS];
+	struct mpsc_test_arg arg[MPSC_TEST_PRODUCERS];
+	uint32_t next[MPSC_TEST_PRODUCERS] = { 0 };
+	uint32_t id, seq;
+
+	ret = iom_init(4096, &iom_buffer, IOM_MPSC);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	ret = iom_init(4096, &iom_buffer, IOM_MPSC | IOM_SPSC);
+	assert(ret == EINVAL);
+
+	ret = iom_push(iom_buffer, rbuf, 1, IOM_HEAD_DROP);
+	assert(ret == ENOTSUP);
+
+	for (i = 0; i < MPSC_TEST_PRODUCERS; i++) {
+		arg[i].iom_buffer = iom_buffer;
+		arg[i].id = i;
+		ret = pthread_create(&producer[i], NULL, mpsc_test_producer, &arg[i]);
+		if (ret) {
+			fprintf(stderr, "Cannot create producer thread (%d)\n", ret);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (n = 0; n < MPSC_TEST_PRODUCERS * MPSC_TEST_CHUNKS; n++) {
+		while ((ret = iom_shift(iom_buffer, rbuf, &rbuf_len,
+					sizeof(rbuf))) == EINVAL || ret == EAGAIN)
+			sched_yield();
+		if (ret) {
+			fprintf(stderr, "Failed to get buffer (%d)\n", ret);
+			return EXIT_FAILURE;
+		}
+
+		/* chunks of one producer MUST arrive in order and intact */
+		memcpy(&id, rbuf, sizeof(id));
+		memcpy(&seq, &rbuf[sizeof(id)], sizeof(seq));
+		assert(id < MPSC_TEST_PRODUCERS);
+		assert(seq == next[id]);
+		assert(rbuf_len == 2 * sizeof(seq) +
+		       (seq + id) % (sizeof(rbuf) - 2 * sizeof(seq)));
+		for (i = 2 * sizeof(seq); i < rbuf_len; i++)
+			assert(rbuf[i] == (seq & 0xff));
+		next[id]++;
+	}
+
+	for (i = 0; i < MPSC_TEST_PRODUCERS; i++)
+		pthread_join(producer[i], NULL);
+
+	assert(iom_chunks(iom_buffer) == 0);
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == EINVAL);
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+int peek_test(void)
+{
+	int ret;
+	struct iom_buffer *iom_buffer;
+	size_t size = 8;
+	unsigned char data;
+	unsigned char rdata;
+	unsigned int rdata_len;
+
+	ret = iom_init(size, &iom_buffer, 0);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	data = 1;
+
+	ret = iom_push(iom_buffer, &data, sizeof(data), IOM_TAIL_DROP);
+	if (ret) {
+		fprintf(stderr, "ERROR (ret: %d)\n", ret);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "  push iteration: %d\n", data);
+
+	/* two successive tests, same result MUST be presented */
+	ret = iom_peek(iom_buffer, &rdata, &rdata_len, sizeof(rdata));
+	if (ret) {
+		fprintf(stderr, "Failed to get buffer (%d)\n", ret);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "  shift iteration: %d, %d byte\n", rdata, rdata_len);
+	assert(rdata == data);
+
+	ret = iom_peek(iom_buffer, &rdata, &rdata_len, sizeof(rdata));
+	if (ret) {
+		fprintf(stderr, "Failed to get buffer (%d)\n", ret);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "  shift iteration: %d, %d byte\n", rdata, rdata_len);
+	assert(rdata == data);
+
+	/* now new finally remove the peeked element from the buffer */
+	ret = iom_peek_update(iom_buffer);
+	assert(ret == 0);
+
+	/* this must fail, because no more chunks are in buffer */
+	ret = iom_peek_update(iom_buffer);
+	assert(ret != 0);
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+int iterator_test(void)
+{
+	int ret;
+	struct iom_buffer *iom_buffer;
+	struct iom_iterator *iom_iterator;
+	size_t size = 8;
+	unsigned char data;
+	unsigned char rdata;
+	int rdata_len;
+
+	ret = iom_init(size, &iom_buffer, 0);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	data = 1;
+	ret = iom_push(iom_buffer, &data, sizeof(data), IOM_TAIL_DROP);
+	if (ret) {
+		fprintf(stderr, "ERROR (ret: %d)\n", ret);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "  push iteration: %d\n", data);
+
+	data = 2;
+	ret = iom_push(iom_buffer, &data, sizeof(data), IOM_TAIL_DROP);
+	if (ret) {
+		fprintf(stderr, "ERROR (ret: %d)\n", ret);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "  push iteration: %d\n", data);
+
+	iom_iterator = iom_iterator_new(iom_buffer);
+	assert(iom_iterator);
+
+	ret = iom_iterator_peek_next(iom_iterator, iom_buffer, &rdata,
+				     &rdata_len, sizeof(rdata));
+	assert(ret == 0);
+	assert(rdata_len == sizeof(data));
+	assert(rdata == 1);
+
+
+	ret = iom_iterator_peek_next(iom_iterator, iom_buffer, &rdata,
+				     &rdata_len, sizeof(rdata));
+	assert(ret == 0);
+	assert(rdata_len == sizeof(data));
+	assert(rdata == 2);
+
+	ret = iom_iterator_peek_next(iom_iterator, iom_buffer, &rdata,
+				     &rdata_len, sizeof(rdata));
+	assert(ret != 0);
+
+	iom_iterator_free(iom_iterator);
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+int nearest_power_test(void)
+{
+	assert(0 == iom_nearest_power_two(0));
+	assert(4 == iom_nearest_power_two(3));
+	assert(4 == iom_nearest_power_two(4));
+	assert(8 == iom_nearest_power_two(5));
+	assert(8 == iom_nearest_power_two(8));
+
+	return 0;
+}
+
+
+int chunks_number_test(void)
+{
+	int ret;
+	unsigned int rbuf_len;
+	struct iom_buffer *iom_buffer;
+	unsigned char buf;
+	unsigned char rbuf[3];
+
+	ret = iom_init(8, &iom_buffer, 0);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+	assert(iom_chunks(iom_buffer) == 0);
+
+	buf = 0;
+	ret = iom_push(iom_buffer, &buf, sizeof(buf), IOM_TAIL_DROP);
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 1);
+
+	buf = 1;
+	ret = iom_push(iom_buffer, &buf, sizeof(buf), IOM_TAIL_DROP);
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 2);
+
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 1);
+
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 0);
+
+	/*
+	 * following shift operation MUST fail. We test to failed
+	 * conditition and additionally test that the chunk size is
+	 * still zero
+	 */
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret != 0);
+	assert(iom_chunks(iom_buffer) == 0);
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+#define IOM_BUF_SIZE 16
+int size_test(void)
+{
+	int ret;
+	unsigned int rbuf_len;
+	struct iom_buffer *iom_buffer;
+	unsigned char buf[4];
+	unsigned char rbuf[4];
+
+	ret = iom_init(IOM_BUF_SIZE, &iom_buffer, 0);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+	assert(iom_chunks(iom_buffer) == 0);
+	assert(iom_space(iom_buffer) == IOM_BUF_SIZE - 1);
+
+
+	ret = iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
+	assert(ret == 0);
+	assert(iom_space(iom_buffer) == IOM_BUF_SIZE - 1 - sizeof(buf) - 2);
+
+
+	ret = iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
+	assert(ret == 0);
+	assert(iom_space(iom_buffer) == IOM_BUF_SIZE - 1 - (sizeof(buf) + 2) * 2);
+	assert(iom_chunks(iom_buffer) == 2);
+
+
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 1);
+	assert(iom_space(iom_buffer) == IOM_BUF_SIZE - 1 - sizeof(buf) - 2);
+
+
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 0);
+	assert(iom_space(iom_buffer) == IOM_BUF_SIZE - 1);
+
+	/*
+	 * following shift operation MUST fail. We test to failed
+	 * conditition and additionally test that the chunk size is
+	 * still zero
+	 */
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret != 0);
+	assert(iom_chunks(iom_buffer) == 0);
+	assert(iom_space(iom_buffer) == IOM_BUF_SIZE - 1);
+
+
+	ret = iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
+	assert(ret == 0);
+	assert(iom_space(iom_buffer) == IOM_BUF_SIZE - 1 - sizeof(buf) - 2);
+
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 0);
+	assert(iom_space(iom_buffer) == IOM_BUF_SIZE - 1);
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+int chunk_headdrop_test(void)
+{
+	int ret, i;
+	struct iom_buffer *iom_buffer;
+	unsigned char buf;
+
+	ret = iom_init(8, &iom_buffer, 0);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+	assert(iom_chunks(iom_buffer) == 0);
+
+	buf = 0;
+	ret = iom_push(iom_buffer, &buf, sizeof(buf), IOM_HEAD_DROP);
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 1);
+
+	i = 10;
+	do {
+		buf = 1;
+		ret = iom_push(iom_buffer, &buf, sizeof(buf), IOM_HEAD_DROP);
+		assert(ret == 0);
+		assert(iom_chunks(iom_buffer) == 2);
+	} while (i--);
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+int reset_test(void)
+{
+	int ret;
+	struct iom_buffer *iom_buffer;
+	unsigned char buf;
+
+	ret = iom_init(8, &iom_buffer, 0);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+	assert(iom_chunks(iom_buffer) == 0);
+
+	buf = 0;
+	ret = iom_push(iom_buffer, &buf, sizeof(buf), IOM_HEAD_DROP);
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 1);
+
+	buf = 0;
+	ret = iom_push(iom_buffer, &buf, sizeof(buf), IOM_HEAD_DROP);
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 2);
+
+	iom_reset(iom_buffer);
+	assert(iom_chunks(iom_buffer) == 0);
+
+	iom_reset(iom_buffer);
+	assert(iom_chunks(iom_buffer) == 0);
+
+	buf = 0;
+	ret = iom_push(iom_buffer, &buf, sizeof(buf), IOM_TAIL_DROP);
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 1);
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+int reserve_test(void)
+{
+	int ret;
+	unsigned int rbuf_len;
+	struct iom_buffer *iom_buffer;
+	struct iom_reservation res;
+	unsigned char buf[8] = { 0 };
+	unsigned char rbuf[16];
+
+	ret = iom_init(16, &iom_buffer, 0);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	/* tail at 8, head at 12: the next payload wraps */
+	ret = iom_push(iom_buffer, buf, 6, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_push(iom_buffer, buf, 2, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0 && rbuf_len == 6);
+
+	ret = iom_push_reserve(iom_buffer, &res, 6, IOM_TAIL_DROP);
+	assert(ret == 0);
+	assert(res.iovcnt == 2);
+	assert(res.iov[0].iov_len == 2 && res.iov[1].iov_len == 4);
+	memcpy(res.iov[0].iov_base, "ab", 2);
+	memcpy(res.iov[1].iov_base, "cdef", 4);
+
+	/* commit may shrink, but not grow the chunk */
+	ret = iom_push_commit(iom_buffer, &res, 7);
+	assert(ret == EINVAL);
+	ret = iom_push_commit(iom_buffer, &res, 5);
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 2);
+
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0 && rbuf_len == 2);
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0 && rbuf_len == 5);
+	assert(!memcmp(rbuf, "abcde", 5));
+	assert(iom_space(iom_buffer) == 16 - 1);
+
+	/* drop policies apply at reservation time */
+	ret = iom_push_reserve(iom_buffer, &res, 14, IOM_TAIL_DROP);
+	assert(ret == ENOBUFS);
+
+	ret = iom_push(iom_buffer, buf, 4, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_push(iom_buffer, buf, 4, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_push_reserve(iom_buffer, &res, 6, IOM_HEAD_DROP);
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 1);
+	memcpy(res.iov[0].iov_base, "ghijkl", res.iov[0].iov_len);
+	if (res.iovcnt == 2)
+		memcpy(res.iov[1].iov_base, &"ghijkl"[res.iov[0].iov_len],
+		       res.iov[1].iov_len);
+	ret = iom_push_commit(iom_buffer, &res, 6);
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 2);
+
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0 && rbuf_len == 4);
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0 && rbuf_len == 6);
+	assert(!memcmp(rbuf, "ghijkl", 6));
+	iom_free(iom_buffer);
+
+	/* the consumer empties the buffer while a reservation is open */
+	ret = iom_init(64, &iom_buffer, 0);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+	ret = iom_push(iom_buffer, buf, 8, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_push_reserve(iom_buffer, &res, 8, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0 && rbuf_len == 8);
+	memcpy(res.iov[0].iov_base, "mnopqrst", 8);
+	ret = iom_push_commit(iom_buffer, &res, 8);
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 1);
+
+	/* the same through iom_peek_update() */
+	ret = iom_push_reserve(iom_buffer, &res, 4, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_peek(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0 && rbuf_len == 8);
+	assert(!memcmp(rbuf, "mnopqrst", 8));
+	ret = iom_peek_update(iom_buffer);
+	assert(ret == 0);
+	memcpy(res.iov[0].iov_base, "uvwx", 4);
+	ret = iom_push_commit(iom_buffer, &res, 4);
+	assert(ret == 0);
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0 && rbuf_len == 4);
+	assert(!memcmp(rbuf, "uvwx", 4));
+	/* empty and committed, it starts over at 0 again */
+	assert(iom_buffer->head == 0 && iom_buffer->tail == 0);
+
+	/* an abandoned reservation does not keep it from starting over */
+	ret = iom_push(iom_buffer, buf, 8, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_push_reserve(iom_buffer, &res, 8, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0 && rbuf_len == 8);
+	assert(iom_buffer->head != 0);
+	ret = iom_push_cancel(iom_buffer, &res);
+	assert(ret == 0);
+	assert(iom_buffer->head == 0 && iom_buffer->tail == 0);
+	assert(iom_chunks(iom_buffer) == 0);
+
+	iom_free(iom_buffer);
+
+	/* multi producer reservations are published with their full size */
+	ret = iom_init(64, &iom_buffer, IOM_MPSC);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	ret = iom_push_reserve(iom_buffer, &res, 3, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == EAGAIN);
+	ret = iom_push_cancel(iom_buffer, &res);
+	assert(ret == ENOTSUP);
+	memcpy(res.iov[0].iov_base, "xyz", 3);
+	ret = iom_push_commit(iom_buffer, &res, 2);
+	assert(ret == EINVAL);
+	ret = iom_push_commit(iom_buffer, &res, 3);
+	assert(ret == 0);
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0 && rbuf_len == 3);
+	assert(!memcmp(rbuf, "xyz", 3));
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+/*
+ * Bring the chunk "abcdef" with its cookie to position 16 - to_end
+ * of a 16 byte buffer and check the view on it
+ */
+static void view_test_at(int to_end, int iovcnt_expected)
+{
+	int ret, iovcnt, i;
+	unsigned int rbuf_len;
+	struct iom_buffer *iom_buffer;
+	struct iovec iov[2];
+	unsigned char buf[16] = { 0 };
+	unsigned char rbuf[16];
+	size_t off = 0;
+
+	ret = iom_init(16, &iom_buffer, 0);
+	assert(ret == 0);
+
+	/* filler and an empty chunk, keeps the buffer from resetting */
+	ret = iom_push(iom_buffer, buf, 16 - to_end - 2 - 2, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_push(iom_buffer, buf, 0, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0);
+
+	ret = iom_push(iom_buffer, (unsigned char *)"abcdef", 6, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0 && rbuf_len == 0);
+
+	ret = iom_shift_view(iom_buffer, iov, &iovcnt);
+	assert(ret == 0);
+	assert(iovcnt == iovcnt_expected);
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(&rbuf[off], iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+	assert(off == 6);
+	assert(!memcmp(rbuf, "abcdef", 6));
+
+	ret = iom_shift_release(iom_buffer);
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 0);
+
+	ret = iom_shift_view(iom_buffer, iov, &iovcnt);
+	assert(ret == EINVAL);
+
+	iom_free(iom_buffer);
+}
+
+
+int view_test(void)
+{
+	/* cookie split, payload at 1 */
+	view_test_at(1, 1);
+	/* cookie at the end, payload at 0 */
+	view_test_at(2, 1);
+	/* payload split */
+	view_test_at(4, 2);
+	/* no wrap at all */
+	view_test_at(8, 1);
+
+	return 0;
+}
+
+
+int magic_ring_test(void)
+{
+	int ret, i, iovcnt;
+	unsigned int rbuf_len, j;
+	struct iom_buffer *iom_buffer;
+	struct iom_reservation res;
+	struct iovec iov[2];
+	unsigned char buf[1500];
+	unsigned char rbuf[1500];
+	size_t size = sysconf(_SC_PAGESIZE);
+
+	/* not a multiple of the page size */
+	ret = iom_init(16, &iom_buffer, IOM_MAGIC_RING);
+	assert(ret == EINVAL);
+
+	ret = iom_init(size, &iom_buffer, IOM_MAGIC_RING);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	/* both mappings MUST show the same memory */
+	iom_buffer->buf[0] = 0x23;
+	assert(iom_buffer->buf[size] == 0x23);
+	iom_buffer->buf[size + 1] = 0x42;
+	assert(iom_buffer->buf[1] == 0x42);
+
+	/* keep one chunk in the buffer so it wraps instead of resetting */
+	ret = iom_push(iom_buffer, buf, 1, IOM_TAIL_DROP);
+	assert(ret == 0);
+
+	for (i = 0; i < 10000; i++) {
+		unsigned int cnt = (rand() % sizeof(buf)) + 1;
+
+		memset(buf, i & 0xff, cnt);
+		if (i % 2) {
+			ret = iom_push(iom_buffer, buf, cnt, IOM_TAIL_DROP);
+			assert(ret == 0);
+		} else {
+			ret = iom_push_reserve(iom_buffer, &res, cnt, IOM_TAIL_DROP);
+			assert(ret == 0);
+			assert(res.iovcnt == 1);
+			memcpy(res.iov[0].iov_base, buf, cnt);
+			ret = iom_push_commit(iom_buffer, &res, cnt);
+			assert(ret == 0);
+		}
+
+		ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+		assert(ret == 0);
+
+		ret = iom_shift_view(iom_buffer, iov, &iovcnt);
+		assert(ret == 0);
+		assert(iovcnt == 1);
+		assert(iov[0].iov_len == cnt);
+		for (j = 0; j < cnt; j++)
+			assert(((unsigned char *)iov[0].iov_base)[j] == (i & 0xff));
+	}
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+int no_split_test(void)
+{
+	int ret, i, iovcnt;
+	unsigned int rbuf_len, cnt, j;
+	struct iom_buffer *iom_buffer;
+	struct iom_reservation res;
+	struct iovec iov[2];
+	unsigned char buf[48];
+	unsigned char rbuf[48];
+	uint32_t seq, rseq, next = 0;
+
+	ret = iom_init(64, &iom_buffer, IOM_NO_SPLIT | IOM_MPSC);
+	assert(ret == EINVAL);
+
+	ret = iom_init(64, &iom_buffer, IOM_NO_SPLIT);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	/*
+	 * tail at 42, head at 52: 14 bytes do not fit in front of the
+	 * end, the 12 bytes up to the end are skipped
+	 */
+	ret = iom_push(iom_buffer, buf, 40, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_push(iom_buffer, buf, 8, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0);
+
+	memset(buf, 'a', 12);
+	ret = iom_push(iom_buffer, buf, 12, IOM_TAIL_DROP);
+	assert(ret == 0);
+	assert(iom_space(iom_buffer) == 64 - 1 - 10 - 12 - 14);
+
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0 && rbuf_len == 8);
+	ret = iom_shift_view(iom_buffer, iov, &iovcnt);
+	assert(ret == 0);
+	assert(iovcnt == 1 && iov[0].iov_len == 12);
+	assert(iov[0].iov_base == &iom_buffer->buf[2]);
+	ret = iom_shift_release(iom_buffer);
+	assert(ret == 0);
+	assert(iom_space(iom_buffer) == 64 - 1);
+
+	/*
+	 * tail at 10, head at 50: 23 bytes are free, but neither the 14
+	 * in front of the end nor the 9 at the start take 18 bytes
+	 */
+	ret = iom_push(iom_buffer, buf, 8, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_push(iom_buffer, buf, 38, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0);
+	assert(iom_space(iom_buffer) == 23);
+
+	ret = iom_push_reserve(iom_buffer, &res, 16, IOM_TAIL_DROP);
+	assert(ret == ENOBUFS);
+	ret = iom_push(iom_buffer, buf, 16, IOM_HEAD_DROP);
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 1);
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0 && rbuf_len == 16);
+
+	/*
+	 * random sizes with IOM_HEAD_DROP: whatever survives MUST be
+	 * in order, intact and never split
+	 */
+	for (i = 0; i < 100000; i++) {
+		cnt = sizeof(seq) + rand() % (sizeof(buf) - sizeof(seq));
+		seq = i;
+		memcpy(buf, &seq, sizeof(seq));
+		memset(&buf[sizeof(seq)], seq & 0xff, cnt - sizeof(seq));
+
+		if (i % 3) {
+			ret = iom_push(iom_buffer, buf, cnt, IOM_HEAD_DROP);
+			assert(ret == 0);
+		} else {
+			ret = iom_push_reserve(iom_buffer, &res, cnt, IOM_HEAD_DROP);
+			assert(ret == 0);
+			assert(res.iovcnt == 1);
+			memcpy(res.iov[0].iov_base, buf, cnt);
+			ret = iom_push_commit(iom_buffer, &res, cnt);
+			assert(ret == 0);
+		}
+
+		if (rand() % 2)
+			continue;
+
+		ret = iom_shift_view(iom_buffer, iov, &iovcnt);
+		assert(ret == 0);
+		assert(iovcnt == 1);
+		memcpy(&rseq, iov[0].iov_base, sizeof(rseq));
+		assert(rseq >= next);
+		for (j = sizeof(rseq); j < iov[0].iov_len; j++)
+			assert(((unsigned char *)iov[0].iov_base)[j] == (rseq & 0xff));
+		next = rseq + 1;
+		ret = iom_shift_release(iom_buffer);
+		assert(ret == 0);
+	}
+
+	while (iom_chunks(iom_buffer)) {
+		ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+		assert(ret == 0);
+		memcpy(&rseq, rbuf, sizeof(rseq));
+		assert(rseq >= next);
+		next = rseq + 1;
+	}
+	assert(iom_space(iom_buffer) == 64 - 1);
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+#define PUSHV_TEST_BATCH 4
+
+static void *pushv_test_producer(void *arg)
+{
+	struct mpsc_test_arg *a = arg;
+	unsigned char buf[PUSHV_TEST_BATCH][64];
+	struct iovec iov[PUSHV_TEST_BATCH];
+	uint32_t seq;
+	int ret, i;
+
+	for (seq = 0; seq < MPSC_TEST_CHUNKS; seq += PUSHV_TEST_BATCH) {
+		for (i = 0; i < PUSHV_TEST_BATCH; i++) {
+			uint32_t s = seq + i;
+
+			memcpy(buf[i], &a->id, sizeof(a->id));
+			memcpy(&buf[i][sizeof(s)], &s, sizeof(s));
+			iov[i].iov_base = buf[i];
+			iov[i].iov_len  = 2 * sizeof(s) + (s + a->id) % 32;
+		}
+
+		while ((ret = iom_pushv(a->iom_buffer, iov, PUSHV_TEST_BATCH,
+					IOM_TAIL_DROP)) == ENOBUFS)
+			sched_yield();
+		assert(ret == 0);
+	}
+
+	return NULL;
+}
+
+
+static int pushv_test_flags(unsigned int flags)
+{
+	int ret, i, n;
+	unsigned int rbuf_len, j;
+	struct iom_buffer *iom_buffer;
+	struct iovec iov[8];
+	unsigned char buf[8][24];
+	unsigned char rbuf[64];
+	uint32_t seq = 0, rseq, next = 0;
+
+	ret = iom_init(256, &iom_buffer, flags);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	/* the batch MUST be stored as a whole or not at all */
+	for (i = 0; i < 8; i++) {
+		memset(buf[i], i, sizeof(buf[i]));
+		iov[i].iov_base = buf[i];
+		iov[i].iov_len  = sizeof(buf[i]);
+	}
+	ret = iom_pushv(iom_buffer, iov, 8, IOM_TAIL_DROP);
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 8);
+	ret = iom_pushv(iom_buffer, iov, 2, IOM_TAIL_DROP);
+	assert(ret == ENOBUFS);
+	assert(iom_chunks(iom_buffer) == 8);
+
+	for (i = 0; i < 8; i++) {
+		ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+		assert(ret == 0 && rbuf_len == sizeof(buf[i]));
+		assert(memcmp(rbuf, buf[i], rbuf_len) == 0);
+	}
+	assert(iom_space(iom_buffer) == 256 - 1);
+
+	ret = iom_pushv(iom_buffer, iov, 0, IOM_TAIL_DROP);
+	assert(ret == 0 && iom_chunks(iom_buffer) == 0);
+
+	/* more than the whole buffer */
+	iov[0].iov_len = 254;
+	ret = iom_pushv(iom_buffer, iov, 1, IOM_TAIL_DROP);
+	assert(ret == EINVAL);
+
+	if (flags & IOM_MPSC) {
+		iom_free(iom_buffer);
+		return 0;
+	}
+
+	/*
+	 * random batches with IOM_HEAD_DROP: whatever survives MUST be
+	 * in order and intact
+	 */
+	for (i = 0; i < 20000; i++) {
+		n = 1 + rand() % 8;
+		for (j = 0; j < (unsigned int)n; j++, seq++) {
+			memcpy(buf[j], &seq, sizeof(seq));
+			iov[j].iov_base = buf[j];
+			iov[j].iov_len  = sizeof(seq) + rand() % (sizeof(buf[j]) - sizeof(seq));
+			memset(&buf[j][sizeof(seq)], seq & 0xff, iov[j].iov_len - sizeof(seq));
+		}
+		ret = iom_pushv(iom_buffer, iov, n, IOM_HEAD_DROP);
+		assert(ret == 0);
+
+		while (rand() % 3) {
+			ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+			if (ret == EINVAL)
+				break;
+			assert(ret == 0);
+			memcpy(&rseq, rbuf, sizeof(rseq));
+			assert(rseq >= next);
+			for (j = sizeof(rseq); j < rbuf_len; j++)
+				assert(rbuf[j] == (rseq & 0xff));
+			next = rseq + 1;
+		}
+	}
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+int pushv_test(void)
+{
+	int ret;
+	unsigned int rbuf_len, i, n;
+	struct iom_buffer *iom_buffer;
+	unsigned char rbuf[64];
+	pthread_t producer[MPSC_TEST_PRODUCERS];
+	struct mpsc_test_arg arg[MPSC_TEST_PRODUCERS];
+	uint32_t next[MPSC_TEST_PRODUCERS] = { 0 };
+	uint32_t id, seq, last_id = MPSC_TEST_PRODUCERS;
+
+	ret = pushv_test_flags(IOM_MAINLY_EMPTY);
+	if (ret)
+		return ret;
+	ret = pushv_test_flags(IOM_NO_SPLIT);
+	if (ret)
+		return ret;
+	ret = pushv_test_flags(IOM_MPSC);
+	if (ret)
+		return ret;
+
+	ret = iom_init(4096, &iom_buffer, IOM_MPSC);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < MPSC_TEST_PRODUCERS; i++) {
+		arg[i].iom_buffer = iom_buffer;
+		arg[i].id = i;
+		ret = pthread_create(&producer[i], NULL, pushv_test_producer, &arg[i]);
+		if (ret) {
+			fprintf(stderr, "Cannot create producer thread (%d)\n", ret);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (n = 0; n < MPSC_TEST_PRODUCERS * MPSC_TEST_CHUNKS; n++) {
+		while ((ret = iom_shift(iom_buffer, rbuf, &rbuf_len,
+					sizeof(rbuf))) == EINVAL || ret == EAGAIN)
+			sched_yield();
+		assert(ret == 0);
+
+		/* a batch MUST NOT be interleaved with other producers */
+		memcpy(&id, rbuf, sizeof(id));
+		memcpy(&seq, &rbuf[sizeof(id)], sizeof(seq));
+		assert(id < MPSC_TEST_PRODUCERS);
+		assert(seq == next[id]);
+		assert(rbuf_len == 2 * sizeof(seq) + (seq + id) % 32);
+		if (seq % PUSHV_TEST_BATCH)
+			assert(id == last_id);
+		last_id = id;
+		next[id]++;
+	}
+
+	for (i = 0; i < MPSC_TEST_PRODUCERS; i++)
+		pthread_join(producer[i], NULL);
+
+	assert(iom_chunks(iom_buffer) == 0);
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+struct shift_batch_test_ctx {
+	uint32_t next;
+	unsigned int stop;
+};
+
+static int shift_batch_test_cb(const struct iovec *iov, int iovcnt, void *arg)
+{
+	struct shift_batch_test_ctx *ctx = arg;
+	unsigned char chunk[64];
+	unsigned int len = iov[0].iov_len, i;
+	uint32_t seq;
+
+	memcpy(chunk, iov[0].iov_base, iov[0].iov_len);
+	if (iovcnt == 2) {
+		memcpy(&chunk[len], iov[1].iov_base, iov[1].iov_len);
+		len += iov[1].iov_len;
+	}
+
+	memcpy(&seq, chunk, sizeof(seq));
+	if (seq == ctx->stop)
+		return EPIPE;
+
+	assert(seq == ctx->next);
+	assert(len == sizeof(seq) + seq % 32);
+	for (i = sizeof(seq); i < len; i++)
+		assert(chunk[i] == (seq & 0xff));
+	ctx->next++;
+
+	return 0;
+}
+
+
+static void shift_batch_test_push(struct iom_buffer *iom_buffer, uint32_t seq)
+{
+	unsigned char buf[64];
+	size_t len = sizeof(seq) + seq % 32;
+	int ret;
+
+	memcpy(buf, &seq, sizeof(seq));
+	memset(&buf[sizeof(seq)], seq & 0xff, len - sizeof(seq));
+	ret = iom_push(iom_buffer, buf, len, IOM_TAIL_DROP);
+	assert(ret == 0);
+}
+
+
+static int shift_batch_test_flags(unsigned int flags)
+{
+	int ret, i;
+	unsigned int chunks;
+	uint32_t seq = 0;
+	struct iom_buffer *iom_buffer;
+	struct shift_batch_test_ctx ctx = { 0, UINT32_MAX };
+	unsigned char rbuf[4][64];
+	struct iovec iov[4];
+
+	ret = iom_init(4096, &iom_buffer, flags);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	ret = iom_shift_batch(iom_buffer, 16, 1024, shift_batch_test_cb, &ctx,
+			      &chunks);
+	assert(ret == EINVAL && chunks == 0);
+
+	/* chunk limit, chunk 0 to 3 */
+	for (; seq < 10; seq++)
+		shift_batch_test_push(iom_buffer, seq);
+	ret = iom_shift_batch(iom_buffer, 4, 1024, shift_batch_test_cb, &ctx,
+			      &chunks);
+	assert(ret == 0 && chunks == 4);
+	assert(iom_chunks(iom_buffer) == 6);
+
+	/* byte limit, chunk 4 (8 bytes) and 5 (9 bytes) */
+	ret = iom_shift_batch(iom_buffer, 16, 17, shift_batch_test_cb, &ctx,
+			      &chunks);
+	assert(ret == 0 && chunks == 2);
+
+	/* the first chunk is passed even if it exceeds the byte limit */
+	ret = iom_shift_batch(iom_buffer, 16, 1, shift_batch_test_cb, &ctx,
+			      &chunks);
+	assert(ret == 0 && chunks == 1);
+
+	/* cb stops at chunk 8, which is left in the buffer */
+	ctx.stop = 8;
+	ret = iom_shift_batch(iom_buffer, 16, 1024, shift_batch_test_cb, &ctx,
+			      &chunks);
+	assert(ret == EPIPE && chunks == 1);
+	assert(iom_chunks(iom_buffer) == 2);
+	ctx.stop = UINT32_MAX;
+
+	/* chunk 8 does not fit its buffer */
+	for (i = 0; i < 4; i++) {
+		iov[i].iov_base = rbuf[i];
+		iov[i].iov_len  = 8;
+	}
+	ret = iom_shift_batchv(iom_buffer, iov, 4, &chunks);
+	assert(ret == ENOBUFS && chunks == 0);
+
+	iov[0].iov_len = sizeof(rbuf[0]);
+	ret = iom_shift_batchv(iom_buffer, iov, 4, &chunks);
+	assert(ret == 0 && chunks == 1);
+	assert(iov[0].iov_len == sizeof(seq) + 8);
+	assert(memcmp(rbuf[0], &ctx.next, sizeof(ctx.next)) == 0);
+	iov[0].iov_len = sizeof(rbuf[0]);
+	ret = iom_shift_batchv(iom_buffer, iov, 4, &chunks);
+	assert(ret == 0 && chunks == 1);
+	assert(iov[0].iov_len == sizeof(seq) + 9);
+	ctx.next += 2;
+	assert(iom_space(iom_buffer) == 4096 - 1);
+
+	/* random batches, around the end of the buffer */
+	for (i = 0; i < 100000; i++) {
+		while (iom_space(iom_buffer) > 1024)
+			shift_batch_test_push(iom_buffer, seq++);
+
+		ret = iom_shift_batch(iom_buffer, 1 + rand() % 64,
+				      rand() % 512, shift_batch_test_cb, &ctx,
+				      &chunks);
+		assert(ret == 0 && chunks > 0);
+	}
+
+	while (iom_chunks(iom_buffer)) {
+		ret = iom_shift_batch(iom_buffer, UINT_MAX, SIZE_MAX,
+				      shift_batch_test_cb, &ctx, &chunks);
+		assert(ret == 0);
+	}
+	assert(ctx.next == seq);
+	assert(iom_space(iom_buffer) == 4096 - 1);
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+int shift_batch_test(void)
+{
+	int ret;
+
+	ret = shift_batch_test_flags(IOM_MAINLY_EMPTY);
+	if (ret)
+		return ret;
+	ret = shift_batch_test_flags(IOM_NO_SPLIT);
+	if (ret)
+		return ret;
+
+	return shift_batch_test_flags(IOM_MAGIC_RING);
+}
+
+
+static void fd_test_chunk(unsigned char *buf, size_t *len, uint32_t seq)
+{
+	*len = sizeof(seq) + seq % 1000;
+	memcpy(buf, &seq, sizeof(seq));
+	memset(&buf[sizeof(seq)], seq & 0xff, *len - sizeof(seq));
+}
+
+
+static int fd_test_flags(unsigned int flags)
+{
+	int ret, fds[2];
+	struct iom_buffer *src, *dst;
+	unsigned char buf[1024], rbuf[1024];
+	unsigned int rbuf_len;
+	size_t len, n;
+	uint32_t seq = 0, next = 0;
+
+	ret = iom_init(65536, &src, flags);
+	ret |= iom_init(65536, &dst, flags);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	/*
+	 * framed through a non blocking pipe: partial writes on the
+	 * drain side, partial frames on the fill side
+	 */
+	ret = pipe2(fds, O_NONBLOCK);
+	assert(ret == 0);
+
+	while (next < 20000) {
+		while (seq < 20000) {
+			fd_test_chunk(buf, &len, seq);
+			if (iom_push(src, buf, len, IOM_TAIL_DROP))
+				break;
+			seq++;
+		}
+
+		ret = iom_drain_to_fd(src, fds[1], IOM_FD_FRAMED, &n);
+		assert(ret == 0 || ret == EINVAL || ret == EAGAIN);
+
+		ret = iom_fill_from_fd(dst, fds[0], 1 + rand() % 4096,
+				       IOM_FD_FRAMED, &n);
+		assert(ret == 0 || ret == EAGAIN || ret == ENOBUFS);
+
+		while (iom_shift(dst, rbuf, &rbuf_len, sizeof(rbuf)) == 0) {
+			fd_test_chunk(buf, &len, next);
+			assert(rbuf_len == len);
+			assert(memcmp(rbuf, buf, len) == 0);
+			next++;
+		}
+	}
+	assert(iom_chunks(src) == 0 && iom_chunks(dst) == 0);
+	close(fds[0]);
+	close(fds[1]);
+
+	/* payload only: the chunks arrive as one byte stream */
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(ret == 0);
+
+	ret = iom_push(src, (unsigned char *)"foo", 3, IOM_TAIL_DROP);
+	ret |= iom_push(src, (unsigned char *)"", 0, IOM_TAIL_DROP);
+	ret |= iom_push(src, (unsigned char *)"barbaz", 6, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_drain_to_fd(src, fds[0], 0, &n);
+	assert(ret == 0 && n == 9);
+	assert(iom_chunks(src) == 0);
+	ret = iom_drain_to_fd(src, fds[0], 0, &n);
+	assert(ret == EINVAL && n == 0);
+
+	/* every read becomes one chunk, 0 bytes is end of file */
+	ret = iom_fill_from_fd(dst, fds[1], 4, 0, &n);
+	assert(ret == 0 && n == 4);
+	ret = iom_fill_from_fd(dst, fds[1], sizeof(rbuf), 0, &n);
+	assert(ret == 0 && n == 5);
+	assert(iom_chunks(dst) == 2);
+	ret = iom_shift(dst, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0 && rbuf_len == 4 && memcmp(rbuf, "foob", 4) == 0);
+	ret = iom_shift(dst, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0 && rbuf_len == 5 && memcmp(rbuf, "arbaz", 5) == 0);
+
+	close(fds[0]);
+	ret = iom_fill_from_fd(dst, fds[1], sizeof(rbuf), 0, &n);
+	assert(ret == 0 && n == 0);
+	assert(iom_chunks(dst) == 0);
+	close(fds[1]);
+
+	/* the frames in front of a broken header are kept */
+	ret = pipe2(fds, O_NONBLOCK);
+	assert(ret == 0);
+	ret = iom_push(src, (unsigned char *)"good", 4, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_drain_to_fd(src, fds[1], IOM_FD_FRAMED, &n);
+	assert(ret == 0);
+	ret = write(fds[1], "\xff\xff", 2);
+	assert(ret == 2);
+	ret = iom_fill_from_fd(dst, fds[0], sizeof(rbuf), IOM_FD_FRAMED, &n);
+	assert(ret == EPROTO);
+	assert(iom_chunks(dst) == 1 && dst->fill_pend == 2);
+	ret = iom_shift(dst, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0 && rbuf_len == 4 && memcmp(rbuf, "good", 4) == 0);
+	close(fds[0]);
+	close(fds[1]);
+
+	/* read until EAGAIN and drain: the buffer starts over at 0 */
+	iom_reset(dst);
+	ret = pipe2(fds, O_NONBLOCK);
+	assert(ret == 0);
+	ret = write(fds[1], "abc", 3);
+	assert(ret == 3);
+	ret = iom_fill_from_fd(dst, fds[0], sizeof(rbuf), 0, &n);
+	assert(ret == 0 && n == 3);
+	ret = iom_fill_from_fd(dst, fds[0], sizeof(rbuf), 0, &n);
+	assert(ret == EAGAIN && n == 0);
+	ret = iom_shift(dst, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0 && rbuf_len == 3);
+	if (!(flags & IOM_SPSC))
+		assert(dst->head == 0 && dst->tail == 0);
+	close(fds[0]);
+	close(fds[1]);
+
+	iom_free(dst);
+	iom_free(src);
+
+	return 0;
+}
+
+
+int fd_test(void)
+{
+	int ret, fds[2];
+	struct iom_buffer *iom_buffer;
+	size_t n;
+
+	ret = fd_test_flags(IOM_MAINLY_EMPTY);
+	if (ret)
+		return ret;
+	ret = fd_test_flags(IOM_SPSC);
+	if (ret)
+		return ret;
+	ret = fd_test_flags(IOM_MAGIC_RING);
+	if (ret)
+		return ret;
+	ret = fd_test_flags(IOM_VARINT);
+	if (ret)
+		return ret;
+
+	ret = iom_init(4096, &iom_buffer, IOM_MPSC);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+	ret = pipe(fds);
+	assert(ret == 0);
+	ret = iom_fill_from_fd(iom_buffer, fds[0], 16, 0, &n);
+	assert(ret == ENOTSUP);
+	close(fds[0]);
+	close(fds[1]);
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+static size_t varint_test_len(uint32_t seq)
+{
+	/* mostly 1 byte headers, some 2 and 3 byte ones */
+	switch (seq % 8) {
+	case 0:
+		return sizeof(seq) + seq % 2000;
+	case 1:
+		return sizeof(seq) + seq % 20000;
+	default:
+		return sizeof(seq) + seq % 124;
+	}
+}
+
+
+static int varint_test_flags(unsigned int flags)
+{
+	int ret, i, fds[2];
+	unsigned int rbuf_len, j;
+	struct iom_buffer *iom_buffer, *dst;
+	struct iom_reservation res;
+	unsigned char *buf, *rbuf;
+	uint32_t seq = 0, rseq, next = 0;
+	size_t len, n;
+
+	ret = iom_init(65536, &iom_buffer, flags);
+	ret |= iom_init(65536, &dst, flags);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+	buf  = malloc(65536);
+	rbuf = malloc(65536);
+	assert(buf && rbuf);
+	memset(buf, 'x', 65536);
+
+	/* header width follows the payload length */
+	ret = iom_push(iom_buffer, buf, 127, IOM_TAIL_DROP);
+	assert(ret == 0 && iom_space(iom_buffer) == 65535 - 128);
+	ret = iom_push(iom_buffer, buf, 128, IOM_TAIL_DROP);
+	assert(ret == 0 && iom_space(iom_buffer) == 65535 - 128 - 130);
+	ret = iom_push(iom_buffer, buf, 16384, IOM_TAIL_DROP);
+	assert(ret == 0 && iom_space(iom_buffer) == 65535 - 128 - 130 - 16387);
+	ret = iom_push(iom_buffer, buf, 0, IOM_TAIL_DROP);
+	assert(ret == 0 && iom_space(iom_buffer) == 65535 - 128 - 130 - 16388);
+	for (j = 0; j < 4; j++) {
+		ret = iom_shift(iom_buffer, rbuf, &rbuf_len, 65536);
+		assert(ret == 0);
+	}
+	assert(rbuf_len == 0 && iom_space(iom_buffer) == 65535);
+
+	/* a shortened commit keeps the reserved 2 byte header */
+	ret = iom_push_reserve(iom_buffer, &res, 1000, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_push_commit(iom_buffer, &res, 5);
+	assert(ret == 0 && iom_space(iom_buffer) == 65535 - 7);
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, 65536);
+	assert(ret == 0 && rbuf_len == 5);
+
+	/* random lengths around the end, with drops */
+	for (i = 0; i < 200000; i++) {
+		len = varint_test_len(seq);
+		memcpy(buf, &seq, sizeof(seq));
+		memset(&buf[sizeof(seq)], seq & 0xff, len - sizeof(seq));
+		ret = iom_push(iom_buffer, buf, len, IOM_HEAD_DROP);
+		assert(ret == 0);
+		seq++;
+
+		if (rand() % 2)
+			continue;
+
+		ret = iom_shift(iom_buffer, rbuf, &rbuf_len, 65536);
+		assert(ret == 0);
+		memcpy(&rseq, rbuf, sizeof(rseq));
+		assert(rseq >= next);
+		assert(rbuf_len == varint_test_len(rseq));
+		for (j = sizeof(rseq); j < rbuf_len; j++)
+			assert(rbuf[j] == (rseq & 0xff));
+		next = rseq + 1;
+	}
+
+	/* the framed stream carries the varint headers */
+	if (!(flags & IOM_NO_SPLIT)) {
+		ret = pipe2(fds, O_NONBLOCK);
+		assert(ret == 0);
+		while (next != seq) {
+			iom_drain_to_fd(iom_buffer, fds[1], IOM_FD_FRAMED, &n);
+			ret = iom_fill_from_fd(dst, fds[0], 1 + rand() % 1000,
+					       IOM_FD_FRAMED, &n);
+			assert(ret == 0 || ret == EAGAIN || ret == ENOBUFS);
+			while (iom_shift(dst, rbuf, &rbuf_len, 65536) == 0) {
+				memcpy(&rseq, rbuf, sizeof(rseq));
+				assert(rseq >= next);
+				assert(rbuf_len == varint_test_len(rseq));
+				next = rseq + 1;
+			}
+		}
+		assert(iom_chunks(iom_buffer) == 0 && iom_chunks(dst) == 0);
+		close(fds[0]);
+		close(fds[1]);
+	}
+
+	free(rbuf);
+	free(buf);
+	iom_free(dst);
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+int varint_test(void)
+{
+	int ret;
+	struct iom_buffer *iom_buffer;
+	unsigned char *buf;
+	unsigned int buf_len;
+	size_t size = 4 << 20, len = 3 << 20;
+
+	ret = iom_init(4096, &iom_buffer, IOM_VARINT | IOM_MPSC);
+	assert(ret == EINVAL);
+
+	/* without IOM_VARINT a cookie cannot describe more than 64 KiB */
+	ret = iom_init(1 << 17, &iom_buffer, 0);
+	assert(ret == 0);
+	ret = iom_push(iom_buffer, (unsigned char *)&ret, 65536, IOM_TAIL_DROP);
+	assert(ret == EINVAL);
+	iom_free(iom_buffer);
+
+	/* multi megabyte chunks with a 4 byte header */
+	ret = iom_init(size, &iom_buffer, IOM_VARINT);
+	buf = malloc(len);
+	if (ret || !buf) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+	memset(buf, 0x5a, len);
+	ret = iom_push(iom_buffer, buf, len, IOM_TAIL_DROP);
+	assert(ret == 0 && iom_space(iom_buffer) == size - 1 - len - 4);
+	memset(buf, 0, len);
+	ret = iom_shift(iom_buffer, buf, &buf_len, len);
+	assert(ret == 0 && buf_len == len);
+	assert(buf[0] == 0x5a && buf[len - 1] == 0x5a);
+	free(buf);
+	iom_free(iom_buffer);
+
+	ret = varint_test_flags(IOM_VARINT);
+	if (ret)
+		return ret;
+	ret = varint_test_flags(IOM_VARINT | IOM_NO_SPLIT);
+	if (ret)
+		return ret;
+
+	return varint_test_flags(IOM_VARINT | IOM_MAGIC_RING);
+}
+
+
+static size_t mainly_empty_test_rss(struct iom_buffer *iom_buffer)
+{
+	size_t page = sysconf(_SC_PAGESIZE), i, n = 0;
+	unsigned char vec[(1 << 20) / 4096];
+	int ret;
+
+	assert(iom_buffer->size / page <= sizeof(vec));
+	ret = mincore(iom_buffer->buf, iom_buffer->size, vec);
+	assert(ret == 0);
+	for (i = 0; i < iom_buffer->size / page; i++)
+		n += vec[i] & 1;
+
+	return n * page;
+}
+
+
+int mainly_empty_test(void)
+{
+	int ret, i;
+	unsigned int rbuf_len;
+	struct iom_buffer *iom_buffer;
+	unsigned char buf[1000], rbuf[1000];
+	const size_t size = 1 << 20;
+
+	ret = iom_init(size, &iom_buffer, IOM_MAINLY_EMPTY | IOM_MAGIC_RING);
+	assert(ret == EINVAL);
+
+	ret = iom_init(size, &iom_buffer, IOM_MAINLY_EMPTY);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+	assert(mainly_empty_test_rss(iom_buffer) == 0);
+
+	/* pages are committed as head advances */
+	memset(buf, 0xaa, sizeof(buf));
+	for (i = 0; i < 500; i++) {
+		ret = iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
+		assert(ret == 0);
+	}
+	assert(mainly_empty_test_rss(iom_buffer) >= 500 * sizeof(buf));
+	assert(mainly_empty_test_rss(iom_buffer) < 520 * sizeof(buf));
+
+	/* nothing is given back while chunks are left */
+	for (i = 0; i < 499; i++) {
+		ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+		assert(ret == 0);
+	}
+	assert(mainly_empty_test_rss(iom_buffer) >= 500 * sizeof(buf));
+
+	/* running empty keeps only the first IOM_RECLAIM_KEEP bytes */
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0 && rbuf_len == sizeof(buf));
+	assert(memcmp(rbuf, buf, sizeof(buf)) == 0);
+	assert(mainly_empty_test_rss(iom_buffer) <= IOM_RECLAIM_KEEP);
+
+	/* small traffic stays within them */
+	for (i = 0; i < 10000; i++) {
+		ret = iom_push(iom_buffer, buf, 100, IOM_TAIL_DROP);
+		ret |= iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+		assert(ret == 0 && rbuf_len == 100);
+	}
+	assert(mainly_empty_test_rss(iom_buffer) <= IOM_RECLAIM_KEEP);
+
+	/* all of buf once head wrapped, reclaimed again when empty */
+	for (i = 0; i < 3000; i++) {
+		ret = iom_push(iom_buffer, buf, sizeof(buf), IOM_HEAD_DROP);
+		assert(ret == 0);
+	}
+	assert(mainly_empty_test_rss(iom_buffer) == size);
+	while (iom_chunks(iom_buffer)) {
+		ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+		assert(ret == 0 && memcmp(rbuf, buf, sizeof(buf)) == 0);
+	}
+	assert(mainly_empty_test_rss(iom_buffer) <= IOM_RECLAIM_KEEP);
+
+	iom_reset_secure(iom_buffer);
+	assert(mainly_empty_test_rss(iom_buffer) == 0);
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+struct pool_test_ctx {
+	struct iom_pool *pool;
+	unsigned int seed;
+	int ret;
+};
+
+
+static void *pool_test_thread(void *arg)
+{
+	struct pool_test_ctx *ctx = arg;
+	struct iom_buffer *rings[64] = { NULL };
+	unsigned char buf[64], rbuf[64];
+	unsigned int rbuf_len, i, n;
+	int ret;
+
+	for (i = 0; i < 20000; i++) {
+		n = rand_r(&ctx->seed) % ARRAY_SIZE(rings);
+		if (rings[n]) {
+			ret = iom_shift(rings[n], rbuf, &rbuf_len, sizeof(rbuf));
+			if (ret || rbuf_len != sizeof(buf) || rbuf[0] != n)
+				ctx->ret = EXIT_FAILURE;
+			iom_pool_put(ctx->pool, rings[n]);
+			rings[n] = NULL;
+			continue;
+		}
+		ret = iom_pool_get(ctx->pool, 256 << (n % 4), &rings[n], 0);
+		if (ret) {
+			ctx->ret = EXIT_FAILURE;
+			break;
+		}
+		memset(buf, n, sizeof(buf));
+		ret = iom_push(rings[n], buf, sizeof(buf), IOM_TAIL_DROP);
+		if (ret)
+			ctx->ret = EXIT_FAILURE;
+	}
+
+	for (n = 0; n < ARRAY_SIZE(rings); n++)
+		if (rings[n])
+			iom_pool_put(ctx->pool, rings[n]);
+
+	return NULL;
+}
+
+
+int pool_test(void)
+{
+	int ret, i;
+	unsigned int rbuf_len;
+	struct iom_pool *pool;
+	struct iom_buffer *a, *b, *c;
+	struct pool_test_ctx ctx[4];
+	pthread_t threads[4];
+	unsigned char buf[100], rbuf[100];
+
+	assert(iom_pool_new(&pool, 4096, 1024, 0, 0) == EINVAL);
+	assert(iom_pool_new(&pool, 1024, 4096, 0, 0x80) == EINVAL);
+	assert(iom_pool_new(&pool, 0, 4096, 1 << 20, 0) == EINVAL);
+	assert(iom_pool_new(&pool, 1024, 0, 1 << 20, 0) == EINVAL);
+
+	ret = iom_pool_new(&pool, 256, 2048, 1 << 20, IOM_POOL_HUGEPAGE);
+	if (ret) {
+		fputs("Cannot allocate iom_pool\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	assert(iom_pool_get(pool, 4096, &a, 0) == EINVAL);
+	assert(iom_pool_get(pool, 256, &a, IOM_MAGIC_RING) == EINVAL);
+	assert(iom_pool_get(pool, 256, &a, IOM_MAINLY_EMPTY) == EINVAL);
+	assert(iom_pool_get(pool, 256, &a, IOM_SPSC | IOM_MPSC) == EINVAL);
+
+	/* sizes round up to the next class */
+	ret = iom_pool_get(pool, 1, &a, 0);
+	ret |= iom_pool_get(pool, 300, &b, IOM_VARINT);
+	ret |= iom_pool_get(pool, 2048, &c, IOM_MPSC);
+	assert(ret == 0);
+	assert(a->size == 256 && b->size == 512 && c->size == 2048);
+	assert(iom_space(a) == 255 && iom_space(c) == 2047);
+
+	/* rings of a class do not overlap */
+	memset(buf, 0xbb, sizeof(buf));
+	for (i = 0; i < 2; i++) {
+		ret = iom_push(a, buf, sizeof(buf), IOM_TAIL_DROP);
+		assert(ret == 0);
+	}
+	iom_pool_put(pool, a);
+	ret = iom_pool_get(pool, 200, &a, 0);
+	assert(ret == 0);
+	/* most recently returned first, and empty again */
+	ret = iom_pool_get(pool, 200, &b, 0);
+	assert(ret == 0 && a != b);
+	assert(iom_chunks(a) == 0 && iom_space(a) == 255);
+	assert((unsigned char *)b >= a->buf + a->size ||
+	       b->buf + b->size <= (unsigned char *)a);
+
+	for (i = 0; i < 100; i++) {
+		ret = iom_push(c, buf, sizeof(buf), IOM_TAIL_DROP);
+		ret |= iom_shift(c, rbuf, &rbuf_len, sizeof(rbuf));
+		assert(ret == 0 && rbuf_len == sizeof(buf));
+		assert(memcmp(rbuf, buf, sizeof(buf)) == 0);
+	}
+
+	iom_pool_put(pool, a);
+	iom_pool_put(pool, b);
+	iom_pool_put(pool, c);
+
+	/* churn across threads, rings travel between magazines */
+	for (i = 0; i < 4; i++) {
+		ctx[i].pool = pool;
+		ctx[i].seed = i;
+		ctx[i].ret = 0;
+		ret = pthread_create(&threads[i], NULL, pool_test_thread, &ctx[i]);
+		assert(ret == 0);
+	}
+	for (i = 0; i < 4; i++) {
+		pthread_join(threads[i], NULL);
+		if (ctx[i].ret)
+			return EXIT_FAILURE;
+	}
+
+	iom_pool_free(pool);
+
+	return 0;
+}
+
+
+static size_t alloc_test_rss(struct iom_buffer *iom_buffer)
+{
+	size_t page = sysconf(_SC_PAGESIZE), i, n = 0;
+	unsigned char *vec;
+	int ret;
+
+	vec = malloc(iom_buffer->size / page);
+	assert(vec);
+	ret = mincore(iom_buffer->buf, iom_buffer->size, vec);
+	assert(ret == 0);
+	for (i = 0; i < iom_buffer->size / page; i++)
+		n += vec[i] & 1;
+	free(vec);
+
+	return n * page;
+}
+
+
+/* node of the page at addr, -1 if the kernel cannot tell */
+static int alloc_test_node(void *addr)
+{
+	int node;
+
+	/* MPOL_F_NODE | MPOL_F_ADDR */
+	if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr, 1 | 2))
+		return -1;
+
+	return node;
+}
+
+
+int alloc_test(void)
+{
+	static const unsigned flags[] = {
+		IOM_HUGEPAGE,
+		IOM_POPULATE,
+		IOM_HUGEPAGE | IOM_POPULATE,
+		IOM_NUMA_LOCAL,
+		IOM_NUMA_NODE(0) | IOM_POPULATE,
+		IOM_NUMA_LOCAL | IOM_POPULATE | IOM_HUGEPAGE | IOM_SPSC,
+		IOM_NUMA_NODE(0) | IOM_MAINLY_EMPTY,
+		IOM_MAGIC_RING | IOM_HUGEPAGE | IOM_POPULATE,
+		IOM_MAGIC_RING | IOM_NUMA_LOCAL,
+		/* no such node, still a working ring */
+		IOM_NUMA_NODE(254) | IOM_POPULATE,
+	};
+	int ret, i, j, node;
+	unsigned int rbuf_len;
+	struct iom_buffer *iom_buffer;
+	unsigned char buf[1000], rbuf[1000];
+	const size_t size = 4 << 20;
+
+	assert(iom_init(size, &iom_buffer, IOM_MAINLY_EMPTY | IOM_POPULATE) == EINVAL);
+	assert(iom_init(size, &iom_buffer, IOM_MAINLY_EMPTY | IOM_HUGEPAGE) == EINVAL);
+	assert(iom_init(size, &iom_buffer, IOM_NUMA_LOCAL | IOM_NUMA_NODE(0)) == EINVAL);
+
+	for (i = 0; i < (int)ARRAY_SIZE(flags); i++) {
+		ret = iom_init(size, &iom_buffer, flags[i]);
+		if (ret) {
+			fprintf(stderr, "Cannot allocate iom_buffer (%x)\n", flags[i]);
+			return EXIT_FAILURE;
+		}
+
+		if (flags[i] & IOM_POPULATE)
+			assert(alloc_test_rss(iom_buffer) == size);
+		else if (!(flags[i] & IOM_HUGEPAGE))
+			assert(alloc_test_rss(iom_buffer) < size);
+
+		/* wrap around a couple of times */
+		for (j = 0; j < 20000; j++) {
+			memset(buf, j, sizeof(buf));
+			ret = iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
+			ret |= iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+			assert(ret == 0 && rbuf_len == sizeof(buf));
+			assert(memcmp(rbuf, buf, sizeof(buf)) == 0);
+		}
+
+		/* node 0 exists everywhere */
+		node = alloc_test_node(iom_buffer->buf);
+		if ((flags[i] & IOM_NUMA_MASK) == IOM_NUMA_NODE(0))
+			assert(node == 0 || node == -1);
+
+		iom_free(iom_buffer);
+	}
+
+	return 0;
+}
+
+
+#define	SHM_TEST_CHUNKS 100000
+
+/* sequence numbers of SHM_TEST_CHUNKS chunks of varying length */
+static int shm_test_produce(struct iom_buffer *iom_buffer, unsigned id)
+{
+	unsigned char buf[200];
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < SHM_TEST_CHUNKS; i++) {
+		memcpy(buf, &id, sizeof(id));
+		memcpy(&buf[4], &i, sizeof(i));
+		do {
+			ret = iom_push(iom_buffer, buf, 8 + i % 190, IOM_TAIL_DROP);
+		} while (ret == ENOBUFS);
+		if (ret)
+			return EXIT_FAILURE;
+	}
+
+	return 0;
+}
+
+
+static int shm_test_consume(struct iom_buffer *iom_buffer, unsigned producers)
+{
+	unsigned char rbuf[200];
+	unsigned int rbuf_len, id, seq, next[2] = { 0, 0 }, n;
+	int ret;
+
+	for (n = 0; n < producers * SHM_TEST_CHUNKS; ) {
+		ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+		if (ret == EINVAL || ret == EAGAIN)
+			continue;
+		if (ret)
+			return EXIT_FAILURE;
+		memcpy(&id, rbuf, sizeof(id));
+		memcpy(&seq, &rbuf[4], sizeof(seq));
+		if (id >= producers || seq != next[id] || rbuf_len != 8 + seq % 190)
+			return EXIT_FAILURE;
+		next[id]++;
+		n++;
+	}
+
+	return 0;
+}
+
+
+static int shm_test_wait(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) != pid)
+		return EXIT_FAILURE;
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+
+int shm_test(void)
+{
+	int ret, i;
+	char name[64];
+	pid_t pid[2];
+	struct iom_buffer *iom_buffer, *peer;
+
+	snprintf(name, sizeof(name), "/iomalloc-test-%d", (int)getpid());
+
+	assert(iom_shm_attach(name, &peer) == ENOENT);
+	assert(iom_shm_create(name, 4096, &iom_buffer, IOM_MAINLY_EMPTY) == EINVAL);
+	assert(iom_shm_create(name, 1000, &iom_buffer, 0) == EINVAL);
+
+	/* named ring, the child attaches and consumes */
+	ret = iom_shm_create(name, 1 << 16, &iom_buffer, 0);
+	if (ret) {
+		fprintf(stderr, "Cannot create shm iom_buffer (%d)\n", ret);
+		return EXIT_FAILURE;
+	}
+	assert(iom_buffer->flags & IOM_SPSC);
+	assert(iom_shm_create(name, 1 << 16, &peer, 0) == EEXIST);
+
+	pid[0] = fork();
+	assert(pid[0] >= 0);
+	if (pid[0] == 0) {
+		ret = iom_shm_attach(name, &peer);
+		if (ret)
+			_exit(EXIT_FAILURE);
+		ret = shm_test_consume(peer, 1);
+		iom_free(peer);
+		_exit(ret);
+	}
+	ret = shm_test_produce(iom_buffer, 0);
+	ret |= shm_test_wait(pid[0]);
+	assert(iom_chunks(iom_buffer) == 0);
+	iom_free(iom_buffer);
+	shm_unlink(name);
+	if (ret)
+		return EXIT_FAILURE;
+
+	/* anonymous magic ring, two producer processes */
+	ret = iom_shm_create(NULL, 1 << 16, &iom_buffer,
+			     IOM_MPSC | IOM_MAGIC_RING);
+	if (ret) {
+		fprintf(stderr, "Cannot create shm iom_buffer (%d)\n", ret);
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < 2; i++) {
+		pid[i] = fork();
+		assert(pid[i] >= 0);
+		if (pid[i] == 0)
+			_exit(shm_test_produce(iom_buffer, i));
+	}
+	ret = shm_test_consume(iom_buffer, 2);
+	ret |= shm_test_wait(pid[0]);
+	ret |= shm_test_wait(pid[1]);
+	iom_free(iom_buffer);
+
+	return ret;
+}
+
+
+static int file_test_flags(const char *path, unsigned flags)
+{
+	int ret, i;
+	unsigned int rbuf_len, seq;
+	struct iom_buffer *iom_buffer;
+	unsigned char buf[300], rbuf[300];
+	const size_t size = 1 << 16;
+	pid_t pid;
+
+	unlink(path);
+
+	ret = iom_file_open(path, size, &iom_buffer, flags, 1 << 14);
+	if (ret) {
+		fprintf(stderr, "Cannot open file iom_buffer (%d)\n", ret);
+		return EXIT_FAILURE;
+	}
+
+	/* wrap around once, then leave 70 chunks behind a clean close */
+	for (i = 0; i < 400; i++) {
+		memset(buf, i, sizeof(buf));
+		memcpy(buf, &i, sizeof(i));
+		ret = iom_push(iom_buffer, buf, 100 + i % 200, IOM_HEAD_DROP);
+		assert(ret == 0);
+	}
+	while (iom_chunks(iom_buffer) > 70) {
+		ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+		assert(ret == 0);
+	}
+	iom_free(iom_buffer);
+
+	/* format flags and size must match, placement hints may differ */
+	assert(iom_file_open(path, size, &iom_buffer, flags ^ IOM_NO_SPLIT, 0) == EINVAL);
+	assert(iom_file_open(path, size * 2, &iom_buffer, flags, 0) == EINVAL);
+	ret = iom_file_open(path, 0, &iom_buffer, flags | IOM_POPULATE, 0);
+	assert(ret == 0);
+	assert(iom_buffer->size == size && iom_chunks(iom_buffer) == 70);
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	memcpy(&seq, rbuf, sizeof(seq));
+	assert(ret == 0 && seq == 330 && rbuf_len == 100 + 330 % 200);
+
+	/* a crashing producer loses nothing it published */
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		for (i = 400; i < 410; i++) {
+			memcpy(buf, &i, sizeof(i));
+			iom_push(iom_buffer, buf, 100 + i % 200, IOM_HEAD_DROP);
+		}
+		/* no iom_free(), no msync() */
+		_exit(0);
+	}
+	iom_free(iom_buffer);
+	waitpid(pid, NULL, 0);
+
+	ret = iom_file_open(path, size, &iom_buffer, flags, 0);
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 79);
+
+	/* head written back, data torn: truncated to the last whole chunk */
+	iom_buffer->buf[iom_buffer->head] = 0x7f;
+	iom_buffer->buf[(iom_buffer->head + 1) & (size - 1)] = 0xff;
+	iom_buffer->head = (iom_buffer->head + 50) & (size - 1);
+	iom_free(iom_buffer);
+
+	ret = iom_file_open(path, size, &iom_buffer, flags, 0);
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 79);
+	for (i = 331; i < 410; i++) {
+		ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+		memcpy(&seq, rbuf, sizeof(seq));
+		assert(ret == 0 && seq == (unsigned)i && rbuf_len == 100 + (unsigned)i % 200);
+	}
+	assert(iom_chunks(iom_buffer) == 0);
+
+	/*
+	 * A power failure: head reached the disk, the data pushed since
+	 * the last sync did not. Recovery keeps the synced chunks only.
+	 */
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		unsigned int synced_head;
+
+		for (i = 500; i < 515; i++) {
+			if (i == 510)
+				assert(iom_file_sync(iom_buffer) == 0);
+			memcpy(buf, &i, sizeof(i));
+			iom_push(iom_buffer, buf, 100 + i % 200, IOM_HEAD_DROP);
+		}
+		synced_head = iom_buffer->synced >> 32;
+		while (synced_head != (unsigned int)iom_buffer->head) {
+			iom_buffer->buf[synced_head] = 0;
+			synced_head = (synced_head + 1) & (size - 1);
+		}
+		iom_shm_hdr(iom_buffer)->boot_id[0] ^= 1;
+		_exit(0);
+	}
+	iom_free(iom_buffer);
+	waitpid(pid, NULL, 0);
+
+	ret = iom_file_open(path, size, &iom_buffer, flags, 0);
+	assert(ret == 0);
+	assert(iom_chunks(iom_buffer) == 10);
+	for (i = 500; i < 510; i++) {
+		ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+		memcpy(&seq, rbuf, sizeof(seq));
+		assert(ret == 0 && seq == (unsigned)i && rbuf_len == 100 + (unsigned)i % 200);
+	}
+	iom_free(iom_buffer);
+
+	unlink(path);
+
+	return 0;
+}
+
+
+int file_test(void)
+{
+	static const unsigned flags[] = { 0, IOM_NO_SPLIT, IOM_VARINT,
+					  IOM_MAGIC_RING };
+	char path[64];
+	struct iom_buffer *iom_buffer;
+	int ret, fd;
+	size_t i;
+
+	snprintf(path, sizeof(path), "/tmp/iomalloc-test-%d", (int)getpid());
+
+	assert(iom_file_open(path, 4096, &iom_buffer, IOM_MPSC, 0) == EINVAL);
+	assert(iom_file_open(path, 1000, &iom_buffer, 0, 0) == EINVAL);
+
+	for (i = 0; i < ARRAY_SIZE(flags); i++) {
+		ret = file_test_flags(path, flags[i]);
+		if (ret)
+			return ret;
+	}
+
+	/* not a ring of this version */
+	ret = iom_file_open(path, 4096, &iom_buffer, 0, 0);
+	assert(ret == 0);
+	iom_shm_hdr(iom_buffer)->version++;
+	iom_free(iom_buffer);
+	assert(iom_file_open(path, 4096, &iom_buffer, 0, 0) == EPROTO);
+
+	/* a file cut short before its magic is recreated */
+	fd = open(path, O_RDWR | O_TRUNC);
+	assert(fd >= 0);
+	close(fd);
+	ret = iom_file_open(path, 4096, &iom_buffer, 0, 0);
+	assert(ret == 0 && iom_chunks(iom_buffer) == 0);
+	iom_free(iom_buffer);
+	unlink(path);
+
+	return 0;
+}
+
+
+/* push chunks seq, seq + 1, ... of varying length until n are in */
+static int resize_test_push(struct iom_buffer *iom_buffer, unsigned *seq,
+			    unsigned n)
+{
+	unsigned char buf[200];
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < n; i++, (*seq)++) {
+		memset(buf, *seq, sizeof(buf));
+		memcpy(buf, seq, sizeof(*seq));
+		ret = iom_push(iom_buffer, buf, 20 + *seq % 150, IOM_TAIL_DROP);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+
+static int resize_test_shift(struct iom_buffer *iom_buffer, unsigned *seq,
+			     unsigned n)
+{
+	unsigned char rbuf[200];
+	unsigned int i, rbuf_len, s;
+	int ret;
+
+	for (i = 0; i < n; i++, (*seq)++) {
+		ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+		if (ret)
+			return ret;
+		memcpy(&s, rbuf, sizeof(s));
+		if (s != *seq || rbuf_len != 20 + s % 150 ||
+		    rbuf[rbuf_len - 1] != (unsigned char)s)
+			return EIO;
+	}
+
+	return 0;
+}
+
+
+static int resize_test_flags(unsigned flags, size_t size)
+{
+	unsigned int in = 0, out = 0;
+	struct iom_buffer *iom_buffer;
+	struct iom_reservation res;
+	int ret, i;
+
+	ret = iom_init(size, &iom_buffer, flags);
+	if (ret) {
+		fprintf(stderr, "Cannot allocate iom_buffer (%d)\n", ret);
+		return EXIT_FAILURE;
+	}
+
+	/* tail in the middle, head wrapped behind it */
+	for (i = 0; i < 5 || iom_buffer->head > iom_buffer->tail; i++) {
+		while (resize_test_push(iom_buffer, &in, 1) == 0)
+			;
+		ret = resize_test_shift(iom_buffer, &out, (in - out) / 2);
+		assert(ret == 0 && i < 100);
+	}
+
+	ret = iom_resize(&iom_buffer, size * 4);
+	assert(ret == 0 && iom_buffer->size == size * 4);
+	assert(iom_chunks(iom_buffer) == in - out);
+	ret = resize_test_push(iom_buffer, &in, size / 100);
+	assert(ret == 0);
+
+	/* only what fits */
+	assert(iom_resize(&iom_buffer, size / 4) == ENOBUFS);
+	ret = resize_test_shift(iom_buffer, &out, in - out - 2);
+	assert(ret == 0);
+	ret = iom_resize(&iom_buffer, size / 4);
+	assert(ret == 0 && iom_chunks(iom_buffer) == 2);
+
+	for (i = 0; i < 1000; i++) {
+		ret = resize_test_push(iom_buffer, &in, 1);
+		ret |= resize_test_shift(iom_buffer, &out, 1);
+		assert(ret == 0);
+	}
+	ret = resize_test_shift(iom_buffer, &out, 2);
+	assert(ret == 0 && iom_chunks(iom_buffer) == 0);
+
+	/* a resize drops the reservation, the empty ring resets again */
+	ret = iom_push_reserve(iom_buffer, &res, 10, IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_resize(&iom_buffer, size / 2);
+	assert(ret == 0 && !iom_buffer->push_pend);
+	ret = resize_test_push(iom_buffer, &in, 1);
+	ret |= resize_test_shift(iom_buffer, &out, 1);
+	assert(ret == 0 && iom_buffer->head == 0 && iom_buffer->tail == 0);
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+int resize_test(void)
+{
+	static const unsigned flags[] = { 0, IOM_NO_SPLIT, IOM_VARINT,
+					  IOM_MAINLY_EMPTY, IOM_HUGEPAGE,
+					  IOM_NO_SPLIT | IOM_MAINLY_EMPTY };
+	unsigned int in = 0, out = 0;
+	struct iom_buffer *iom_buffer;
+	unsigned char *big;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < ARRAY_SIZE(flags); i++) {
+		ret = resize_test_flags(flags[i], 4096);
+		if (ret)
+			return ret;
+	}
+	ret = resize_test_flags(IOM_MAGIC_RING, 4 * sysconf(_SC_PAGESIZE));
+	if (ret)
+		return ret;
+
+	assert(iom_init(4096, &iom_buffer, IOM_GROW_MAX(16) | IOM_SPSC) == EINVAL);
+	assert(iom_init(4096, &iom_buffer, IOM_GROW_MAX(11)) == EINVAL);
+
+	ret = iom_init(4096, &iom_buffer, IOM_SPSC);
+	assert(ret == 0);
+	assert(iom_resize(&iom_buffer, 8192) == ENOTSUP);
+	iom_free(iom_buffer);
+
+	/* grows instead of dropping, and never moves */
+	ret = iom_init(1024, &iom_buffer, IOM_GROW_MAX(16) | IOM_NO_SPLIT);
+	assert(ret == 0);
+	assert(iom_resize(&iom_buffer, 1 << 17) == EINVAL);
+	for (i = 0; i < 5 || iom_buffer->head > iom_buffer->tail; i++) {
+		while (iom_space(iom_buffer) > 200)
+			resize_test_push(iom_buffer, &in, 1);
+		ret = resize_test_shift(iom_buffer, &out, (in - out) / 2);
+		assert(ret == 0 && i < 100);
+	}
+	ret = resize_test_push(iom_buffer, &in, 300);
+	assert(ret == 0 && iom_buffer->size == 1 << 15);
+	/* up to the maximum */
+	while ((ret = resize_test_push(iom_buffer, &in, 1)) == 0)
+		;
+	assert(ret == ENOBUFS && iom_buffer->size == 1 << 16);
+	assert(iom_space(iom_buffer) < 200);
+	ret = resize_test_shift(iom_buffer, &out, in - out);
+	assert(ret == 0);
+	ret = iom_resize(&iom_buffer, 1024);
+	assert(ret == 0 && iom_buffer->size == 1024);
+	/* even a chunk larger than the current size */
+	big = calloc(1, 5000);
+	assert(big);
+	ret = iom_push(iom_buffer, big, 5000, IOM_TAIL_DROP);
+	assert(ret == 0 && iom_buffer->size == 8192);
+	free(big);
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+#define	SEGQ_TEST_CHUNKS 200000
+
+static void segq_test_chunk(unsigned char *buf, unsigned int *len,
+			    unsigned int seq)
+{
+	*len = 8 + seq % 300;
+	memset(buf, seq, *len);
+	memcpy(buf, &seq, sizeof(seq));
+}
+
+
+static void *segq_test_producer(void *arg)
+{
+	struct iom_segq *q = arg;
+	unsigned char buf[400];
+	unsigned int i, len;
+
+	for (i = 0; i < SEGQ_TEST_CHUNKS; i++) {
+		segq_test_chunk(buf, &len, i);
+		if (iom_segq_push(q, buf, len))
+			return (void *)1;
+	}
+
+	return NULL;
+}
+
+
+int segq_test(void)
+{
+	int ret, rlen;
+	unsigned int i, len, rbuf_len;
+	struct iom_segq *q;
+	struct iom_segq_iterator *it;
+	unsigned char buf[400], rbuf[400];
+	pthread_t thread;
+	void *tret;
+
+	assert(iom_segq_init(&q, 4096, 2, IOM_MPSC) == EINVAL);
+	assert(iom_segq_init(&q, 5000, 2, 0) == EINVAL);
+
+	ret = iom_segq_init(&q, 4096, 2, IOM_NO_SPLIT);
+	if (ret) {
+		fputs("Cannot allocate iom_segq\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	assert(iom_segq_push(q, buf, 5000) == EINVAL);
+	assert(iom_segq_shift(q, rbuf, &rbuf_len, sizeof(rbuf)) == EINVAL);
+
+	/* a backlog of many segments, nothing dropped */
+	for (i = 0; i < 10000; i++) {
+		segq_test_chunk(buf, &len, i);
+		ret = iom_segq_push(q, buf, len);
+		assert(ret == 0);
+	}
+	assert(iom_segq_chunks(q) == 10000);
+	assert(iom_segq_segments(q) > 300);
+
+	it = iom_segq_iterator_new(q);
+	assert(it);
+	for (i = 0; i < 10000; i++) {
+		ret = iom_segq_iterator_peek_next(it, rbuf, &rlen, sizeof(rbuf));
+		segq_test_chunk(buf, &len, i);
+		assert(ret == 0 && (unsigned)rlen == len);
+		assert(memcmp(rbuf, buf, len) == 0);
+	}
+	assert(iom_segq_iterator_peek_next(it, rbuf, &rlen, sizeof(rbuf)) == EINVAL);
+	iom_segq_iterator_free(it);
+
+	ret = iom_segq_peek(q, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0 && rbuf_len == 8);
+	ret = iom_segq_peek_update(q);
+	assert(ret == 0 && iom_segq_chunks(q) == 9999);
+
+	/* drained segments are recycled, at most keep are kept */
+	for (i = 1; i < 10000; i++) {
+		ret = iom_segq_shift(q, rbuf, &rbuf_len, sizeof(rbuf));
+		segq_test_chunk(buf, &len, i);
+		assert(ret == 0 && rbuf_len == len);
+		assert(memcmp(rbuf, buf, len) == 0);
+		if (i == 5000)
+			assert(iom_segq_segments(q) < 260);
+	}
+	assert(iom_segq_shift(q, rbuf, &rbuf_len, sizeof(rbuf)) == EINVAL);
+	assert(iom_segq_chunks(q) == 0 && iom_segq_segments(q) <= 3);
+	iom_segq_free(q);
+
+	/* a chunk filling a whole segment does not fit, one byte less does */
+	ret = iom_segq_init(&q, 256, 1, 0);
+	assert(ret == 0);
+	len = 256 - sizeof(union encoder_cookie);
+	memset(buf, 0xa5, len);
+	assert(iom_segq_push(q, buf, len) == EINVAL);
+	assert(iom_segq_push(q, buf, len - 1) == 0);
+	assert(iom_segq_push(q, buf, len - 1) == 0);
+	assert(iom_segq_chunks(q) == 2 && iom_segq_segments(q) == 2);
+	for (i = 0; i < 2; i++) {
+		ret = iom_segq_shift(q, rbuf, &rbuf_len, sizeof(rbuf));
+		assert(ret == 0 && rbuf_len == len - 1);
+		assert(memcmp(rbuf, buf, len - 1) == 0);
+	}
+	iom_segq_free(q);
+
+	/* producer and consumer thread */
+	ret = iom_segq_init(&q, 1 << 14, 4, IOM_SPSC);
+	assert(ret == 0);
+	ret = pthread_create(&thread, NULL, segq_test_producer, q);
+	assert(ret == 0);
+	for (i = 0; i < SEGQ_TEST_CHUNKS; ) {
+		ret = iom_segq_shift(q, rbuf, &rbuf_len, sizeof(rbuf));
+		if (ret == EINVAL)
+			continue;
+		segq_test_chunk(buf, &len, i);
+		if (ret || rbuf_len != len || memcmp(rbuf, buf, len))
+			return EXIT_FAILURE;
+		i++;
+	}
+	pthread_join(thread, &tret);
+	if (tret)
+		return EXIT_FAILURE;
+	iom_segq_free(q);
+
+	return 0;
+}
+
+
+
+/*
+ * Mix the inline iom_push()/iom_shift() from iomalloc.h with the
+ * library calls, both must read what the other wrote
+ */
+static int inline_test_flags(unsigned flags)
+{
+	int ret;
+	unsigned int i, len, rbuf_len;
+	struct iom_buffer *iom_buffer;
+	unsigned char buf[2000], rbuf[2000];
+
+	ret = iom_init(4096, &iom_buffer, flags);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	/* one chunk stays in the buffer, head and tail wrap */
+	for (i = 0; i < 1000; i++) {
+		memset(buf, i, sizeof(buf));
+		if (i & 1)
+			ret = iom_push(iom_buffer, buf, (i * 337) % 1300, IOM_TAIL_DROP);
+		else
+			ret = iom_push_slow(iom_buffer, buf, (i * 337) % 1300,
+					    IOM_TAIL_DROP);
+		assert(ret == 0);
+		if (i == 0)
+			continue;
+
+		len = ((i - 1) * 337) % 1300;
+		if (i & 2)
+			ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+		else
+			ret = iom_shift_slow(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+		if (ret || rbuf_len != len ||
+		    (len && rbuf[len - 1] != (unsigned char)(i - 1))) {
+			fprintf(stderr, "chunk %u: ret %d len %u\n", i - 1, ret,
+				rbuf_len);
+			return EXIT_FAILURE;
+		}
+		assert(iom_chunks(iom_buffer) == 1);
+	}
+
+	/* too small a buffer and empty */
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, 1);
+	assert(ret == ENOBUFS);
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == 0);
+	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+	assert(ret == EINVAL);
+	assert(iom_cnt(iom_buffer) == 0);
+	assert(iom_space(iom_buffer) == 4095);
+
+	/* full buffer, the drop policies are left to the library */
+	for (i = 0; i < 5; i++) {
+		ret = iom_push(iom_buffer, buf, 1500, IOM_HEAD_DROP);
+		if (flags & IOM_SPSC)
+			assert(ret == ENOTSUP);
+		else
+			assert(ret == 0);
+	}
+	if (!(flags & (IOM_SPSC | IOM_GROW_MASK))) {
+		/* IOM_NO_SPLIT: the last chunk moved to 0, over the first */
+		assert(iom_chunks(iom_buffer) == (flags & IOM_NO_SPLIT ? 1U : 2U));
+		ret = iom_push(iom_buffer, buf, 10, IOM_DROP_ALL);
+		assert(ret == 0);
+		assert(iom_chunks(iom_buffer) == 1);
+	}
+	if (flags & IOM_GROW_MASK)
+		assert(iom_chunks(iom_buffer) == 5);
+	ret = iom_push(iom_buffer, buf, 70000, IOM_TAIL_DROP);
+	assert(ret == EINVAL);
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+int inline_test(void)
+{
+	static const unsigned flags[] = {
+		0, IOM_SPSC, IOM_MAGIC_RING, IOM_VARINT, IOM_NO_SPLIT,
+		IOM_MAINLY_EMPTY, IOM_GROW_MAX(14),
+	};
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(flags); i++) {
+		if (inline_test_flags(flags[i])) {
+			fprintf(stderr, "flags 0x%x\n", flags[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	return 0;
+}
+
+
+#define WAIT_TEST_CHUNKS 100000
+
+/* pauses now and then, so the consumer parks in the kernel */
+static void *wait_test_producer(void *arg)
+{
+	struct iom_buffer *iom_buffer = arg;
+	unsigned char buf[256];
+	uint32_t seq;
+	size_t len;
+	int ret;
+
+	for (seq = 0; seq < WAIT_TEST_CHUNKS; seq++) {
+		len = sizeof(seq) + seq % (sizeof(buf) - sizeof(seq));
+		memcpy(buf, &seq, sizeof(seq));
+		memset(&buf[sizeof(seq)], seq & 0xff, len - sizeof(seq));
+
+		if (seq % 5000 == 0)
+			usleep(2000);
+		while ((ret = iom_push(iom_buffer, buf, len, IOM_TAIL_DROP)) == ENOBUFS) {
+			ret = iom_wait_writable(iom_buffer, len, -1);
+			assert(ret == 0);
+		}
+		assert(ret == 0);
+	}
+
+	return NULL;
+}
+
+
+/* the consumer pauses as well, so the producer parks */
+static int wait_test_flags(unsigned flags)
+{
+	int ret;
+	unsigned int rbuf_len, i;
+	struct iom_buffer *iom_buffer;
+	unsigned char rbuf[256];
+	pthread_t producer;
+	uint32_t seq, rseq;
+
+	ret = iom_init(4096, &iom_buffer, flags);
+	if (ret) {
+		fputs("Cannot allocate iom_buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	ret = pthread_create(&producer, NULL, wait_test_producer, iom_buffer);
+	if (ret) {
+		fprintf(stderr, "Cannot create producer thread (%d)\n", ret);
+		return EXIT_FAILURE;
+	}
+
+	for (seq = 0; seq < WAIT_TEST_CHUNKS; seq++) {
+		if (seq % 7000 == 0)
+			usleep(2000);
+		while ((ret = iom_shift(iom_buffer, rbuf, &rbuf_len,
+					sizeof(rbuf))) == EINVAL || ret == EAGAIN) {
+			ret = iom_wait_readable(iom_buffer, -1);
+			assert(ret == 0);
+		}
+		if (ret) {
+			fprintf(stderr, "Failed to get buffer (%d)\n", ret);
+			return EXIT_FAILURE;
+		}
+
+		memcpy(&rseq, rbuf, sizeof(rseq));
+		assert(rseq == seq);
+		assert(rbuf_len == sizeof(seq) + seq % (sizeof(rbuf) - sizeof(seq)));
+		for (i = sizeof(seq); i < rbuf_len; i++)
+			assert(rbuf[i] == (seq & 0xff));
+	}
+
+	pthread_join(producer, NULL);
+
+	assert(iom_buffer->rd_waiters == 0 && iom_buffer->wr_waiters == 0);
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+int wait_test(void)
+{
+	int ret;
+	unsigned int rbuf_len;
+	struct iom_buffer *iom_buffer;
+	unsigned char buf[16] = { 0 };
+	struct timespec start, end;
+	pid_t pid;
+
+	/* nobody to wait for */
+	ret = iom_init(4096, &iom_buffer, IOM_WAIT);
+	assert(ret == EINVAL);
+
+	ret = iom_init(4096, &iom_buffer, IOM_SPSC);
+	assert(ret == 0);
+	ret = iom_wait_readable(iom_buffer, 0);
+	assert(ret == EINVAL);
+	iom_free(iom_buffer);
+
+	ret = iom_init(4096, &iom_buffer, IOM_SPSC | IOM_WAIT);
+	assert(ret == 0);
+
+	ret = iom_wait_readable(iom_buffer, 0);
+	assert(ret == ETIMEDOUT);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = iom_wait_readable(iom_buffer, 20);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	assert(ret == ETIMEDOUT);
+	assert((end.tv_sec - start.tv_sec) * 1000 +
+	       (end.tv_nsec - start.tv_nsec) / 1000000 >= 19);
+
+	ret = iom_wait_writable(iom_buffer, 4094, 0);
+	assert(ret == EINVAL);
+	ret = iom_wait_writable(iom_buffer, 4000, 0);
+	assert(ret == 0);
+	ret = iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
+	assert(ret == 0);
+	ret = iom_wait_readable(iom_buffer, 0);
+	assert(ret == 0);
+	ret = iom_wait_writable(iom_buffer, 4090, 10);
+	assert(ret == ETIMEDOUT);
+	iom_free(iom_buffer);
+
+	ret = wait_test_flags(IOM_SPSC | IOM_WAIT);
+	if (ret)
+		return ret;
+	ret = wait_test_flags(IOM_MPSC | IOM_WAIT);
+	if (ret)
+		return ret;
+
+	/* across processes the futex must not be process private */
+	ret = iom_shm_create(NULL, 4096, &iom_buffer, IOM_SPSC | IOM_WAIT);
+	if (ret) {
+		fprintf(stderr, "Cannot create shared iom_buffer (%d)\n", ret);
+		return EXIT_FAILURE;
+	}
+	pid = fork();
+	if (pid < 0)
+		return EXIT_FAILURE;
+	if (pid == 0) {
+		usleep(50000);
+		_exit(iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP));
+	}
+	ret = iom_wait_readable(iom_buffer, 5000);
+	assert(ret == 0);
+	ret = iom_shift(iom_buffer, buf, &rbuf_len, sizeof(buf));
+	assert(ret == 0);
+	ret = shm_test_wait(pid);
+	iom_free(iom_buffer);
+
+	return ret;
+}
+
+
+/* events reported since the last call, the eventfd must agree */
+static unsigned int notify_test_events(struct iom_buffer *iom_buffer, int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	unsigned int events;
+	int ready, ret;
+
+	ready = poll(&pfd, 1, 0);
+	ret = iom_notify_read(iom_buffer, &events);
+	assert(ret == 0);
+	assert(ready == (events != 0));
+	assert(poll(&pfd, 1, 0) == 0);
+
+	return events;
+}
+
+
+#define NOTIFY_TEST_CHUNKS 100000
+
+static void *notify_test_producer(void *arg)
+{
+	struct iom_buffer *iom_buffer = arg;
+	unsigned char buf[64];
+	uint32_t seq;
+	int ret;
+
+	memset(buf, 0, sizeof(buf));
+	for (seq = 0; seq < NOTIFY_TEST_CHUNKS; seq++) {
+		memcpy(buf, &seq, sizeof(seq));
+		if (seq % 5000 == 0)
+			usleep(2000);
+		while ((ret = iom_push(iom_buffer, buf, sizeof(buf),
+				       IOM_TAIL_DROP)) == ENOBUFS)
+			sched_yield();
+		assert(ret == 0);
+	}
+
+	return NULL;
+}
+
+
+/*
+ * The consumer only looks at the ring after the eventfd fired and
+ * drains it completely, a lost empty to non-empty edge hangs in
+ * poll(). HIGH and LOW race with the producer, once all is shifted
+ * the ring must be back below the high watermark.
+ */
+static int notify_test_flags(unsigned flags)
+{
+	struct pollfd pfd;
+	struct iom_buffer *iom_buffer;
+	unsigned char rbuf[64];
+	unsigned int rbuf_len, events, level = 0;
+	pthread_t producer;
+	uint32_t seq = 0, rseq;
+	int ret;
+
+	ret = iom_init(4096, &iom_buffer, flags);
+	assert(ret == 0);
+	ret = iom_notify_fd(iom_buffer, 1024, 3072, &pfd.fd);
+	assert(ret == 0);
+	pfd.events = POLLIN;
+
+	ret = pthread_create(&producer, NULL, notify_test_producer, iom_buffer);
+	if (ret) {
+		fprintf(stderr, "Cannot create producer thread (%d)\n", ret);
+		return EXIT_FAILURE;
+	}
+
+	while (seq < NOTIFY_TEST_CHUNKS) {
+		if (poll(&pfd, 1, 5000) != 1) {
+			fprintf(stderr, "no event, chunk %u (flags 0x%x)\n",
+				seq, flags);
+			return EXIT_FAILURE;
+		}
+		ret = iom_notify_read(iom_buffer, &events);
+		assert(ret == 0);
+		assert((events & (IOM_EV_HIGH | IOM_EV_LOW)) !=
+		       (IOM_EV_HIGH | IOM_EV_LOW));
+		if (events & (IOM_EV_HIGH | IOM_EV_LOW))
+			level = events & (IOM_EV_HIGH | IOM_EV_LOW);
+
+		while ((ret = iom_shift(iom_buffer, rbuf, &rbuf_len,
+					sizeof(rbuf))) != EINVAL) {
+			if (ret == EAGAIN)
+				continue;
+			assert(ret == 0 && rbuf_len == sizeof(rbuf));
+			memcpy(&rseq, rbuf, sizeof(rseq));
+			assert(rseq == seq);
+			seq++;
+		}
+	}
+
+	pthread_join(producer, NULL);
+
+	events = notify_test_events(iom_buffer, pfd.fd);
+	if (events & (IOM_EV_HIGH | IOM_EV_LOW))
+		level = events & (IOM_EV_HIGH | IOM_EV_LOW);
+	assert(level != IOM_EV_HIGH);
+	assert(!(iom_buffer->ev_state & IOM_EV_ABOVE));
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+int notify_test(void)
+{
+	int ret, fd, fd2, i;
+	unsigned int rbuf_len;
+	struct iom_buffer *iom_buffer;
+	unsigned char buf[98] = { 0 };
+
+	ret = iom_init(1024, &iom_buffer, 0);
+	assert(ret == 0);
+	ret = iom_notify_read(iom_buffer, &rbuf_len);
+	assert(ret == EINVAL);
+	ret = iom_notify_fd(iom_buffer, 500, 500, &fd);
+	assert(ret == EINVAL);
+	ret = iom_notify_fd(iom_buffer, 100, 1024, &fd);
+	assert(ret == EINVAL);
+
+	/* a chunk takes 100 bytes */
+	ret = iom_notify_fd(iom_buffer, 100, 500, &fd);
+	assert(ret == 0);
+	assert(notify_test_events(iom_buffer, fd) == 0);
+
+	ret = iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
+	assert(ret == 0);
+	assert(notify_test_events(iom_buffer, fd) == IOM_EV_READABLE);
+	for (i = 0; i < 4; i++)
+		iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
+	assert(notify_test_events(iom_buffer, fd) == 0);
+	iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
+	assert(notify_test_events(iom_buffer, fd) == IOM_EV_HIGH);
+	iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
+	assert(notify_test_events(iom_buffer, fd) == 0);
+
+	for (i = 0; i < 5; i++)
+		iom_shift(iom_buffer, buf, &rbuf_len, sizeof(buf));
+	assert(notify_test_events(iom_buffer, fd) == 0);
+	iom_shift(iom_buffer, buf, &rbuf_len, sizeof(buf));
+	assert(notify_test_events(iom_buffer, fd) == IOM_EV_LOW);
+
+	/* coalesced, and the later crossing replaces the earlier one */
+	iom_shift(iom_buffer, buf, &rbuf_len, sizeof(buf));
+	for (i = 0; i < 6; i++)
+		iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
+	for (i = 0; i < 5; i++)
+		iom_shift(iom_buffer, buf, &rbuf_len, sizeof(buf));
+	assert(notify_test_events(iom_buffer, fd) ==
+	       (IOM_EV_READABLE | IOM_EV_LOW));
+
+	/* head drop keeps it full, no events */
+	for (i = 0; i < 20; i++)
+		iom_push(iom_buffer, buf, sizeof(buf), IOM_HEAD_DROP);
+	assert(notify_test_events(iom_buffer, fd) == IOM_EV_HIGH);
+	for (i = 0; i < 20; i++)
+		iom_push(iom_buffer, buf, sizeof(buf), IOM_HEAD_DROP);
+	assert(notify_test_events(iom_buffer, fd) == 0);
+
+	/* the eventfd stays with a resized ring */
+	ret = iom_resize(&iom_buffer, 2048);
+	assert(ret == 0);
+	ret = iom_notify_fd(iom_buffer, 100, 1500, &fd2);
+	assert(ret == 0 && fd2 == fd);
+	assert(notify_test_events(iom_buffer, fd) == 0);
+	iom_reset(iom_buffer);
+	assert(notify_test_events(iom_buffer, fd) == IOM_EV_LOW);
+	iom_free(iom_buffer);
+	assert(fcntl(fd, F_GETFD) < 0);
+
+	/* a ring with data reports it right away */
+	ret = iom_init(1024, &iom_buffer, IOM_SPSC);
+	assert(ret == 0);
+	for (i = 0; i < 6; i++)
+		iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
+	ret = iom_notify_fd(iom_buffer, 100, 500, &fd);
+	assert(ret == 0);
+	assert(notify_test_events(iom_buffer, fd) ==
+	       (IOM_EV_READABLE | IOM_EV_HIGH));
+	iom_free(iom_buffer);
+
+	ret = iom_shm_create(NULL, 4096, &iom_buffer, IOM_SPSC);
+	assert(ret == 0);
+	ret = iom_notify_fd(iom_buffer, 0, 0, &fd);
+	assert(ret == ENOTSUP);
+	iom_free(iom_buffer);
+
+	ret = notify_test_flags(IOM_SPSC);
+	if (ret)
+		return ret;
+
+	return notify_test_flags(IOM_MPSC);
+}
+
+#define BCAST_TEST_CHUNKS 200000
+#define BCAST_TEST_READERS 3
+
+struct bcast_test_reader {
+	struct iom_cursor *cursor;
+	struct iom_buffer *iom_buffer;
+	/* usleep() every n chunks, 0 never */
+	uint32_t pause;
+	/* attach on the thread, mid stream */
+	int late;
+};
+
+
+static int bcast_test_len(uint32_t seq)
+{
+	return sizeof(seq) + seq % 300;
+}
+
+
+static void *bcast_test_reader(void *arg)
+{
+	struct bcast_test_reader *r = arg;
+	unsigned char buf[512];
+	unsigned int len, i;
+	uint32_t seq = 0, rseq;
+	int ret, first = 1;
+
+	if (r->late) {
+		usleep(5000);
+		ret = iom_cursor_new(r->iom_buffer, 0, &r->cursor);
+		assert(ret == 0);
+	}
+
+	while (seq < BCAST_TEST_CHUNKS) {
+		ret = iom_cursor_shift(r->cursor, buf, &len, sizeof(buf));
+		if (ret == EINVAL) {
+			sched_yield();
+			continue;
+		}
+		assert(ret == 0);
+		memcpy(&rseq, buf, sizeof(rseq));
+		/* a late reader starts anywhere, then sees every chunk */
+		if (first && r->late)
+			seq = rseq;
+		first = 0;
+		assert(rseq == seq);
+		assert(len == (unsigned int)bcast_test_len(seq));
+		for (i = sizeof(seq); i < len; i++)
+			assert(buf[i] == (seq & 0xff));
+		seq++;
+		if (r->pause && seq % r->pause == 0)
+			usleep(1000);
+	}
+
+	iom_cursor_free(r->cursor);
+
+	return NULL;
+}
+
+
+/*
+ * One producer, readers of different pace and one that joins while
+ * the producer runs. All see the same chunks, the producer waits for
+ * the slowest.
+ */
+static int bcast_test_flags(unsigned flags)
+{
+	struct bcast_test_reader r[BCAST_TEST_READERS + 1];
+	pthread_t thread[BCAST_TEST_READERS + 1];
+	struct iom_buffer *iom_buffer;
+	unsigned char buf[512];
+	unsigned int i;
+	uint32_t seq;
+	int ret, len;
+
+	ret = iom_init(1 << 14, &iom_buffer, flags);
+	assert(ret == 0);
+
+	for (i = 0; i <= BCAST_TEST_READERS; i++) {
+		r[i].iom_buffer = iom_buffer;
+		r[i].pause = i == 1 ? 20000 : 0;
+		r[i].late = i == BCAST_TEST_READERS;
+		if (!r[i].late) {
+			ret = iom_cursor_new(iom_buffer, 0, &r[i].cursor);
+			assert(ret == 0);
+		}
+		ret = pthread_create(&thread[i], NULL, bcast_test_reader, &r[i]);
+		if (ret) {
+			fprintf(stderr, "Cannot create reader thread (%d)\n", ret);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (seq = 0; seq < BCAST_TEST_CHUNKS; seq++) {
+		len = bcast_test_len(seq);
+		memcpy(buf, &seq, sizeof(seq));
+		memset(&buf[sizeof(seq)], seq & 0xff, len - sizeof(seq));
+		while ((ret = iom_push(iom_buffer, buf, len,
+				       IOM_TAIL_DROP)) == ENOBUFS)
+			sched_yield();
+		assert(ret == 0);
+	}
+
+	for (i = 0; i <= BCAST_TEST_READERS; i++)
+		pthread_join(thread[i], NULL);
+
+	iom_free(iom_buffer);
+
+	return 0;
+}
+
+
+int bcast_test(void)
+{
+	struct iom_cursor *a, *b, *c[IOM_CURSOR_MAX];
+	struct iom_buffer *iom_buffer;
+	unsigned char buf[100];
+	unsigned int len, lag, i;
+	struct iovec iov[2];
+	int ret, iovcnt;
+
+	ret = iom_init(4096, &iom_buffer, IOM_BROADCAST);
+	assert(ret == EINVAL);
+	ret = iom_init(4096, &iom_buffer, IOM_BROADCAST | IOM_MPSC);
+	assert(ret == EINVAL);
+	ret = iom_init(4096, &iom_buffer, IOM_BROADCAST | IOM_SPSC | IOM_WAIT);
+	assert(ret == EINVAL);
+	ret = iom_shm_create(NULL, 4096, &iom_buffer, IOM_BROADCAST | IOM_SPSC);
+	assert(ret == EINVAL);
+
+	ret = iom_init(4096, &iom_buffer, IOM_SPSC);
+	assert(ret == 0);
+	ret = iom_cursor_new(iom_buffer, 0, &a);
+	assert(ret == EINVAL);
+	iom_free(iom_buffer);
+
+	ret = iom_init(4096, &iom_buffer, IOM_SPSC | IOM_BROADCAST);
+	assert(ret == 0);
+	ret = iom_cursor_new(iom_buffer, 0x2, &a);
+	assert(ret == EINVAL);
+
+	/* nobody reads, nothing is kept */
+	memset(buf, 0, sizeof(buf));
+	for (i = 0; i < 100; i++) {
+		ret = iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
+		assert(ret == 0);
+	}
+	ret = iom_shift(iom_buffer, buf, &len, sizeof(buf));
+	assert(ret == EINVAL);
+
+	/* a chunk takes 102 bytes, 40 fit */
+	ret = iom_cursor_new(iom_buffer, 0, &a);
+	assert(ret == 0);
+	ret = iom_cursor_new(iom_buffer, IOM_CURSOR_DETACH, &b);
+	assert(ret == 0);
+	ret = iom_cursor_shift(a, buf, &len, sizeof(buf));
+	assert(ret == EINVAL);
+	for (i = 0; i < 30; i++) {
+		buf[0] = i;
+		ret = iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
+		assert(ret == 0);
+	}
+	for (i = 0; i < 10; i++) {
+		ret = iom_cursor_shift(a, buf, &len, sizeof(buf));
+		assert(ret == 0 && len == sizeof(buf) && buf[0] == i);
+	}
+	ret = iom_cursor_lag(a, &lag);
+	assert(ret == 0 && lag == 20 * 102);
+	ret = iom_cursor_lag(b, &lag);
+	assert(ret == 0 && lag == 30 * 102);
+
+	/* b holds up the producer and goes */
+	for (i = 30; i < 50; i++) {
+		buf[0] = i;
+		ret = iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
+		assert(ret == 0);
+	}
+	ret = iom_cursor_shift(b, buf, &len, sizeof(buf));
+	assert(ret == EPIPE);
+	ret = iom_cursor_view(b, iov, &iovcnt);
+	assert(ret == EPIPE);
+	ret = iom_cursor_lag(b, &lag);
+	assert(ret == EPIPE);
+	iom_cursor_free(b);
+
+	/* a does not, the producer has to wait for it */
+	ret = iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
+	assert(ret == ENOBUFS);
+	ret = iom_cursor_view(a, iov, &iovcnt);
+	assert(ret == 0 && iov[0].iov_len + (iovcnt == 2 ? iov[1].iov_len : 0) ==
+	       sizeof(buf));
+	assert(((unsigned char *)iov[0].iov_base)[0] == 10);
+	ret = iom_cursor_release(a);
+	assert(ret == 0);
+	ret = iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
+	assert(ret == 0);
+	for (i = 11; i < 51; i++) {
+		ret = iom_cursor_shift(a, buf, &len, sizeof(buf));
+		assert(ret == 0 && buf[0] == (i < 50 ? i : 49));
+	}
+	ret = iom_cursor_shift(a, buf, &len, sizeof(buf));
+	assert(ret == EINVAL);
+	ret = iom_cursor_lag(a, &lag);
+	assert(ret == 0 && lag == 0);
+
+	/* a header longer than what was pushed is not handed out */
+	ret = iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
+	assert(ret == 0);
+	i = a->state & IOM_CURSOR_POS;
+	iom_hdr_put(iom_buffer, i, 4000, 2);
+	ret = iom_cursor_view(a, iov, &iovcnt);
+	assert(ret == EPIPE);
+	ret = iom_cursor_shift(a, buf, &len, sizeof(buf));
+	assert(ret == EPIPE);
+	iom_hdr_put(iom_buffer, i, sizeof(buf), 2);
+	ret = iom_cursor_shift(a, buf, &len, sizeof(buf));
+	assert(ret == 0 && len == sizeof(buf));
+
+	/* slots run out, a freed one is taken again */
+	iom_cursor_free(a);
+	for (i = 0; i < IOM_CURSOR_MAX; i++) {
+		ret = iom_cursor_new(iom_buffer, 0, &c[i]);
+		assert(ret == 0);
+	}
+	ret = iom_cursor_new(iom_buffer, 0, &a);
+	assert(ret == ENOBUFS);
+	iom_cursor_free(c[3]);
+	ret = iom_cursor_new(iom_buffer, 0, &c[3]);
+	assert(ret == 0);
+	for (i = 0; i < IOM_CURSOR_MAX; i++) {
+		ret = iom_cursor_shift(c[i], buf, &len, sizeof(buf));
+		assert(ret == EINVAL);
+		iom_cursor_free(c[i]);
+	}
+	iom_free(iom_buffer);
+
+	ret = bcast_test_flags(IOM_SPSC | IOM_BROADCAST);
+	if (ret)
+		return ret;
+	ret = bcast_test_flags(IOM_SPSC | IOM_BROADCAST | IOM_NO_SPLIT);
+	if (ret)
+		return ret;
+
+	return bcast_test_flags(IOM_SPSC | IOM_BROADCAST | IOM_VARINT);
+}
+
+#define SHARDQ_TEST_PRODUCERS 4
+#define SHARDQ_TEST_CHUNKS    50000
+
+struct shardq_test_producer {
+	struct iom_shardq *q;
+	uint32_t id;
+	/* chunks to push, values from first on */
+	uint32_t first, n;
+};
+
+
+static unsigned int shardq_test_chunk(unsigned char *buf, uint32_t id,
+				      uint32_t seq)
+{
+	memcpy(buf, &id, sizeof(id));
+	memcpy(buf + sizeof(id), &seq, sizeof(seq));
+	memset(buf + 8, seq & 0xff, seq % 40);
+
+	return 8 + seq % 40;
+}
+
+
+static void *shardq_test_producer(void *arg)
+{
+	struct shardq_test_producer *p = arg;
+	unsigned char buf[64];
+	unsigned int len;
+	uint32_t i;
+	int ret;
+
+	for (i = p->first; i < p->first + p->n; ) {
+		len = shardq_test_chunk(buf, p->id, i);
+		ret = iom_shardq_push(p->q, buf, len);
+		if (ret == ENOBUFS) {
+			sched_yield();
+			continue;
+		}
+		if (ret)
+			return (void *)1;
+		i++;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Eight threads one after the other, each pushes two chunks and is
+ * bound to the next of the 4 shards. Returns the values in the
+ * order the consumer sees them.
+ */
+static int shardq_test_bound(unsigned int qflags, uint32_t *seen)
+{
+	struct shardq_test_producer p;
+	struct iom_shardq *q;
+	unsigned char rbuf[64];
+	unsigned int i, len;
+	pthread_t thread;
+	void *tret;
+	int ret;
+
+	ret = iom_shardq_init(&q, 4, 4096, IOM_SHARDQ_THREAD | qflags, 0);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < 8; i++) {
+		p.q = q;
+		p.id = i;
+		p.first = 2 * i;
+		p.n = 2;
+		ret = pthread_create(&thread, NULL, shardq_test_producer, &p);
+		assert(ret == 0);
+		pthread_join(thread, &tret);
+		if (tret)
+			return EXIT_FAILURE;
+	}
+	assert(iom_shardq_chunks(q) == 16);
+
+	/* a chunk which does not fit stays */
+	ret = iom_shardq_shift(q, rbuf, &len, 4);
+	assert(ret == ENOBUFS);
+
+	for (i = 0; i < 16; i++) {
+		ret = iom_shardq_shift(q, rbuf, &len, sizeof(rbuf));
+		if (ret || len < 8)
+			return EXIT_FAILURE;
+		memcpy(&seen[i], rbuf + 4, sizeof(seen[i]));
+	}
+	assert(iom_shardq_shift(q, rbuf, &len, sizeof(rbuf)) == EINVAL);
+	assert(iom_shardq_chunks(q) == 0);
+	iom_shardq_free(q);
+
+	return 0;
+}
+
+
+static int shardq_test_threads(unsigned int qflags)
+{
+	struct shardq_test_producer p[SHARDQ_TEST_PRODUCERS];
+	pthread_t thread[SHARDQ_TEST_PRODUCERS];
+	uint32_t next[SHARDQ_TEST_PRODUCERS] = { 0 };
+	unsigned char buf[64], rbuf[64];
+	unsigned int i, len, rlen, total = 0;
+	struct iom_shardq *q;
+	uint32_t id, seq;
+	void *tret;
+	int ret;
+
+	ret = iom_shardq_init(&q, 0, 1 << 14, qflags, 0);
+	if (ret)
+		return ret;
+	assert(iom_shardq_shards(q) >= 1);
+
+	for (i = 0; i < SHARDQ_TEST_PRODUCERS; i++) {
+		p[i].q = q;
+		p[i].id = i;
+		p[i].first = 0;
+		p[i].n = SHARDQ_TEST_CHUNKS;
+		ret = pthread_create(&thread[i], NULL, shardq_test_producer, &p[i]);
+		assert(ret == 0);
+	}
+
+	while (total < SHARDQ_TEST_PRODUCERS * SHARDQ_TEST_CHUNKS) {
+		ret = iom_shardq_shift(q, rbuf, &rlen, sizeof(rbuf));
+		if (ret == EINVAL || ret == EAGAIN) {
+			sched_yield();
+			continue;
+		}
+		if (ret || rlen < 8)
+			return EXIT_FAILURE;
+		memcpy(&id, rbuf, sizeof(id));
+		memcpy(&seq, rbuf + 4, sizeof(seq));
+		if (id >= SHARDQ_TEST_PRODUCERS || seq >= SHARDQ_TEST_CHUNKS)
+			return EXIT_FAILURE;
+		len = shardq_test_chunk(buf, id, seq);
+		if (rlen != len || memcmp(rbuf, buf, len))
+			return EXIT_FAILURE;
+		/* in order per producer only when bound to a shard */
+		if ((qflags & IOM_SHARDQ_THREAD) && seq != next[id])
+			return EXIT_FAILURE;
+		next[id]++;
+		total++;
+	}
+
+	for (i = 0; i < SHARDQ_TEST_PRODUCERS; i++) {
+		pthread_join(thread[i], &tret);
+		if (tret || next[i] != SHARDQ_TEST_CHUNKS)
+			return EXIT_FAILURE;
+	}
+	assert(iom_shardq_shift(q, rbuf, &rlen, sizeof(rbuf)) == EINVAL);
+	iom_shardq_free(q);
+
+	return 0;
+}
+
+
+int shardq_test(void)
+{
+	struct iom_shardq *q;
+	uint32_t seen[16];
+	unsigned int i;
+	int ret;
+
+	assert(iom_shardq_init(&q, 4, 4096, 0x4, 0) == EINVAL);
+	assert(iom_shardq_init(&q, 4, 4096, 0, IOM_SPSC) == EINVAL);
+	assert(iom_shardq_init(&q, 4, 4096, 0, IOM_WAIT) == EINVAL);
+	assert(iom_shardq_init(&q, 4, 4096, 0, IOM_NO_SPLIT) == EINVAL);
+
+	ret = iom_shardq_init(&q, 2, 4096, IOM_SHARDQ_ORDERED, 0);
+	if (ret) {
+		fputs("Cannot allocate iom_shardq\n", stderr);
+		return EXIT_FAILURE;
+	}
+	assert(iom_shardq_push(q, (unsigned char *)seen, 5000) == EINVAL);
+	iom_shardq_free(q);
+
+	/* shard s holds 2s, 2s + 1, 2s + 8, 2s + 9 */
+	ret = shardq_test_bound(0, seen);
+	if (ret)
+		return ret;
+	for (i = 0; i < 16; i++)
+		if (seen[i] != (i / 8) * 8 + (i % 4) * 2 + (i / 4) % 2)
+			return EXIT_FAILURE;
+
+	/* the merge restores the order of the pushes */
+	ret = shardq_test_bound(IOM_SHARDQ_ORDERED, seen);
+	if (ret)
+		return ret;
+	for (i = 0; i < 16; i++)
+		if (seen[i] != i)
+			return EXIT_FAILURE;
+
+	ret = shardq_test_threads(0);
+	if (ret)
+		return ret;
+	ret = shardq_test_threads(IOM_SHARDQ_ORDERED);
+	if (ret)
+		return ret;
+	ret = shardq_test_threads(IOM_SHARDQ_THREAD);
+	if (ret)
+		return ret;
+
+	return shardq_test_threads(IOM_SHARDQ_THREAD | IOM_SHARDQ_ORDERED);
+}
+
+int prioq_test(void)
+{
+	struct iom_prioq_class cl[3] = {
+		{ 4096, 300, IOM_TAIL_DROP },
+		{ 4096, 100, IOM_TAIL_DROP },
+		{ 4096, 1, IOM_HEAD_DROP },
+	};
+	struct iom_prioq *q;
+	unsigned char buf[2000], rbuf[2000];
+	unsigned int i, len, cls, sent[2] = { 0 };
+	int ret;
+
+	assert(iom_prioq_init(&q, cl, 0, IOM_PRIOQ_DRR, 0) == EINVAL);
+	assert(iom_prioq_init(&q, cl, 3, 2, 0) == EINVAL);
+	assert(iom_prioq_init(&q, cl, 3, IOM_PRIOQ_DRR, IOM_BROADCAST) == EINVAL);
+	/* IOM_HEAD_DROP needs a non concurrent ring */
+	assert(iom_prioq_init(&q, cl, 3, IOM_PRIOQ_DRR, IOM_MPSC) == EINVAL);
+	cl[0].quantum = 0;
+	assert(iom_prioq_init(&q, cl, 3, IOM_PRIOQ_DRR, 0) == EINVAL);
+	cl[0].quantum = 300;
+	cl[0].drop = 7;
+	assert(iom_prioq_init(&q, cl, 3, IOM_PRIOQ_STRICT, 0) == EINVAL);
+	cl[0].drop = IOM_TAIL_DROP;
+
+	/* strict: control overtakes the bulk queued before it */
+	ret = iom_prioq_init(&q, cl, 3, IOM_PRIOQ_STRICT, 0);
+	if (ret) {
+		fputs("Cannot allocate iom_prioq\n", stderr);
+		return EXIT_FAILURE;
+	}
+	memset(buf, 0, sizeof(buf));
+	for (i = 0; i < 3; i++) {
+		buf[0] = i;
+		ret = iom_prioq_push(q, 2, buf, 10);
+		assert(ret == 0);
+	}
+	buf[0] = 42;
+	assert(iom_prioq_push(q, 0, buf, 10) == 0);
+	assert(iom_prioq_push(q, 3, buf, 10) == EINVAL);
+	assert(iom_prioq_chunks(q, 2) == 3);
+	assert(iom_prioq_chunks(q, 0) == 1);
+
+	ret = iom_prioq_shift(q, rbuf, &len, sizeof(rbuf), &cls);
+	if (ret || cls != 0 || len != 10 || rbuf[0] != 42)
+		return EXIT_FAILURE;
+	for (i = 0; i < 3; i++) {
+		ret = iom_prioq_shift(q, rbuf, &len, sizeof(rbuf), &cls);
+		if (ret || cls != 2 || rbuf[0] != i)
+			return EXIT_FAILURE;
+	}
+	assert(iom_prioq_shift(q, rbuf, &len, sizeof(rbuf), NULL) == EINVAL);
+
+	/* each class keeps its drop policy */
+	for (i = 0; i < 100; i++) {
+		buf[0] = i;
+		ret = iom_prioq_push(q, 0, buf, 100);
+		if (ret == ENOBUFS)
+			break;
+		assert(ret == 0);
+		assert(iom_prioq_push(q, 2, buf, 100) == 0);
+	}
+	assert(ret == ENOBUFS && i > 0);
+	assert(iom_prioq_push(q, 2, buf, 100) == 0);
+	ret = iom_prioq_shift(q, rbuf, &len, sizeof(rbuf), &cls);
+	if (ret || cls != 0 || rbuf[0] != 0)
+		return EXIT_FAILURE;
+	while (iom_prioq_chunks(q, 0))
+		assert(iom_prioq_shift(q, rbuf, &len, sizeof(rbuf), &cls) == 0);
+	/* the oldest bulk chunk was dropped for the newest */
+	ret = iom_prioq_shift(q, rbuf, &len, sizeof(rbuf), &cls);
+	if (ret || cls != 2 || rbuf[0] != 1)
+		return EXIT_FAILURE;
+
+	/* a chunk which does not fit stays on turn */
+	assert(iom_prioq_push(q, 1, buf, 50) == 0);
+	assert(iom_prioq_shift(q, rbuf, &len, 10, &cls) == ENOBUFS);
+	ret = iom_prioq_shift(q, rbuf, &len, sizeof(rbuf), &cls);
+	if (ret || cls != 1 || len != 50)
+		return EXIT_FAILURE;
+	iom_prioq_free(q);
+
+	/* DRR: 300 vs 100 bytes per round */
+	ret = iom_prioq_init(&q, cl, 3, IOM_PRIOQ_DRR, 0);
+	if (ret)
+		return EXIT_FAILURE;
+	for (i = 0; i < 20; i++) {
+		assert(iom_prioq_push(q, 0, buf, 100) == 0);
+		assert(iom_prioq_push(q, 1, buf, 100) == 0);
+	}
+	for (i = 0; i < 16; i++) {
+		ret = iom_prioq_shift(q, rbuf, &len, sizeof(rbuf), &cls);
+		if (ret || len != 100 || cls > 1)
+			return EXIT_FAILURE;
+		/* three of class 0, then one of class 1 */
+		if (cls != (i % 4 == 3))
+			return EXIT_FAILURE;
+		sent[cls]++;
+	}
+	assert(sent[0] == 12 && sent[1] == 4);
+
+	/* a chunk far beyond its quantum is still served */
+	assert(iom_prioq_push(q, 2, buf, 1500) == 0);
+	while ((ret = iom_prioq_shift(q, rbuf, &len, sizeof(rbuf), &cls)) == 0)
+		if (cls == 2)
+			break;
+	if (ret || len != 1500)
+		return EXIT_FAILURE;
+	/* the other classes still got their turns */
+	if (iom_prioq_chunks(q, 0) == 8 || iom_prioq_chunks(q, 1) == 16)
+		return EXIT_FAILURE;
+	while (iom_prioq_shift(q, rbuf, &len, sizeof(rbuf), NULL) == 0)
+		;
+	assert(iom_prioq_chunks(q, 0) + iom_prioq_chunks(q, 1) == 0);
+	iom_prioq_free(q);
+
+	return 0;
+}
+
+int main(void)
+{
+	int ret;
+
+	ret = space_test();
+	if (ret) {
+		fprintf(stderr, "space test 1 failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "space test 1 passed\n");
+
+	ret = space_test2();
+	if (ret) {
+		fprintf(stderr, "space test 2 failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "space test 2 passed\n");
+
+	ret = space_test3();
+	if (ret) {
+		fprintf(stderr, "space test 3 failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "space test 3 passed\n");
+
+	ret = space_test4();
+	if (ret) {
+		fprintf(stderr, "space test 4 failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "space test 4 passed\n");
+
+	ret = spsc_test();
+	if (ret) {
+		fprintf(stderr, "spsc test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "spsc test passed\n");
+
+	ret = mpsc_test();
+	if (ret) {
+		fprintf(stderr, "mpsc test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "mpsc test passed\n");
+
+	ret = peek_test();
+	if (ret) {
+		fprintf(stderr, "peek test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "peek test passed\n");
+
+	ret = iterator_test();
+	if (ret) {
+		fprintf(stderr, "iterator test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "iterator test passed\n");
+
+	ret = nearest_power_test();
+	if (ret) {
+		fprintf(stderr, "nearest power test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "nearest power of two test passed\n");
+
+	ret = chunks_number_test();
+	if (ret) {
+		fprintf(stderr, "chunks number test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "chunks number test passed\n");
+
+	ret = size_test();
+	if (ret) {
+		fprintf(stderr, "size test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "size test passed\n");
+
+	ret = chunk_headdrop_test();
+	if (ret) {
+		fprintf(stderr, "chunk headdrop test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "chunk headdrop test passed\n");
+
+	ret = reset_test();
+	if (ret) {
+		fprintf(stderr, "reset test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "reset test passed\n");
+
+	ret = reserve_test();
+	if (ret) {
+		fprintf(stderr, "reserve test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "reserve test passed\n");
+
+	ret = view_test();
+	if (ret) {
+		fprintf(stderr, "view test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "view test passed\n");
+
+	ret = magic_ring_test();
+	if (ret) {
+		fprintf(stderr, "magic ring test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "magic ring test passed\n");
+
+	ret = no_split_test();
+	if (ret) {
+		fprintf(stderr, "no split test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "no split test passed\n");
+
+	ret = pushv_test();
+	if (ret) {
+		fprintf(stderr, "pushv test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "pushv test passed\n");
+
+	ret = shift_batch_test();
+	if (ret) {
+		fprintf(stderr, "shift batch test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "shift batch test passed\n");
+
+	ret = fd_test();
+	if (ret) {
+		fprintf(stderr, "fd test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "fd test passed\n");
+
+	ret = varint_test();
+	if (ret) {
+		fprintf(stderr, "varint test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "varint test passed\n");
+
+	ret = mainly_empty_test();
+	if (ret) {
+		fprintf(stderr, "mainly empty test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "mainly empty test passed\n");
+
+	ret = pool_test();
+	if (ret) {
+		fprintf(stderr, "pool test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "pool test passed\n");
+
+	ret = alloc_test();
+	if (ret) {
+		fprintf(stderr, "alloc test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "alloc test passed\n");
 
-	if (!iom_cnt(iom_buffer))
-		return EINVAL;
+	ret = shm_test();
+	if (ret) {
+		fprintf(stderr, "shm test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "shm test passed\n");
 
-	tail_to_end = iom_tail_to_end(iom_buffer);
-	switch (tail_to_end) {
-	case 1:
-		cookie.s[0] = iom_buffer->buf[iom_buffer->tail];
-		cookie.s[1] = iom_buffer->buf[0];
-		encoded_len = ntohs(cookie.l);
-		if (encoded_len > max_size) return ENOBUFS;
-		memcpy(buf, &iom_buffer->buf[1], encoded_len);
-		break;
-	case 2:
-		cookie.s[0] = iom_buffer->buf[iom_buffer->tail];
-		cookie.s[1] = iom_buffer->buf[iom_buffer->tail + 1];
-		encoded_len = ntohs(cookie.l);
-		if (encoded_len > max_size) return ENOBUFS;
-		memcpy(buf, &iom_buffer->buf[0], encoded_len);
-		break;
-	default:
-		cookie.s[0] = iom_buffer->buf[iom_buffer->tail];
-		cookie.s[1] = iom_buffer->buf[iom_buffer->tail + 1];
-		encoded_len = ntohs(cookie.l);
-		if (encoded_len > max_size) return ENOBUFS;
-		if (tail_to_end - sc >= encoded_len) {
-			memcpy(buf, &iom_buffer->buf[iom_buffer->tail + sc],
-			       encoded_len);
-		} else {
-			remaining = encoded_len - (tail_to_end - sc);
-			memcpy(buf, &iom_buffer->buf[iom_buffer->tail + sc],
-			       tail_to_end - sc);
-			memcpy(&buf[tail_to_end -  sc], iom_buffer->buf,
-			       remaining);
-		}
-		break;
+	ret = file_test();
+	if (ret) {
+		fprintf(stderr, "file test failed\n");
+		return EXIT_FAILURE;
 	}
+	fprintf(stderr, "file test passed\n");
 
-	*buf_len = encoded_len;
-	iom_tail_inc(iom_buffer, encoded_len + sc);
-	iom_buffer->chunks--;
+	ret = resize_test();
+	if (ret) {
+		fprintf(stderr, "resize test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "resize test passed\n");
 
-	/* reset to 0 if to keep memory reference local */
-	if (iom_space(iom_buffer) == iom_buffer->size - 1)
-		iom_reset(iom_buffer);
+	ret = segq_test();
+	if (ret) {
+		fprintf(stderr, "segq test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "segq test passed\n");
 
-	return 0;
-}
+	ret = inline_test();
+	if (ret) {
+		fprintf(stderr, "inline test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "inline test passed\n");
 
+	ret = wait_test();
+	if (ret) {
+		fprintf(stderr, "wait test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "wait test passed\n");
 
-int iom_peek(struct iom_buffer *iom_buffer, unsigned char *buf,
-	     unsigned int *buf_len, unsigned int max_size)
-{
-	unsigned int tail_to_end;
-	int remaining;
-	unsigned int encoded_len;
-	union encoder_cookie cookie;
-	size_t sc = sizeof(union encoder_cookie);
+	ret = notify_test();
+	if (ret) {
+		fprintf(stderr, "notify test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "notify test passed\n");
 
-	assert(iom_buffer);
-	assert(buf_len);
-	assert(max_size > 0);
+	ret = bcast_test();
+	if (ret) {
+		fprintf(stderr, "bcast test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "bcast test passed\n");
 
-	if (!iom_cnt(iom_buffer))
-		return EINVAL;
+	ret = shardq_test();
+	if (ret) {
+		fprintf(stderr, "shardq test failed\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "shardq test passed\n");
 
-	tail_to_end = iom_tail_to_end(iom_buffer);
-	switch (tail_to_end) {
-	case 1:
-		cookie.s[0] = iom_buffer->buf[iom_buffer->tail];
-		cookie.s[1] = iom_buffer->buf[0];
-		encoded_len = ntohs(cookie.l);
-		if (encoded_len > max_size) return ENOBUFS;
-		memcpy(buf, &iom_buffer->buf[1], encoded_len);
-		break;
-	case 2:
-		cookie.s[0] = iom_buffer->buf[iom_buffer->tail];
-		cookie.s[1] = iom_buffer->buf[iom_buffer->tail + 1];
-		encoded_len = ntohs(cookie.l);
-		if (encoded_len > max_size) return ENOBUFS;
-		memcpy(buf, &iom_buffer->buf[0], encoded_len);
-		break;
-	default:
-		cookie.s[0] = iom_buffer->buf[iom_buffer->tail];
-		cookie.s[1] = iom_buffer->buf[iom_buffer->tail + 1];
-		encoded_len = ntohs(cookie.l);
-		if (encoded_len > max_size) return ENOBUFS;
-		if (tail_to_end >= encoded_len) {
-			memcpy(buf, &iom_buffer->buf[iom_buffer->tail + sc],
-			       encoded_len);
-		} else {
-			remaining = encoded_len - (tail_to_end - sc);
-			memcpy(buf, &iom_buffer->buf[iom_buffer->tail + sc],
-			       tail_to_end - sc);
-			memcpy(&buf[tail_to_end -  sc], iom_buffer->buf,
-			       remaining);
-		}
-		break;
+	ret = prioq_test();
+	if (ret) {
+		fprintf(stderr, "prioq test failed\n");
+		return EXIT_FAILURE;
 	}
+	fprintf(stderr, "prioq test passed\n");
 
-	*buf_len = encoded_len;
 
-	return 0;
+	return EXIT_SUCCESS;
+}
+
+#endif /* TEST_BUILD */
+
+
+#if defined(BENCH_BUILD)
+#include <time.h>
+
+static double bench_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
 
 /*
- * iom_peek_update() can be used after iom_peek() to
- * remove the still remaining chunk from the buffer.
- * A iom_peek() followed by a iom_peek_update() is
- * functional identical to iom_shift().
- *
- * This function return 0 for success or any other value
- * to indicate an error.
- *
- * o EINVAL indicates that no chunk was saved.
+ * Steady state push/shift of equally sized chunks. One chunk stays
+ * in the buffer all the time, so head and tail travel around the
+ * ring and regularly cross its end.
  */
-int iom_peek_update(struct iom_buffer *iom_buffer)
+static int bench_push_shift(const char *name, unsigned flags, size_t size,
+			    size_t chunk, unsigned long rounds)
 {
-	unsigned int tail_to_end;
-	int encoded_len;
-	union encoder_cookie cookie;
-	size_t sc = sizeof(union encoder_cookie);
+	int ret;
+	unsigned long i;
+	unsigned int rbuf_len;
+	struct iom_buffer *iom_buffer;
+	unsigned char *buf, *rbuf;
+	double start, ns, mibs;
+	int fd;
 
-	assert(iom_buffer);
+	ret = iom_init(size, &iom_buffer, flags & ~IOM_NOTIFY);
+	if (ret) {
+		fprintf(stderr, "Cannot allocate iom_buffer (%d)\n", ret);
+		return EXIT_FAILURE;
+	}
 
-	if (!iom_cnt(iom_buffer))
-		return EINVAL;
+	/* IOM_NOTIFY: with an eventfd and watermarks attached */
+	if (flags & IOM_NOTIFY) {
+		ret = iom_notify_fd(iom_buffer, size / 4, size / 2, &fd);
+		assert(ret == 0);
+	}
 
-	tail_to_end = iom_tail_to_end(iom_buffer);
-	switch (tail_to_end) {
-	case 1:
-		cookie.s[0] = iom_buffer->buf[iom_buffer->tail];
-		cookie.s[1] = iom_buffer->buf[0];
-		encoded_len = ntohs(cookie.l);
-		break;
-	case 2:
-		cookie.s[0] = iom_buffer->buf[iom_buffer->tail];
-		cookie.s[1] = iom_buffer->buf[iom_buffer->tail + 1];
-		encoded_len = ntohs(cookie.l);
-		break;
-	default:
-		cookie.s[0] = iom_buffer->buf[iom_buffer->tail];
-		cookie.s[1] = iom_buffer->buf[iom_buffer->tail + 1];
-		encoded_len = ntohs(cookie.l);
-		break;
+	buf  = calloc(1, chunk);
+	rbuf = malloc(chunk);
+	if (!buf || !rbuf) {
+		fputs("Cannot allocate buffer\n", stderr);
+		return EXIT_FAILURE;
 	}
 
-	iom_tail_inc(iom_buffer, encoded_len + sc);
-	iom_buffer->chunks--;
+	ret = iom_push(iom_buffer, buf, chunk, IOM_TAIL_DROP);
+	assert(ret == 0);
 
-	/* reset to 0 if to keep memory reference local */
-	if (iom_space(iom_buffer) == iom_buffer->size - 1)
-		iom_reset(iom_buffer);
+	start = bench_time();
+	for (i = 0; i < rounds; i++) {
+		ret = iom_push(iom_buffer, buf, chunk, IOM_TAIL_DROP);
+		ret |= iom_shift(iom_buffer, rbuf, &rbuf_len, chunk);
+		if (ret) {
+			fprintf(stderr, "push/shift failed (%d)\n", ret);
+			return EXIT_FAILURE;
+		}
+	}
+	ns = (bench_time() - start) * 1e9 / rounds;
+	mibs = chunk / ns * 1e9 / (1024 * 1024);
+
+	printf("%-8s size %7zu chunk %6zu: %8.1f ns/op %9.1f MiB/s\n",
+	       name, size, chunk, ns, mibs);
+
+	free(rbuf);
+	free(buf);
+	iom_free(iom_buffer);
 
 	return 0;
 }
 
-struct iom_iterator *iom_iterator_new(struct iom_buffer *iom_buffer)
-{
-	struct iom_iterator *iom_iterator;
 
-	iom_iterator = malloc(sizeof(*iom_iterator));
-	if (!iom_iterator)
-		return NULL;
+static int bench_drain_cb(const struct iovec *iov, int iovcnt, void *arg)
+{
+	unsigned char *rbuf = arg;
 
-	memset(iom_iterator, 0, sizeof(*iom_iterator));
-	iom_iterator->head = iom_buffer->head;
-	iom_iterator->tail = iom_buffer->tail;
+	memcpy(rbuf, iov[0].iov_base, iov[0].iov_len);
+	if (iovcnt == 2)
+		memcpy(&rbuf[iov[0].iov_len], iov[1].iov_base, iov[1].iov_len);
 
-	return iom_iterator;
+	return 0;
 }
 
 
-void iom_iterator_free(struct iom_iterator *iom_iterator)
+/*
+ * Fill the buffer with small chunks and drain it completely, one
+ * iom_shift() per chunk or with a single iom_shift_batch()
+ */
+static int bench_drain(const char *name, int batch, size_t size, size_t chunk,
+		       unsigned long rounds)
 {
-	free(iom_iterator);
+	int ret;
+	unsigned long i, n, total = 0;
+	unsigned int rbuf_len, shifted;
+	struct iom_buffer *iom_buffer;
+	unsigned char *buf, *rbuf;
+	double start, elapsed = 0, ns;
+
+	ret = iom_init(size, &iom_buffer, 0);
+	if (ret) {
+		fprintf(stderr, "Cannot allocate iom_buffer (%d)\n", ret);
+		return EXIT_FAILURE;
+	}
+
+	buf  = calloc(1, chunk);
+	rbuf = malloc(chunk);
+	if (!buf || !rbuf) {
+		fputs("Cannot allocate buffer\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < rounds; i++) {
+		for (n = 0; iom_push(iom_buffer, buf, chunk, IOM_TAIL_DROP) == 0; n++)
+			;
+
+		start = bench_time();
+		if (batch) {
+			ret = iom_shift_batch(iom_buffer, UINT_MAX, SIZE_MAX,
+					      bench_drain_cb, rbuf, &shifted);
+			if (shifted != n)
+				ret = EIO;
+		} else {
+			while ((ret = iom_shift(iom_buffer, rbuf, &rbuf_len,
+						chunk)) == 0)
+				;
+			if (ret == EINVAL)
+				ret = 0;
+		}
+		elapsed += bench_time() - start;
+		if (ret) {
+			fprintf(stderr, "drain failed (%d)\n", ret);
+			return EXIT_FAILURE;
+		}
+		total += n;
+	}
+	ns = elapsed * 1e9 / total;
+
+	printf("%-8s size %7zu chunk %6zu: %8.1f ns/chunk\n",
+	       name, size, chunk, ns);
+
+	free(rbuf);
+	free(buf);
+	iom_free(iom_buffer);
+
+	return 0;
 }
 
 
-int iom_iterator_peek_next(struct iom_iterator *iom_iterator,
-			   struct iom_buffer *iom_buffer,
-			   unsigned char *buf, int *buf_len, int max_size)
+/*
+ * Keep a working set of live rings and replace a random one per
+ * round, with iom_init()/iom_free() or from an iom_pool
+ */
+static int bench_churn(const char *name, int pooled, size_t size,
+		       size_t live, unsigned long rounds)
 {
-	int tail_to_end, encoded_len, remaining;
-	union encoder_cookie cookie;
-	size_t sc = sizeof(union encoder_cookie);
+	int ret;
+	unsigned long i;
+	unsigned int seed = 1;
+	size_t n;
+	struct iom_pool *pool = NULL;
+	struct iom_buffer **rings;
+	double start, ns;
+
+	rings = calloc(live, sizeof(*rings));
+	if (!rings) {
+		fputs("Cannot allocate rings\n", stderr);
+		return EXIT_FAILURE;
+	}
 
-	assert(iom_buffer);
-	assert(max_size);
-	assert(buf_len);
+	if (pooled) {
+		ret = iom_pool_new(&pool, size, size, 64 << 20, 0);
+		if (ret) {
+			fprintf(stderr, "Cannot allocate iom_pool (%d)\n", ret);
+			return EXIT_FAILURE;
+		}
+	}
 
-	if (!iom_cnt_int(iom_iterator->head, iom_iterator->tail, iom_buffer->size))
-		return EINVAL;
+	for (n = 0; n < live; n++) {
+		ret = pooled ? iom_pool_get(pool, size, &rings[n], 0) :
+			       iom_init(size, &rings[n], 0);
+		if (ret) {
+			fprintf(stderr, "Cannot allocate iom_buffer (%d)\n", ret);
+			return EXIT_FAILURE;
+		}
+	}
 
-	tail_to_end = iom_tail_to_end_int(iom_buffer->size, iom_iterator->tail);
-	switch (tail_to_end) {
-	case 1:
-		cookie.s[0] = iom_buffer->buf[iom_iterator->tail];
-		cookie.s[1] = iom_buffer->buf[0];
-		encoded_len = ntohs(cookie.l);
-		if (encoded_len > max_size) return ENOBUFS;
-		memcpy(buf, &iom_buffer->buf[1], encoded_len);
-		break;
-	case 2:
-		cookie.s[0] = iom_buffer->buf[iom_iterator->tail];
-		cookie.s[1] = iom_buffer->buf[iom_iterator->tail + 1];
-		encoded_len = ntohs(cookie.l);
-		if (encoded_len > max_size) return ENOBUFS;
-		memcpy(buf, &iom_buffer->buf[0], encoded_len);
-		break;
-	default:
-		cookie.s[0] = iom_buffer->buf[iom_iterator->tail];
-		cookie.s[1] = iom_buffer->buf[iom_iterator->tail + 1];
-		encoded_len = ntohs(cookie.l);
-		if (encoded_len > max_size) return ENOBUFS;
-		if (tail_to_end >= encoded_len) {
-			memcpy(buf, &iom_buffer->buf[iom_iterator->tail + sc],
-			       encoded_len);
+	start = bench_time();
+	for (i = 0; i < rounds; i++) {
+		n = rand_r(&seed) % live;
+		if (pooled) {
+			iom_pool_put(pool, rings[n]);
+			ret = iom_pool_get(pool, size, &rings[n], 0);
 		} else {
-			remaining = encoded_len - (tail_to_end - sc);
-			memcpy(buf, &iom_buffer->buf[iom_iterator->tail + sc],
-			       tail_to_end - sc);
-			memcpy(&buf[tail_to_end -  sc], iom_buffer->buf,
-			       remaining);
+			iom_free(rings[n]);
+			ret = iom_init(size, &rings[n], 0);
 		}
-		break;
+		if (ret) {
+			fprintf(stderr, "churn failed (%d)\n", ret);
+			return EXIT_FAILURE;
+		}
+		/* touch it like a fresh user would */
+		rings[n]->buf[0] = 0;
 	}
+	ns = (bench_time() - start) * 1e9 / rounds;
 
-	*buf_len = encoded_len;
-	iom_iterator->tail = iom_tail_inc_int(iom_iterator->tail,
-					      iom_buffer->size,
-					      encoded_len + sc);
+	printf("%-8s size %7zu live %7zu: %8.1f ns/op\n", name, size, live, ns);
+
+	for (n = 0; n < live; n++) {
+		if (pooled)
+			iom_pool_put(pool, rings[n]);
+		else
+			iom_free(rings[n]);
+	}
+	if (pool)
+		iom_pool_free(pool);
+	free(rings);
 
 	return 0;
 }
 
+/*
+ * Benchmark suite: throughput, cycles per byte and per-op latency
+ * percentiles of push/shift, peek and iteration, for iomalloc and for
+ * a malloc() per message linked list as baseline. Both are driven
+ * through struct bench_impl, so both pay the same indirect call.
+ */
+#define	BENCH_SAMPLES   (1UL << 16)
+#define	BENCH_BYTES     (32UL << 20)
+#define	BENCH_WALK_MAX  1024
 
-size_t iom_nearest_power_two(size_t k)
+enum {
+	BENCH_PUSHSHIFT,
+	BENCH_PEEK,
+	BENCH_WALK,
+};
+
+struct bench_impl {
+	const char *name;
+	int (*init)(void **ctx, size_t size, unsigned flags);
+	int (*push)(void *ctx, unsigned char *buf, size_t len);
+	int (*shift)(void *ctx, unsigned char *buf, size_t max_size);
+	int (*peek)(void *ctx, unsigned char *buf, size_t max_size);
+	/* copy out the n oldest chunks */
+	int (*walk)(void *ctx, unsigned char *buf, size_t max_size,
+		    unsigned int n);
+	void (*free)(void *ctx);
+};
+
+struct bench_result {
+	double ns;
+	double cycles;
+	double p50, p99, p999;
+};
+
+/* TSC ticks (ns without a TSC) per ns, and the cost of reading it */
+static double bench_cycles_per_ns;
+static uint64_t bench_cycles_overhead;
+
+static __always_inline uint64_t bench_cycles(void)
 {
-	size_t i;
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
 
-	if (k == 1) return 2;
-	k--;
-	for (i = 1; i < sizeof(size_t) * CHAR_BIT; i <<= 1)
-		k = k | k >> i;
-	return k + 1;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
 }
 
 
-#if defined(TEST_BUILD)
-#include <time.h>
+static void bench_calibrate(void)
+{
+	uint64_t c, d, best = UINT64_MAX;
+	double start;
+	int i;
+
+	start = bench_time();
+	c = bench_cycles();
+	while (bench_time() - start < 0.05)
+		;
+	bench_cycles_per_ns = (bench_cycles() - c) / ((bench_time() - start) * 1e9);
+
+	for (i = 0; i < 1000; i++) {
+		c = bench_cycles();
+		d = bench_cycles() - c;
+		if (d < best)
+			best = d;
+	}
+	bench_cycles_overhead = best;
+}
 
-int space_test(void)
+
+static int bench_iom_init(void **ctx, size_t size, unsigned flags)
 {
-	int ret, i, j;
-	unsigned int rbuf_len;
 	struct iom_buffer *iom_buffer;
-	unsigned char buf[2048] = { 0 };
-	unsigned char rbuf[2048];
-	size_t size = 16;
-
-	ret = iom_init(size, &iom_buffer, 0);
-	if (ret) {
-		fputs("Cannot allocate iom_buffer\n", stderr);
-		return EXIT_FAILURE;
-	}
+	int ret;
 
-	srand(time(NULL));
+	ret = iom_init(size, &iom_buffer, flags);
+	*ctx = iom_buffer;
 
-	i = 1000;
-	while (i--) {
-		int iter;
-		unsigned int cnt = (rand() % 10) + 1;
-		iter = (rand() % 100) + 1;
-		fprintf(stderr, "push %d\n", cnt);
+	return ret;
+}
 
-		for (j = 0; j < iter; j++) {
-			ret = iom_push(iom_buffer, buf, cnt, IOM_TAIL_DROP);
-			if (ret) {
-				if (ret == ENOBUFS) {
-					/* reach limit with IOM_TAIL_DROP */
-					iter = j;
-					break;
-				}
-				fprintf(stderr, "ERROR (ret: %d)\n", ret);
-				return EXIT_FAILURE;
-			}
-			fprintf(stderr, "  push iteration: %d\n", j);
-		}
 
-		for (j = 0; j < iter; j++) {
-			ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
-			if (ret) {
-				fprintf(stderr, "Failed to get buffer (%d)\n", ret);
-				return EXIT_FAILURE;
-			}
-			fprintf(stderr, "  shift iteration: %d, %d byte\n", j, rbuf_len);
+static int bench_iom_push(void *ctx, unsigned char *buf, size_t len)
+{
+	return iom_push(ctx, buf, len, IOM_TAIL_DROP);
+}
 
-			assert(rbuf_len == cnt);
-		}
 
-		fprintf(stderr, "rbuf: %d\n", rbuf_len);
-		if (iom_space(iom_buffer) != size - 1) {
-			fprintf(stderr, "wrong capacity %d\n", iom_space(iom_buffer));
-			assert(0);
-		}
+static int bench_iom_shift(void *ctx, unsigned char *buf, size_t max_size)
+{
+	unsigned int buf_len;
 
-		fputs("\n\n", stderr);
-	}
+	return iom_shift(ctx, buf, &buf_len, max_size);
+}
 
-	iom_free(iom_buffer);
 
-	return 0;
+static int bench_iom_peek(void *ctx, unsigned char *buf, size_t max_size)
+{
+	unsigned int buf_len;
+
+	return iom_peek(ctx, buf, &buf_len, max_size);
 }
 
-int space_test2(void)
+
+static int bench_iom_walk(void *ctx, unsigned char *buf, size_t max_size,
+			  unsigned int n)
 {
-	int ret, i, j;
-	unsigned int rbuf_len;
-	struct iom_buffer *iom_buffer;
-	unsigned char buf[2048] = { 0 };
-	unsigned char rbuf[2048];
-	size_t size = iom_nearest_power_two(32000);
+	struct iom_iterator *it;
+	int buf_len, ret = 0;
 
-	ret = iom_init(size, &iom_buffer, 0);
-	if (ret) {
-		fputs("Cannot allocate iom_buffer\n", stderr);
-		return EXIT_FAILURE;
-	}
+	it = iom_iterator_new(ctx);
+	if (!it)
+		return ENOMEM;
+	while (n-- && !ret)
+		ret = iom_iterator_peek_next(it, ctx, buf, &buf_len, max_size);
+	iom_iterator_free(it);
 
-	i = 1000;
-	while (i--) {
-		int iter;
-		unsigned int cnt = (rand() % 1500) + 1;
-		iter = (rand() % 100) + 1;
-		fprintf(stderr, "push %d byte\n", cnt);
+	return ret;
+}
 
-		for (j = 0; j < iter; j++) {
-			ret = iom_push(iom_buffer, buf, cnt, IOM_TAIL_DROP);
-			if (ret) {
-				if (ret == ENOBUFS) {
-					/* reach limit with IOM_TAIL_DROP */
-					iter = j;
-					break;
-				}
-				fprintf(stderr, "ERROR (ret: %d)\n", ret);
-				return EXIT_FAILURE;
-			}
-			fprintf(stderr, "  push iteration: %d\n", j);
-		}
 
-		ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
-		if (ret) {
-			fprintf(stderr, "Failed to get buffer (%d)\n", ret);
-			return EXIT_FAILURE;
-		}
-		fprintf(stderr, "  shift iteration: %d, %d byte\n", j, rbuf_len);
+static void bench_iom_free(void *ctx)
+{
+	iom_free(ctx);
+}
 
-		ret = iom_push(iom_buffer, buf, cnt, IOM_TAIL_DROP);
-		if (ret) {
-			if (ret == ENOBUFS) {
-				/* reach limit with IOM_TAIL_DROP */
-				iter = j;
-				break;
-			}
-			fprintf(stderr, "ERROR (ret: %d)\n", ret);
-			return EXIT_FAILURE;
-		}
-		fprintf(stderr, "  push iteration: %d\n", j);
 
-		for (j = 0; j < iter; j++) {
-			ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
-			if (ret) {
-				fprintf(stderr, "Failed to get buffer (%d)\n", ret);
-				return EXIT_FAILURE;
-			}
-			fprintf(stderr, "  shift iteration: %d, %d byte\n", j, rbuf_len);
+struct bench_node {
+	struct bench_node *next;
+	size_t len;
+	unsigned char data[FLEX_ARRAY];
+};
 
-			assert(rbuf_len == cnt);
-		}
+struct bench_list {
+	struct bench_node *head;
+	struct bench_node **tailp;
+};
 
-		fprintf(stderr, "rbuf: %d\n", rbuf_len);
-		if (iom_space(iom_buffer) != size - 1) {
-			fprintf(stderr, "wrong capacity %d\n", iom_space(iom_buffer));
-			assert(0);
-		}
 
-		fputs("\n\n", stderr);
-	}
+static int bench_list_init(void **ctx, size_t size, unsigned flags)
+{
+	struct bench_list *list;
 
-	iom_free(iom_buffer);
+	(void)size;
+	(void)flags;
+
+	list = malloc(sizeof(*list));
+	if (!list)
+		return ENOMEM;
+	list->head = NULL;
+	list->tailp = &list->head;
+	*ctx = list;
 
 	return 0;
 }
 
 
-int space_test3(void)
+static int bench_list_push(void *ctx, unsigned char *buf, size_t len)
 {
-	int ret;
-	struct iom_buffer *iom_buffer;
-	unsigned char buf;
+	struct bench_list *list = ctx;
+	struct bench_node *node;
 
-	ret = iom_init(8, &iom_buffer, 0);
-	if (ret) {
-		fputs("Cannot allocate iom_buffer\n", stderr);
-		return EXIT_FAILURE;
-	}
+	node = malloc(sizeof(*node) + len);
+	if (!node)
+		return ENOBUFS;
+	node->next = NULL;
+	node->len = len;
+	memcpy(node->data, buf, len);
+	*list->tailp = node;
+	list->tailp = &node->next;
 
-	buf = 0;
-	ret = iom_push(iom_buffer, &buf, sizeof(buf), IOM_TAIL_DROP);
-	assert(ret == 0);
+	return 0;
+}
 
-	buf = 1;
-	ret = iom_push(iom_buffer, &buf, sizeof(buf), IOM_TAIL_DROP);
-	assert(ret == 0);
 
-	/* the following test MUST fail! Why, because local
-	 * accouning requires 2 byte for each chunk. If we save
-	 * 2 x 1byte we require 6 byte. If we want to save another
-	 * byte (with additional overhead of 2 bytes), the operation
-	 * MUST fail
-	 */
-	buf = 23;
-	ret = iom_push(iom_buffer, &buf, sizeof(buf), IOM_TAIL_DROP);
-	assert(ret != 0);
+static int bench_list_shift(void *ctx, unsigned char *buf, size_t max_size)
+{
+	struct bench_list *list = ctx;
+	struct bench_node *node = list->head;
 
-	iom_free(iom_buffer);
+	if (!node)
+		return EINVAL;
+	if (node->len > max_size)
+		return ENOBUFS;
+	memcpy(buf, node->data, node->len);
+	list->head = node->next;
+	if (!list->head)
+		list->tailp = &list->head;
+	free(node);
 
 	return 0;
 }
 
 
-int space_test4(void)
+static int bench_list_peek(void *ctx, unsigned char *buf, size_t max_size)
 {
-	int ret;
-	unsigned int rbuf_len;
-	struct iom_buffer *iom_buffer;
-	unsigned char *buf;
-	unsigned char rbuf[3];
-
-	ret = iom_init(8, &iom_buffer, 0);
-	if (ret) {
-		fputs("Cannot allocate iom_buffer\n", stderr);
-		return EXIT_FAILURE;
-	}
-
-	buf = (unsigned char *)"AAA";
-	ret = iom_push(iom_buffer, buf, 3, IOM_TAIL_DROP);
-	assert(ret == 0);
+	struct bench_list *list = ctx;
 
-	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
-	if (ret) {
-		fprintf(stderr, "Failed to get buffer (%d)\n", ret);
-		return EXIT_FAILURE;
-	}
+	if (!list->head)
+		return EINVAL;
+	if (list->head->len > max_size)
+		return ENOBUFS;
+	memcpy(buf, list->head->data, list->head->len);
 
-	/* ok, head is now 3 + 2 byte shifted within iom_buffer */
+	return 0;
+}
 
-	buf = (unsigned char *)"BB";
-	ret = iom_push(iom_buffer, buf, 3, IOM_TAIL_DROP);
-	assert(ret == 0);
 
+static int bench_list_walk(void *ctx, unsigned char *buf, size_t max_size,
+			   unsigned int n)
+{
+	struct bench_list *list = ctx;
+	struct bench_node *node;
 
-	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
-	if (ret) {
-		fprintf(stderr, "Failed to get buffer (%d)\n", ret);
-		return EXIT_FAILURE;
+	for (node = list->head; node && n; node = node->next, n--) {
+		if (node->len > max_size)
+			return ENOBUFS;
+		memcpy(buf, node->data, node->len);
 	}
-	assert(rbuf_len == 3);
 
-	iom_free(iom_buffer);
-
-	return 0;
+	return n ? EINVAL : 0;
 }
 
 
-int peek_test(void)
+static void bench_list_free(void *ctx)
 {
-	int ret;
-	struct iom_buffer *iom_buffer;
-	size_t size = 8;
-	unsigned char data;
-	unsigned char rdata;
-	unsigned int rdata_len;
+	struct bench_list *list = ctx;
 
-	ret = iom_init(size, &iom_buffer, 0);
-	if (ret) {
-		fputs("Cannot allocate iom_buffer\n", stderr);
-		return EXIT_FAILURE;
+	while (list->head) {
+		struct bench_node *node = list->head;
+
+		list->head = node->next;
+		free(node);
 	}
+	free(list);
+}
 
-	data = 1;
 
-	ret = iom_push(iom_buffer, &data, sizeof(data), IOM_TAIL_DROP);
-	if (ret) {
-		fprintf(stderr, "ERROR (ret: %d)\n", ret);
-		return EXIT_FAILURE;
-	}
-	fprintf(stderr, "  push iteration: %d\n", data);
+static const struct bench_impl bench_impls[] = {
+	{
+		"iom", bench_iom_init, bench_iom_push, bench_iom_shift,
+		bench_iom_peek, bench_iom_walk, bench_iom_free,
+	}, {
+		"list", bench_list_init, bench_list_push, bench_list_shift,
+		bench_list_peek, bench_list_walk, bench_list_free,
+	},
+};
 
-	/* two successive tests, same result MUST be presented */
-	ret = iom_peek(iom_buffer, &rdata, &rdata_len, sizeof(rdata));
-	if (ret) {
-		fprintf(stderr, "Failed to get buffer (%d)\n", ret);
-		return EXIT_FAILURE;
-	}
-	fprintf(stderr, "  shift iteration: %d, %d byte\n", rdata, rdata_len);
-	assert(rdata == data);
 
-	ret = iom_peek(iom_buffer, &rdata, &rdata_len, sizeof(rdata));
-	if (ret) {
-		fprintf(stderr, "Failed to get buffer (%d)\n", ret);
-		return EXIT_FAILURE;
-	}
-	fprintf(stderr, "  shift iteration: %d, %d byte\n", rdata, rdata_len);
-	assert(rdata == data);
+static int bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
 
-	/* now new finally remove the peeked element from the buffer */
-	ret = iom_peek_update(iom_buffer);
-	assert(ret == 0);
+	return x < y ? -1 : x > y;
+}
 
-	/* this must fail, because no more chunks are in buffer */
-	ret = iom_peek_update(iom_buffer);
-	assert(ret != 0);
 
-	iom_free(iom_buffer);
+static __always_inline int bench_op(const struct bench_impl *impl, void *ctx,
+				    int op, unsigned char *buf,
+				    unsigned char *rbuf, size_t chunk,
+				    unsigned int n)
+{
+	int ret;
 
-	return 0;
+	switch (op) {
+	case BENCH_PUSHSHIFT:
+		ret = impl->push(ctx, buf, chunk);
+		ret |= impl->shift(ctx, rbuf, chunk);
+		return ret;
+	case BENCH_PEEK:
+		return impl->peek(ctx, rbuf, chunk);
+	case BENCH_WALK:
+		return impl->walk(ctx, rbuf, chunk, n);
+	default:
+		return EINVAL;
+	}
 }
 
 
-int iterator_test(void)
+/*
+ * One measurement: a throughput pass over rounds operations, then a
+ * latency pass timing up to BENCH_SAMPLES of them one by one. resident
+ * chunks stay in the buffer during the run - with one resident chunk
+ * push/shift wraps around the end of a ring all the time, without
+ * the ring is empty after every shift and restarts at 0. BENCH_WALK
+ * results are per chunk.
+ */
+static int bench_run(const struct bench_impl *impl, int op, size_t size,
+		     unsigned flags, size_t chunk, unsigned int resident,
+		     unsigned long rounds, struct bench_result *res)
 {
+	unsigned long i, samples = min(rounds, BENCH_SAMPLES);
+	unsigned int n = op == BENCH_WALK ? resident : 1;
+	unsigned char *buf, *rbuf;
+	uint64_t *lat, c, start_cycles;
+	double start;
+	void *ctx;
 	int ret;
-	struct iom_buffer *iom_buffer;
-	struct iom_iterator *iom_iterator;
-	size_t size = 8;
-	unsigned char data;
-	unsigned char rdata;
-	int rdata_len;
 
-	ret = iom_init(size, &iom_buffer, 0);
-	if (ret) {
-		fputs("Cannot allocate iom_buffer\n", stderr);
+	buf  = calloc(1, chunk);
+	rbuf = malloc(chunk);
+	lat  = malloc(samples * sizeof(*lat));
+	if (!buf || !rbuf || !lat) {
+		fputs("Cannot allocate buffer\n", stderr);
 		return EXIT_FAILURE;
 	}
 
-	data = 1;
-	ret = iom_push(iom_buffer, &data, sizeof(data), IOM_TAIL_DROP);
+	ret = impl->init(&ctx, size, flags);
 	if (ret) {
-		fprintf(stderr, "ERROR (ret: %d)\n", ret);
+		fprintf(stderr, "Cannot allocate %s (%d)\n", impl->name, ret);
 		return EXIT_FAILURE;
 	}
-	fprintf(stderr, "  push iteration: %d\n", data);
-
-	data = 2;
-	ret = iom_push(iom_buffer, &data, sizeof(data), IOM_TAIL_DROP);
+	for (i = 0; i < resident && !ret; i++)
+		ret = impl->push(ctx, buf, chunk);
+
+	start = bench_time();
+	start_cycles = bench_cycles();
+	for (i = 0; i < rounds && !ret; i++)
+		ret = bench_op(impl, ctx, op, buf, rbuf, chunk, n);
+	c = bench_cycles() - start_cycles;
+	res->ns = (bench_time() - start) * 1e9 / rounds / n;
+	res->cycles = (double)c / rounds / n;
+
+	for (i = 0; i < samples && !ret; i++) {
+		c = bench_cycles();
+		ret = bench_op(impl, ctx, op, buf, rbuf, chunk, n);
+		lat[i] = bench_cycles() - c;
+		lat[i] = lat[i] > bench_cycles_overhead ?
+			 lat[i] - bench_cycles_overhead : 0;
+	}
 	if (ret) {
-		fprintf(stderr, "ERROR (ret: %d)\n", ret);
+		fprintf(stderr, "%s failed (%d)\n", impl->name, ret);
 		return EXIT_FAILURE;
 	}
-	fprintf(stderr, "  push iteration: %d\n", data);
 
-	iom_iterator = iom_iterator_new(iom_buffer);
-	assert(iom_iterator);
+	qsort(lat, samples, sizeof(*lat), bench_cmp_u64);
+	res->p50  = lat[samples / 2] / bench_cycles_per_ns / n;
+	res->p99  = lat[samples * 99 / 100] / bench_cycles_per_ns / n;
+	res->p999 = lat[samples * 999 / 1000] / bench_cycles_per_ns / n;
 
-	ret = iom_iterator_peek_next(iom_iterator, iom_buffer, &rdata,
-				     &rdata_len, sizeof(rdata));
-	assert(ret == 0);
-	assert(rdata_len == sizeof(data));
-	assert(rdata == 1);
+	impl->free(ctx);
+	free(lat);
+	free(rbuf);
+	free(buf);
 
+	return 0;
+}
 
-	ret = iom_iterator_peek_next(iom_iterator, iom_buffer, &rdata,
-				     &rdata_len, sizeof(rdata));
-	assert(ret == 0);
-	assert(rdata_len == sizeof(data));
-	assert(rdata == 2);
 
-	ret = iom_iterator_peek_next(iom_iterator, iom_buffer, &rdata,
-				     &rdata_len, sizeof(rdata));
-	assert(ret != 0);
+static void bench_report(int csv, const char *op, const char *impl,
+			 const char *pattern, size_t size, size_t chunk,
+			 const struct bench_result *res)
+{
+	double mibs = chunk / res->ns * 1e9 / (1024 * 1024);
 
-	iom_iterator_free(iom_iterator);
-	iom_free(iom_buffer);
+	if (csv) {
+		printf("%s,%s,%s,%zu,%zu,%.2f,%.1f,%.4f,%.1f,%.1f,%.1f\n",
+		       op, impl, pattern, size, chunk, res->ns, mibs,
+		       res->cycles / chunk, res->p50, res->p99, res->p999);
+		return;
+	}
+
+	printf("%-9s %-4s %-6s ring %8zu chunk %5zu: %8.1f ns/op %9.1f MiB/s "
+	       "%8.3f cyc/B  p50 %7.1f p99 %7.1f p99.9 %8.1f ns\n",
+	       op, impl, pattern, size, chunk, res->ns, mibs,
+	       res->cycles / chunk, res->p50, res->p99, res->p999);
+}
+
+
+/*
+ * All operations for chunk sizes from 1 byte to 64 KiB on three ring
+ * sizes. 64 KiB chunks exceed the 2 byte cookie and use IOM_VARINT.
+ */
+static int bench_suite(int csv)
+{
+	static const size_t sizes[] = { 64 << 10, 1 << 20, 16 << 20 };
+	static const size_t chunks[] = { 1, 16, 256, 4096, 65536 };
+	struct bench_result res;
+	unsigned long rounds;
+	unsigned int walk;
+	unsigned flags;
+	size_t s, c, i;
+	int ret = 0;
+
+	if (csv)
+		puts("op,impl,pattern,ring,chunk,ns_op,mib_s,cycles_byte,"
+		     "p50_ns,p99_ns,p999_ns");
+
+	for (s = 0; s < ARRAY_SIZE(sizes); s++) {
+		for (c = 0; c < ARRAY_SIZE(chunks); c++) {
+			if (chunks[c] + 4 > sizes[s] / 4)
+				continue;
+
+			flags = chunks[c] > USHRT_MAX ? IOM_VARINT : 0;
+			rounds = BENCH_BYTES / chunks[c];
+			rounds = max(rounds, 2000UL);
+			rounds = min(rounds, 1UL << 21);
+			walk = sizes[s] / 2 / (chunks[c] + 4);
+			walk = min(walk, (unsigned int)BENCH_WALK_MAX);
+
+			for (i = 0; i < ARRAY_SIZE(bench_impls); i++) {
+				const struct bench_impl *impl = &bench_impls[i];
+
+				ret |= bench_run(impl, BENCH_PUSHSHIFT, sizes[s],
+						 flags, chunks[c], 0, rounds, &res);
+				bench_report(csv, "pushshift", impl->name, "nowrap",
+					     sizes[s], chunks[c], &res);
+				ret |= bench_run(impl, BENCH_PUSHSHIFT, sizes[s],
+						 flags, chunks[c], 1, rounds, &res);
+				bench_report(csv, "pushshift", impl->name, "wrap",
+					     sizes[s], chunks[c], &res);
+				ret |= bench_run(impl, BENCH_PEEK, sizes[s],
+						 flags, chunks[c], 1, rounds, &res);
+				bench_report(csv, "peek", impl->name, "-",
+					     sizes[s], chunks[c], &res);
+				ret |= bench_run(impl, BENCH_WALK, sizes[s], flags,
+						 chunks[c], walk,
+						 max(rounds / walk, 100UL), &res);
+				bench_report(csv, "iterate", impl->name, "-",
+					     sizes[s], chunks[c], &res);
+				if (ret)
+					return ret;
+			}
+		}
+	}
 
-	return 0;
+	return ret;
 }
 
-int nearest_power_test(void)
+
+struct bench_wakeup_arg {
+	struct iom_buffer *iom_buffer;
+	unsigned long rounds;
+	uint64_t *lat;
+};
+
+static void *bench_wakeup_consumer(void *arg)
 {
-	assert(0 == iom_nearest_power_two(0));
-	assert(4 == iom_nearest_power_two(3));
-	assert(4 == iom_nearest_power_two(4));
-	assert(8 == iom_nearest_power_two(5));
-	assert(8 == iom_nearest_power_two(8));
+	struct bench_wakeup_arg *a = arg;
+	unsigned int rbuf_len;
+	unsigned long i;
+	uint64_t sent;
+	int ret;
 
-	return 0;
+	for (i = 0; i < a->rounds; i++) {
+		while ((ret = iom_shift(a->iom_buffer, (unsigned char *)&sent,
+					&rbuf_len, sizeof(sent))) == EINVAL)
+			iom_wait_readable(a->iom_buffer, -1);
+		a->lat[i] = bench_cycles() - sent;
+	}
+
+	return NULL;
 }
 
 
-int chunks_number_test(void)
+/*
+ * IOM_WAIT: time from iom_push() to the return of the consumer from
+ * iom_wait_readable(), with gap_us idle time in front of every push.
+ * Without a gap the consumer is caught spinning, with a long gap it
+ * sleeps in the kernel.
+ */
+static int bench_wakeup(unsigned int gap_us, unsigned long rounds)
 {
+	struct bench_wakeup_arg arg;
+	pthread_t consumer;
+	unsigned long i;
+	uint64_t now;
 	int ret;
-	unsigned int rbuf_len;
-	struct iom_buffer *iom_buffer;
-	unsigned char buf;
-	unsigned char rbuf[3];
 
-	ret = iom_init(8, &iom_buffer, 0);
+	ret = iom_init(4096, &arg.iom_buffer, IOM_SPSC | IOM_WAIT);
 	if (ret) {
-		fputs("Cannot allocate iom_buffer\n", stderr);
+		fprintf(stderr, "Cannot allocate iom_buffer (%d)\n", ret);
+		return EXIT_FAILURE;
+	}
+	arg.rounds = rounds;
+	arg.lat = malloc(rounds * sizeof(*arg.lat));
+	if (!arg.lat || pthread_create(&consumer, NULL, bench_wakeup_consumer, &arg)) {
+		fputs("Cannot start consumer\n", stderr);
 		return EXIT_FAILURE;
 	}
-	assert(iom_chunks(iom_buffer) == 0);
-
-	buf = 0;
-	ret = iom_push(iom_buffer, &buf, sizeof(buf), IOM_TAIL_DROP);
-	assert(ret == 0);
-	assert(iom_chunks(iom_buffer) == 1);
-
-	buf = 1;
-	ret = iom_push(iom_buffer, &buf, sizeof(buf), IOM_TAIL_DROP);
-	assert(ret == 0);
-	assert(iom_chunks(iom_buffer) == 2);
-
-	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
-	assert(ret == 0);
-	assert(iom_chunks(iom_buffer) == 1);
 
-	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
-	assert(ret == 0);
-	assert(iom_chunks(iom_buffer) == 0);
+	for (i = 0; i < rounds; i++) {
+		if (gap_us)
+			usleep(gap_us);
+		/* one chunk at a time, the consumer has to wake for each */
+		while (iom_chunks(arg.iom_buffer))
+			cpu_relax();
+		now = bench_cycles();
+		ret = iom_push(arg.iom_buffer, (unsigned char *)&now, sizeof(now),
+			       IOM_TAIL_DROP);
+		assert(ret == 0);
+	}
+	pthread_join(consumer, NULL);
 
-	/*
-	 * following shift operation MUST fail. We test to failed
-	 * conditition and additionally test that the chunk size is
-	 * still zero
-	 */
-	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
-	assert(ret != 0);
-	assert(iom_chunks(iom_buffer) == 0);
+	qsort(arg.lat, rounds, sizeof(*arg.lat), bench_cmp_u64);
+	printf("wakeup   gap %6u us: p50 %8.2f us p99 %8.2f us\n", gap_us,
+	       arg.lat[rounds / 2] / bench_cycles_per_ns / 1000,
+	       arg.lat[rounds * 99 / 100] / bench_cycles_per_ns / 1000);
 
-	iom_free(iom_buffer);
+	free(arg.lat);
+	iom_free(arg.iom_buffer);
 
 	return 0;
 }
 
 
-#define IOM_BUF_SIZE 16
-int size_test(void)
+#define BENCH_FANOUT_READERS 3
+#define BENCH_FANOUT_BATCH   64
+
+/*
+ * BENCH_FANOUT_READERS readers get every chunk: from one
+ * IOM_BROADCAST ring through cursors, or from a ring each which the
+ * producer copies every chunk to. Single threaded, batches of
+ * BENCH_FANOUT_BATCH chunks are pushed and then read by each reader
+ * in turn, so this is the CPU time per chunk for all readers.
+ */
+static int bench_fanout(const char *name, int bcast, size_t chunk,
+			unsigned long rounds)
 {
+	struct iom_buffer *iom_buffer[BENCH_FANOUT_READERS];
+	struct iom_cursor *cursor[BENCH_FANOUT_READERS];
+	unsigned char *buf, *rbuf;
+	unsigned int rbuf_len, j, rings = bcast ? 1 : BENCH_FANOUT_READERS;
+	unsigned long i, k;
+	double start, ns;
 	int ret;
-	unsigned int rbuf_len;
-	struct iom_buffer *iom_buffer;
-	unsigned char buf[4];
-	unsigned char rbuf[4];
 
-	ret = iom_init(IOM_BUF_SIZE, &iom_buffer, 0);
-	if (ret) {
-		fputs("Cannot allocate iom_buffer\n", stderr);
+	buf  = calloc(1, chunk);
+	rbuf = malloc(chunk);
+	if (!buf || !rbuf) {
+		fputs("Cannot allocate buffer\n", stderr);
 		return EXIT_FAILURE;
 	}
-	assert(iom_chunks(iom_buffer) == 0);
-	assert(iom_space(iom_buffer) == IOM_BUF_SIZE - 1);
-
-
-	ret = iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
-	assert(ret == 0);
-	assert(iom_space(iom_buffer) == IOM_BUF_SIZE - 1 - sizeof(buf) - 2);
-
 
-	ret = iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
-	assert(ret == 0);
-	assert(iom_space(iom_buffer) == IOM_BUF_SIZE - 1 - (sizeof(buf) + 2) * 2);
-	assert(iom_chunks(iom_buffer) == 2);
+	for (j = 0; j < rings; j++) {
+		ret = iom_init(1 << 20, &iom_buffer[j],
+			       bcast ? IOM_SPSC | IOM_BROADCAST : IOM_SPSC);
+		if (ret) {
+			fprintf(stderr, "Cannot allocate iom_buffer (%d)\n", ret);
+			return EXIT_FAILURE;
+		}
+	}
+	for (j = 0; bcast && j < BENCH_FANOUT_READERS; j++) {
+		ret = iom_cursor_new(iom_buffer[0], 0, &cursor[j]);
+		assert(ret == 0);
+	}
 
+	start = bench_time();
+	for (i = 0; i < rounds; i += BENCH_FANOUT_BATCH) {
+		for (k = 0; k < BENCH_FANOUT_BATCH; k++)
+			for (j = 0; j < rings; j++)
+				ret |= iom_push(iom_buffer[j], buf, chunk,
+						IOM_TAIL_DROP);
+		for (j = 0; j < BENCH_FANOUT_READERS; j++)
+			for (k = 0; k < BENCH_FANOUT_BATCH; k++)
+				ret |= bcast ?
+				       iom_cursor_shift(cursor[j], rbuf,
+							&rbuf_len, chunk) :
+				       iom_shift(iom_buffer[j], rbuf,
+						 &rbuf_len, chunk);
+		if (ret) {
+			fprintf(stderr, "push/shift failed (%d)\n", ret);
+			return EXIT_FAILURE;
+		}
+	}
+	ns = (bench_time() - start) * 1e9 / rounds;
 
-	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
-	assert(ret == 0);
-	assert(iom_chunks(iom_buffer) == 1);
-	assert(iom_space(iom_buffer) == IOM_BUF_SIZE - 1 - sizeof(buf) - 2);
+	printf("%-8s readers %u chunk %6zu: %8.1f ns/chunk %9.1f MiB/s\n",
+	       name, BENCH_FANOUT_READERS, chunk, ns,
+	       chunk / ns * 1e9 / (1024 * 1024));
 
+	for (j = 0; bcast && j < BENCH_FANOUT_READERS; j++)
+		iom_cursor_free(cursor[j]);
+	for (j = 0; j < rings; j++)
+		iom_free(iom_buffer[j]);
+	free(rbuf);
+	free(buf);
 
-	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
-	assert(ret == 0);
-	assert(iom_chunks(iom_buffer) == 0);
-	assert(iom_space(iom_buffer) == IOM_BUF_SIZE - 1);
+	return 0;
+}
 
-	/*
-	 * following shift operation MUST fail. We test to failed
-	 * conditition and additionally test that the chunk size is
-	 * still zero
-	 */
-	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
-	assert(ret != 0);
-	assert(iom_chunks(iom_buffer) == 0);
-	assert(iom_space(iom_buffer) == IOM_BUF_SIZE - 1);
 
+#define BENCH_SHARDQ_PRODUCERS 16
 
-	ret = iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
-	assert(ret == 0);
-	assert(iom_space(iom_buffer) == IOM_BUF_SIZE - 1 - sizeof(buf) - 2);
+struct bench_shardq_arg {
+	struct iom_buffer *iom_buffer;
+	struct iom_shardq *q;
+	unsigned long rounds;
+};
 
-	ret = iom_shift(iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
-	assert(ret == 0);
-	assert(iom_chunks(iom_buffer) == 0);
-	assert(iom_space(iom_buffer) == IOM_BUF_SIZE - 1);
+static void *bench_shardq_producer(void *arg)
+{
+	struct bench_shardq_arg *a = arg;
+	unsigned char buf[64] = { 0 };
+	unsigned long i;
+	int ret;
 
-	iom_free(iom_buffer);
+	for (i = 0; i < a->rounds; ) {
+		ret = a->q ? iom_shardq_push(a->q, buf, sizeof(buf)) :
+		      iom_push(a->iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
+		if (ret == ENOBUFS) {
+			sched_yield();
+			continue;
+		}
+		assert(ret == 0);
+		i++;
+	}
 
-	return 0;
+	return NULL;
 }
 
 
-int chunk_headdrop_test(void)
+/*
+ * producers threads push 64 byte chunks, into one IOM_MPSC ring or
+ * into an iom_shardq with a shard per producer, while this thread
+ * drains. Chunks per second over all producers.
+ */
+static int bench_shardq(const char *name, int sharded, unsigned int producers,
+			unsigned long rounds)
 {
-	int ret, i;
-	struct iom_buffer *iom_buffer;
-	unsigned char buf;
+	struct bench_shardq_arg arg;
+	pthread_t thread[BENCH_SHARDQ_PRODUCERS];
+	unsigned char rbuf[64];
+	unsigned int rbuf_len, i;
+	unsigned long total = 0;
+	double start, secs;
+	int ret;
 
-	ret = iom_init(8, &iom_buffer, 0);
+	memset(&arg, 0, sizeof(arg));
+	ret = sharded ? iom_shardq_init(&arg.q, producers, 1 << 16,
+					IOM_SHARDQ_THREAD, 0) :
+	      iom_init(producers << 16, &arg.iom_buffer, IOM_MPSC);
 	if (ret) {
-		fputs("Cannot allocate iom_buffer\n", stderr);
+		fprintf(stderr, "Cannot allocate queue (%d)\n", ret);
 		return EXIT_FAILURE;
 	}
-	assert(iom_chunks(iom_buffer) == 0);
+	arg.rounds = rounds;
 
-	buf = 0;
-	ret = iom_push(iom_buffer, &buf, sizeof(buf), IOM_HEAD_DROP);
-	assert(ret == 0);
-	assert(iom_chunks(iom_buffer) == 1);
+	start = bench_time();
+	for (i = 0; i < producers; i++)
+		if (pthread_create(&thread[i], NULL, bench_shardq_producer, &arg)) {
+			fputs("Cannot start producer\n", stderr);
+			return EXIT_FAILURE;
+		}
 
-	i = 10;
-	do {
-		buf = 1;
-		ret = iom_push(iom_buffer, &buf, sizeof(buf), IOM_HEAD_DROP);
+	while (total < rounds * producers) {
+		ret = sharded ? iom_shardq_shift(arg.q, rbuf, &rbuf_len,
+						 sizeof(rbuf)) :
+		      iom_shift(arg.iom_buffer, rbuf, &rbuf_len, sizeof(rbuf));
+		if (ret == EINVAL || ret == EAGAIN) {
+			sched_yield();
+			continue;
+		}
 		assert(ret == 0);
-		assert(iom_chunks(iom_buffer) == 2);
-	} while (i--);
+		total++;
+	}
+	for (i = 0; i < producers; i++)
+		pthread_join(thread[i], NULL);
+	secs = bench_time() - start;
 
-	iom_free(iom_buffer);
+	printf("%-8s producers %2u: %8.2f Mchunks/s\n", name, producers,
+	       total / secs / 1e6);
+
+	if (sharded)
+		iom_shardq_free(arg.q);
+	else
+		iom_free(arg.iom_buffer);
 
 	return 0;
 }
 
 
-int reset_test(void)
+#define BENCH_PRIOQ_BULK 200
+
+/*
+ * A control chunk behind BENCH_PRIOQ_BULK bulk chunks of 4000 bytes:
+ * time from its push until the consumer has it, for one FIFO ring
+ * and for an iom_prioq with the control and the bulk class.
+ */
+static int bench_prioq(const char *name, int sched, unsigned long rounds)
 {
+	const struct iom_prioq_class cl[2] = {
+		{ 1 << 16, 1500, IOM_TAIL_DROP },
+		{ 1 << 20, 16000, IOM_TAIL_DROP },
+	};
+	unsigned char buf[4000] = { 0 }, rbuf[4000];
+	struct iom_buffer *iom_buffer = NULL;
+	struct iom_prioq *q = NULL;
+	unsigned int rbuf_len, i;
+	unsigned long r;
+	double start, ns = 0;
 	int ret;
-	struct iom_buffer *iom_buffer;
-	unsigned char buf;
 
-	ret = iom_init(8, &iom_buffer, 0);
+	ret = sched < 0 ? iom_init(1 << 20, &iom_buffer, 0) :
+	      iom_prioq_init(&q, cl, 2, sched, 0);
 	if (ret) {
-		fputs("Cannot allocate iom_buffer\n", stderr);
+		fprintf(stderr, "Cannot allocate queue (%d)\n", ret);
 		return EXIT_FAILURE;
 	}
-	assert(iom_chunks(iom_buffer) == 0);
 
-	buf = 0;
-	ret = iom_push(iom_buffer, &buf, sizeof(buf), IOM_HEAD_DROP);
-	assert(ret == 0);
-	assert(iom_chunks(iom_buffer) == 1);
-
-	buf = 0;
-	ret = iom_push(iom_buffer, &buf, sizeof(buf), IOM_HEAD_DROP);
-	assert(ret == 0);
-	assert(iom_chunks(iom_buffer) == 2);
-
-	iom_reset(iom_buffer);
-	assert(iom_chunks(iom_buffer) == 0);
-
-	iom_reset(iom_buffer);
-	assert(iom_chunks(iom_buffer) == 0);
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < BENCH_PRIOQ_BULK; i++) {
+			buf[0] = 1;
+			ret |= q ? iom_prioq_push(q, 1, buf, sizeof(buf)) :
+			       iom_push(iom_buffer, buf, sizeof(buf), IOM_TAIL_DROP);
+		}
+		buf[0] = 0;
+		start = bench_time();
+		ret |= q ? iom_prioq_push(q, 0, buf, 64) :
+		       iom_push(iom_buffer, buf, 64, IOM_TAIL_DROP);
+		do {
+			ret |= q ? iom_prioq_shift(q, rbuf, &rbuf_len,
+						   sizeof(rbuf), NULL) :
+			       iom_shift(iom_buffer, rbuf, &rbuf_len,
+					 sizeof(rbuf));
+		} while (!ret && rbuf[0]);
+		ns += (bench_time() - start) * 1e9;
+		if (ret) {
+			fprintf(stderr, "push/shift failed (%d)\n", ret);
+			return EXIT_FAILURE;
+		}
+		/* drain the bulk left over */
+		if (q)
+			while (!iom_prioq_shift(q, rbuf, &rbuf_len, sizeof(rbuf), NULL))
+				;
+		else
+			iom_reset(iom_buffer);
+	}
 
-	buf = 0;
-	ret = iom_push(iom_buffer, &buf, sizeof(buf), IOM_TAIL_DROP);
-	assert(ret == 0);
-	assert(iom_chunks(iom_buffer) == 1);
+	printf("%-8s control behind %u bulk: %10.1f ns\n", name,
+	       BENCH_PRIOQ_BULK, ns / rounds);
 
-	iom_free(iom_buffer);
+	if (q)
+		iom_prioq_free(q);
+	else
+		iom_free(iom_buffer);
 
 	return 0;
 }
 
 
-int main(void)
+/*
+ * iomalloc-bench [-c]: -c prints the suite as CSV and skips the
+ * special cases below
+ */
+int main(int argc, char **argv)
 {
-	int ret;
-
-	ret = space_test();
-	if (ret) {
-		fprintf(stderr, "space test 1 failed\n");
-		return EXIT_FAILURE;
-	}
-	fprintf(stderr, "space test 1 passed\n");
+	static const size_t chunks[] = { 64, 1000, 4000, 16000, 30000 };
+	static const size_t small[] = { 8, 32, 128 };
+	const size_t size = 65536;
+	unsigned long rounds;
+	int ret, opt, csv = 0;
+	size_t i;
 
-	ret = space_test2();
-	if (ret) {
-		fprintf(stderr, "space test 2 failed\n");
-		return EXIT_FAILURE;
+	while ((opt = getopt(argc, argv, "c")) != -1) {
+		switch (opt) {
+		case 'c':
+			csv = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
 	}
-	fprintf(stderr, "space test 2 passed\n");
 
-	ret = space_test3();
-	if (ret) {
-		fprintf(stderr, "space test 3 failed\n");
-		return EXIT_FAILURE;
-	}
-	fprintf(stderr, "space test 3 passed\n");
+	bench_calibrate();
+	if (!csv)
+		printf("%.2f cycles/ns, timer overhead %" PRIu64 " cycles\n",
+		       bench_cycles_per_ns, bench_cycles_overhead);
 
-	ret = space_test4();
-	if (ret) {
-		fprintf(stderr, "space test 4 failed\n");
-		return EXIT_FAILURE;
-	}
-	fprintf(stderr, "space test 4 passed\n");
+	ret = bench_suite(csv);
+	if (csv || ret)
+		return ret ? EXIT_FAILURE : EXIT_SUCCESS;
 
-	ret = peek_test();
-	if (ret) {
-		fprintf(stderr, "peek test failed\n");
-		return EXIT_FAILURE;
+	for (i = 0; i < ARRAY_SIZE(chunks); i++) {
+		rounds = (1UL << 30) / chunks[i];
+		ret |= bench_push_shift("split", 0, size, chunks[i], rounds);
+		ret |= bench_push_shift("magic", IOM_MAGIC_RING, size, chunks[i],
+					rounds);
 	}
-	fprintf(stderr, "peek test passed\n");
 
-	ret = iterator_test();
-	if (ret) {
-		fprintf(stderr, "iterator test failed\n");
-		return EXIT_FAILURE;
-	}
-	fprintf(stderr, "iterator test passed\n");
+	/* large ring, every wrap walks 64 MiB worth of TLB entries */
+	ret |= bench_push_shift("split", 0, 64 << 20, 4000, 1UL << 18);
+	ret |= bench_push_shift("huge", IOM_HUGEPAGE | IOM_POPULATE, 64 << 20,
+				4000, 1UL << 18);
 
-	ret = nearest_power_test();
-	if (ret) {
-		fprintf(stderr, "nearest power test failed\n");
-		return EXIT_FAILURE;
+	for (i = 0; i < ARRAY_SIZE(small); i++) {
+		ret |= bench_drain("shift", 0, size, small[i], 1000);
+		ret |= bench_drain("batch", 1, size, small[i], 1000);
 	}
-	fprintf(stderr, "nearest power of two test passed\n");
 
-	ret = chunks_number_test();
-	if (ret) {
-		fprintf(stderr, "chunks number test failed\n");
-		return EXIT_FAILURE;
-	}
-	fprintf(stderr, "chunks number test passed\n");
+	ret |= bench_churn("malloc", 0, 4096, 100000, 10000000);
+	ret |= bench_churn("pool", 1, 4096, 100000, 10000000);
 
-	ret = size_test();
-	if (ret) {
-		fprintf(stderr, "size test failed\n");
-		return EXIT_FAILURE;
-	}
-	fprintf(stderr, "size test passed\n");
+	/* the cost of IOM_WAIT for a producer nobody waits for */
+	ret |= bench_push_shift("spsc", IOM_SPSC, size, 64, 1UL << 24);
+	ret |= bench_push_shift("wait", IOM_SPSC | IOM_WAIT, size, 64, 1UL << 24);
+	ret |= bench_push_shift("notify", IOM_SPSC | IOM_NOTIFY, size, 64, 1UL << 24);
+	ret |= bench_wakeup(0, 100000);
+	ret |= bench_wakeup(500, 2000);
 
-	ret = chunk_headdrop_test();
-	if (ret) {
-		fprintf(stderr, "chunk headdrop test failed\n");
-		return EXIT_FAILURE;
+	/* one ring read by all vs a copy per reader */
+	for (i = 0; i < 2; i++) {
+		ret |= bench_fanout("copies", 0, i ? 1000 : 64, 1UL << 23);
+		ret |= bench_fanout("cursors", 1, i ? 1000 : 64, 1UL << 23);
 	}
-	fprintf(stderr, "chunk headdrop test passed\n");
 
-	ret = reset_test();
-	if (ret) {
-		fprintf(stderr, "reset test failed\n");
-		return EXIT_FAILURE;
+	/* producer scaling, one contended ring vs a shard each */
+	for (i = 1; i <= BENCH_SHARDQ_PRODUCERS; i *= 4) {
+		ret |= bench_shardq("mpsc", 0, i, (1UL << 22) / i);
+		ret |= bench_shardq("shardq", 1, i, (1UL << 22) / i);
 	}
-	fprintf(stderr, "reset test passed\n");
 
+	/* head of line blocking of control traffic */
+	ret |= bench_prioq("fifo", -1, 10000);
+	ret |= bench_prioq("strict", IOM_PRIOQ_STRICT, 10000);
+	ret |= bench_prioq("drr", IOM_PRIOQ_DRR, 10000);
 
-	return EXIT_SUCCESS;
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-#endif /* TEST_BUILD */
+#endif /* BENCH_BUILD */
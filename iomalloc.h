@@ -0,0 +1,477 @@
+/*
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** IOMalloc - Strict FIFO Memory Allocator
+**
+** Author: Hagen Paul Pfeifer <hagen.pfeifer@protocollabs.com>
+**
+*/
+
+#ifndef IOMALLOC_H
+#define IOMALLOC_H
+
+#include <stddef.h>
+#include <string.h>
+/* for struct iovec */
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef IOM_CACHELINE_SIZE
+# define IOM_CACHELINE_SIZE 64
+#endif
+
+/*
+ * See if our compiler is known to support flexible array members.
+ */
+#ifndef FLEX_ARRAY
+#if defined(__STDC_VERSION__) && \
+	(__STDC_VERSION__ >= 199901L) && \
+	(!defined(__SUNPRO_C) || (__SUNPRO_C > 0x580))
+# define FLEX_ARRAY /* empty */
+#elif defined(__GNUC__)
+# if (__GNUC__ >= 3)
+#  define FLEX_ARRAY /* empty */
+# else
+#  define FLEX_ARRAY 0 /* older GNU extension */
+# endif
+#endif
+#ifndef FLEX_ARRAY
+# define FLEX_ARRAY 1
+#endif
+#endif
+
+/* iom_init() flags */
+#define	IOM_SPSC         0x1
+#define	IOM_MPSC         0x2
+#define	IOM_MAGIC_RING   0x4
+#define	IOM_NO_SPLIT     0x8
+#define	IOM_VARINT       0x10
+#define	IOM_MAINLY_EMPTY 0x20
+#define	IOM_HUGEPAGE     0x40
+#define	IOM_POPULATE     0x80
+#define	IOM_NUMA_LOCAL   0x100
+/* iom_wait_readable() and iom_wait_writable(), IOM_SPSC or IOM_MPSC only */
+#define	IOM_WAIT         0x200
+/* readers are cursors from iom_cursor_new(), with IOM_SPSC only */
+#define	IOM_BROADCAST    0x400
+/* prefer memory of NUMA node n (0 - 254) */
+#define	IOM_NUMA_NODE(n) ((((unsigned)(n) + 1) & 0xff) << 16)
+#define	IOM_NUMA_MASK    0x00ff0000
+/* grow on demand instead of dropping, up to 2^shift bytes (max 30) */
+#define	IOM_GROW_MAX(shift) (((unsigned)(shift) & 0x1f) << 24)
+#define	IOM_GROW_MASK    0x1f000000
+
+/* iom_push() flags */
+#define IOM_HEAD_DROP          0x0
+#define	IOM_TAIL_DROP          0x1
+#define	IOM_DROP_ALL           0x2
+
+/* iom_drain_to_fd() and iom_fill_from_fd() flags */
+#define	IOM_FD_FRAMED          0x1
+
+/* iom_notify_read() events */
+#define	IOM_EV_READABLE        0x1
+#define	IOM_EV_HIGH            0x2
+#define	IOM_EV_LOW             0x4
+
+/* iom_cursor_new() flags */
+#define	IOM_CURSOR_DETACH      0x1
+
+/* iom_shardq_init() queue flags */
+#define	IOM_SHARDQ_ORDERED     0x1
+#define	IOM_SHARDQ_THREAD      0x2
+
+/* iom_prioq_init() schedulers */
+#define	IOM_PRIOQ_DRR          0x0
+#define	IOM_PRIOQ_STRICT       0x1
+
+/* iom_pool_new() flags */
+#define	IOM_POOL_HUGEPAGE      0x1
+
+/* internal: the buffer belongs to an iom_pool */
+#define	IOM_POOLED       0x80000000U
+/* internal: buf is a shared mapping from iom_shm_create/attach() */
+#define	IOM_SHARED       0x40000000U
+/* internal: the shared mapping is a file from iom_file_open() */
+#define	IOM_PERSIST      0x20000000U
+/* internal: iom_notify_fd() attached an eventfd */
+#define	IOM_NOTIFY       0x00008000U
+
+/* internal: modes the inline iom_push() and iom_shift() leave to the library */
+#define	IOM_INLINE_SLOW  (IOM_MPSC | IOM_NO_SPLIT | IOM_VARINT | \
+			  IOM_MAINLY_EMPTY | IOM_BROADCAST | IOM_PERSIST | \
+			  IOM_NOTIFY)
+
+/*
+ * Implemented as continues chunk to avoid memory
+ * dereferences when queue never fills.
+ *
+ * Producer and consumer state live on separate cache lines. Each
+ * side keeps a private copy of the other index (tail_cache,
+ * head_cache) and only re-reads the shared one if the copy says the
+ * buffer is full or empty. The number of chunks is not shared
+ * either: each side counts for itself and iom_chunks() returns the
+ * difference.
+ */
+struct iom_bcast;
+
+struct iom_buffer {
+	unsigned int size;
+	unsigned int flags;
+	/* iom_notify_fd(): eventfd, watermarks and pending events */
+	int evfd;
+	unsigned int lo_wm;
+	unsigned int hi_wm;
+	unsigned int ev_state;
+	/* IOM_BROADCAST: the cursor slots, see iom_cursor_new() */
+	struct iom_bcast *bcast;
+
+	/* producer side - buf index: no pointer, save 8 byte on some arch's */
+	int head __attribute__ ((__aligned__(IOM_CACHELINE_SIZE)));
+	int tail_cache;
+	unsigned int pushed;
+	/* IOM_MPSC: unmasked reservation index, head trails behind */
+	unsigned int resv;
+	/* iom_fill_from_fd(): bytes of an incomplete frame beyond head */
+	unsigned int fill_pend;
+	/* iom_push_reserve(): a reservation at head is not committed yet */
+	unsigned int push_pend;
+	/* IOM_MAINLY_EMPTY: bytes of buf touched since the last reclaim */
+	unsigned int hiwat;
+	/* IOM_PERSIST: msync() after sync_bytes, unsynced pushed since */
+	unsigned int sync_bytes;
+	unsigned int unsynced;
+	/* IOM_PERSIST: head << 32 | tail of the last iom_file_sync() */
+	unsigned long long synced __attribute__ ((__aligned__(8)));
+	/* IOM_PERSIST: error of a sync done by a push, for iom_file_sync() */
+	int sync_err;
+	/* IOM_WAIT: consumers parked on head, read on every publish */
+	unsigned int rd_waiters;
+
+	/* consumer side */
+	int tail __attribute__ ((__aligned__(IOM_CACHELINE_SIZE)));
+	int head_cache;
+	unsigned int shifted;
+	/* iom_drain_to_fd(): bytes of the chunk at tail already written */
+	unsigned int drain_off;
+	/* IOM_WAIT: producers parked on tail */
+	unsigned int wr_waiters;
+
+	unsigned char buf[FLEX_ARRAY] __attribute__ ((__aligned__(IOM_CACHELINE_SIZE)));
+};
+
+struct iom_iterator {
+	int tail;
+	int head;
+};
+
+/*
+ * Space handed out by iom_push_reserve(). The payload is written
+ * to iov[0] and - if the chunk wraps around the end of the buffer -
+ * iov[1]. pos and len are private to iomalloc.
+ */
+struct iom_reservation {
+	struct iovec iov[2];
+	int iovcnt;
+	int pos;
+	unsigned int len;
+	unsigned int hdr_len;
+};
+
+/*
+ * One class of an iom_prioq: a ring of size bytes, its iom_push()
+ * drop policy and, for IOM_PRIOQ_DRR, the bytes it may send per
+ * round.
+ */
+struct iom_prioq_class {
+	size_t size;
+	unsigned int quantum;
+	int drop;
+};
+
+struct iom_cursor;
+struct iom_pool;
+struct iom_segq;
+struct iom_segq_iterator;
+struct iom_shardq;
+struct iom_prioq;
+
+int iom_init(size_t size, struct iom_buffer **iom_buffer, unsigned flags);
+void iom_free(struct iom_buffer *iom_buffer);
+void iom_reset(struct iom_buffer *iom_buffer);
+void iom_reset_secure(struct iom_buffer *iom_buffer);
+int iom_resize(struct iom_buffer **iom_buffer, size_t size);
+
+int iom_shm_create(const char *name, size_t size,
+		   struct iom_buffer **iom_buffer, unsigned flags);
+int iom_shm_attach(const char *name, struct iom_buffer **iom_buffer);
+int iom_file_open(const char *path, size_t size, struct iom_buffer **iom_buffer,
+		  unsigned flags, size_t sync_bytes);
+int iom_file_sync(struct iom_buffer *iom_buffer);
+
+unsigned int iom_cnt_to_end(struct iom_buffer *iom_buffer);
+unsigned int iom_space_to_end(struct iom_buffer *iom_buffer);
+int iom_continues_chunk_fast(struct iom_buffer *iom_buffer, size_t size);
+
+int iom_push_slow(struct iom_buffer *iom_buffer, unsigned char *buf,
+		  size_t len, int flags);
+int iom_pushv(struct iom_buffer *iom_buffer, const struct iovec *iov,
+	      int iovcnt, int flags);
+int iom_push_reserve(struct iom_buffer *iom_buffer, struct iom_reservation *res,
+		     size_t len, int flags);
+int iom_push_commit(struct iom_buffer *iom_buffer, struct iom_reservation *res,
+		    size_t len);
+int iom_push_cancel(struct iom_buffer *iom_buffer, struct iom_reservation *res);
+
+int iom_shift_slow(struct iom_buffer *iom_buffer, unsigned char *buf,
+		   unsigned int *buf_len, unsigned int max_size);
+int iom_peek(struct iom_buffer *iom_buffer, unsigned char *buf,
+	     unsigned int *buf_len, unsigned int max_size);
+int iom_peek_update(struct iom_buffer *iom_buffer);
+int iom_shift_view(struct iom_buffer *iom_buffer, struct iovec iov[2],
+		   int *iovcnt);
+int iom_shift_release(struct iom_buffer *iom_buffer);
+int iom_shift_batch(struct iom_buffer *iom_buffer, unsigned int max_chunks,
+		    size_t max_bytes,
+		    int (*cb)(const struct iovec *iov, int iovcnt, void *arg),
+		    void *arg, unsigned int *chunks);
+int iom_shift_batchv(struct iom_buffer *iom_buffer, struct iovec *iov,
+		     int iovcnt, unsigned int *chunks);
+
+int iom_wait_readable(struct iom_buffer *iom_buffer, int timeout_ms);
+int iom_wait_writable(struct iom_buffer *iom_buffer, size_t len, int timeout_ms);
+void iom_wake_slow(struct iom_buffer *iom_buffer, int *word);
+
+int iom_notify_fd(struct iom_buffer *iom_buffer, unsigned int low,
+		  unsigned int high, int *fd);
+int iom_notify_read(struct iom_buffer *iom_buffer, unsigned int *events);
+
+int iom_drain_to_fd(struct iom_buffer *iom_buffer, int fd, int flags,
+		    size_t *written);
+int iom_fill_from_fd(struct iom_buffer *iom_buffer, int fd, size_t max_len,
+		     int flags, size_t *nread);
+
+struct iom_iterator *iom_iterator_new(struct iom_buffer *iom_buffer);
+void iom_iterator_free(struct iom_iterator *iom_iterator);
+int iom_iterator_peek_next(struct iom_iterator *iom_iterator,
+			   struct iom_buffer *iom_buffer,
+			   unsigned char *buf, int *buf_len, int max_size);
+
+int iom_cursor_new(struct iom_buffer *iom_buffer, unsigned flags,
+		   struct iom_cursor **cursor);
+void iom_cursor_free(struct iom_cursor *cursor);
+int iom_cursor_shift(struct iom_cursor *cursor, unsigned char *buf,
+		     unsigned int *buf_len, unsigned int max_size);
+int iom_cursor_view(struct iom_cursor *cursor, struct iovec iov[2],
+		    int *iovcnt);
+int iom_cursor_release(struct iom_cursor *cursor);
+int iom_cursor_lag(struct iom_cursor *cursor, unsigned int *lag);
+
+size_t iom_nearest_power_two(size_t k);
+
+int iom_pool_new(struct iom_pool **iom_pool, size_t min_size,
+		 size_t max_size, size_t slab_size, unsigned flags);
+int iom_pool_get(struct iom_pool *pool, size_t size,
+		 struct iom_buffer **iom_buffer, unsigned flags);
+void iom_pool_put(struct iom_pool *pool, struct iom_buffer *iom_buffer);
+void iom_pool_free(struct iom_pool *pool);
+
+int iom_segq_init(struct iom_segq **iom_segq, size_t seg_size,
+		  unsigned int keep, unsigned flags);
+void iom_segq_free(struct iom_segq *q);
+int iom_segq_push(struct iom_segq *q, unsigned char *buf, size_t len);
+int iom_segq_shift(struct iom_segq *q, unsigned char *buf,
+		   unsigned int *buf_len, unsigned int max_size);
+int iom_segq_peek(struct iom_segq *q, unsigned char *buf,
+		  unsigned int *buf_len, unsigned int max_size);
+int iom_segq_peek_update(struct iom_segq *q);
+unsigned int iom_segq_chunks(struct iom_segq *q);
+unsigned int iom_segq_segments(struct iom_segq *q);
+struct iom_segq_iterator *iom_segq_iterator_new(struct iom_segq *q);
+void iom_segq_iterator_free(struct iom_segq_iterator *it);
+int iom_segq_iterator_peek_next(struct iom_segq_iterator *it,
+				unsigned char *buf, int *buf_len, int max_size);
+
+int iom_shardq_init(struct iom_shardq **iom_shardq, unsigned int shards,
+		    size_t shard_size, unsigned int qflags, unsigned flags);
+void iom_shardq_free(struct iom_shardq *q);
+int iom_shardq_push(struct iom_shardq *q, unsigned char *buf, size_t len);
+int iom_shardq_shift(struct iom_shardq *q, unsigned char *buf,
+		     unsigned int *buf_len, unsigned int max_size);
+unsigned int iom_shardq_chunks(struct iom_shardq *q);
+unsigned int iom_shardq_shards(struct iom_shardq *q);
+
+int iom_prioq_init(struct iom_prioq **iom_prioq,
+		   const struct iom_prioq_class *classes, unsigned int nclasses,
+		   unsigned int sched, unsigned flags);
+void iom_prioq_free(struct iom_prioq *q);
+int iom_prioq_push(struct iom_prioq *q, unsigned int cls,
+		   unsigned char *buf, size_t len);
+int iom_prioq_shift(struct iom_prioq *q, unsigned char *buf,
+		    unsigned int *buf_len, unsigned int max_size,
+		    unsigned int *cls);
+unsigned int iom_prioq_chunks(struct iom_prioq *q, unsigned int cls);
+
+/*
+ * Inline fast paths. The counters, and iom_push() and iom_shift()
+ * for a chunk with the plain 2 byte cookie which fits without
+ * dropping, are compiled into the caller. Everything else - drop
+ * policies at work, growing, IOM_MPSC, IOM_NO_SPLIT, IOM_VARINT,
+ * IOM_MAINLY_EMPTY, persistent rings, iom_notify_fd() and all errors
+ * - is handed to iom_push_slow() and iom_shift_slow() in the
+ * library, which implement the complete calls. With IOM_WAIT a
+ * parked peer is woken by iom_wake_slow().
+ */
+
+static inline unsigned int iom_cnt_int(int head, int tail, unsigned int size)
+{
+	return (head - tail) & (size - 1);
+}
+
+
+static inline unsigned int iom_space_int(int head, int tail, unsigned int size)
+{
+	return (tail - (head + 1)) & (size - 1);
+}
+
+
+/**
+ * Returns the number of bytes currently occupying iom_buffer
+ */
+static inline unsigned int iom_cnt(struct iom_buffer *iom_buffer)
+{
+	return iom_cnt_int(__atomic_load_n(&iom_buffer->head, __ATOMIC_ACQUIRE),
+			   __atomic_load_n(&iom_buffer->tail, __ATOMIC_ACQUIRE),
+			   iom_buffer->size);
+}
+
+
+/**
+ * Returns the amount of space left in iom_buffer
+ */
+static inline unsigned int iom_space(struct iom_buffer *iom_buffer)
+{
+	return iom_space_int(__atomic_load_n(&iom_buffer->head, __ATOMIC_ACQUIRE),
+			     __atomic_load_n(&iom_buffer->tail, __ATOMIC_ACQUIRE),
+			     iom_buffer->size);
+}
+
+
+/**
+ * Returns number of chunks in the buffer - not bytes
+ */
+static inline unsigned int iom_chunks(struct iom_buffer *iom_buffer)
+{
+	unsigned int shifted = __atomic_load_n(&iom_buffer->shifted,
+					       __ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&iom_buffer->pushed, __ATOMIC_RELAXED) - shifted;
+}
+
+
+static inline int iom_push(struct iom_buffer *iom_buffer, unsigned char *buf,
+			   size_t len, int flags)
+{
+	const unsigned int mask = iom_buffer->size - 1;
+	unsigned int pos;
+	size_t to_end;
+	int head;
+
+	/* a HEAD_DROP which need not drop is a TAIL_DROP */
+	if ((iom_buffer->flags & IOM_INLINE_SLOW) || len > 0xffff ||
+	    !(flags == IOM_TAIL_DROP ||
+	      (flags == IOM_HEAD_DROP && !(iom_buffer->flags & IOM_SPSC))))
+		return iom_push_slow(iom_buffer, buf, len, flags);
+
+	head = iom_buffer->head;
+	if (iom_space_int(head, iom_buffer->tail_cache, iom_buffer->size) < len + 2) {
+		iom_buffer->tail_cache = __atomic_load_n(&iom_buffer->tail,
+							 __ATOMIC_ACQUIRE);
+		if (iom_space_int(head, iom_buffer->tail_cache,
+				  iom_buffer->size) < len + 2)
+			return iom_push_slow(iom_buffer, buf, len, flags);
+	}
+
+	iom_buffer->buf[head] = (unsigned char)(len >> 8);
+	iom_buffer->buf[(head + 1) & mask] = (unsigned char)len;
+	pos = (head + 2) & mask;
+	to_end = iom_buffer->size - pos;
+	if (len <= to_end) {
+		memcpy(&iom_buffer->buf[pos], buf, len);
+	} else {
+		memcpy(&iom_buffer->buf[pos], buf, to_end);
+		memcpy(&iom_buffer->buf[0], &buf[to_end], len - to_end);
+	}
+
+	__atomic_store_n(&iom_buffer->pushed, iom_buffer->pushed + 1,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&iom_buffer->head, (int)((pos + len) & mask),
+			 __ATOMIC_RELEASE);
+	if ((iom_buffer->flags & IOM_WAIT) &&
+	    __atomic_fetch_add(&iom_buffer->rd_waiters, 0, __ATOMIC_SEQ_CST))
+		iom_wake_slow(iom_buffer, &iom_buffer->head);
+
+	return 0;
+}
+
+
+static inline int iom_shift(struct iom_buffer *iom_buffer, unsigned char *buf,
+			    unsigned int *buf_len, unsigned int max_size)
+{
+	const unsigned int mask = iom_buffer->size - 1;
+	unsigned int len, pos, to_end;
+	int tail;
+
+	if (iom_buffer->flags & IOM_INLINE_SLOW)
+		return iom_shift_slow(iom_buffer, buf, buf_len, max_size);
+
+	tail = iom_buffer->tail;
+	if (!iom_cnt_int(iom_buffer->head_cache, tail, iom_buffer->size)) {
+		iom_buffer->head_cache = __atomic_load_n(&iom_buffer->head,
+							 __ATOMIC_ACQUIRE);
+		if (!iom_cnt_int(iom_buffer->head_cache, tail, iom_buffer->size))
+			return iom_shift_slow(iom_buffer, buf, buf_len, max_size);
+	}
+
+	len = (iom_buffer->buf[tail] << 8) | iom_buffer->buf[(tail + 1) & mask];
+	if (len > max_size)
+		return iom_shift_slow(iom_buffer, buf, buf_len, max_size);
+
+	pos = (tail + 2) & mask;
+	to_end = iom_buffer->size - pos;
+	if (len <= to_end) {
+		memcpy(buf, &iom_buffer->buf[pos], len);
+	} else {
+		memcpy(buf, &iom_buffer->buf[pos], to_end);
+		memcpy(&buf[to_end], &iom_buffer->buf[0], len - to_end);
+	}
+	*buf_len = len;
+
+	/* single threaded an empty buffer starts over at 0 */
+	if (!(iom_buffer->flags & IOM_SPSC) && !iom_buffer->fill_pend &&
+	    !iom_buffer->push_pend && ((pos + len) & mask) == (unsigned int)iom_buffer->head) {
+		iom_reset(iom_buffer);
+		return 0;
+	}
+
+	__atomic_store_n(&iom_buffer->shifted, iom_buffer->shifted + 1,
+			 __ATOMIC_RELEASE);
+	__atomic_store_n(&iom_buffer->tail, (int)((pos + len) & mask),
+			 __ATOMIC_RELEASE);
+	if ((iom_buffer->flags & IOM_WAIT) &&
+	    __atomic_fetch_add(&iom_buffer->wr_waiters, 0, __ATOMIC_SEQ_CST))
+		iom_wake_slow(iom_buffer, &iom_buffer->tail);
+
+	return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IOMALLOC_H */
@@ -0,0 +1,332 @@
+/*
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** IOMalloc - Strict FIFO Memory Allocator
+**
+** Author: Hagen Paul Pfeifer <hagen.pfeifer@protocollabs.com>
+**
+*/
+
+/*
+ * C++20 front end: iom::ring<Policy, Capacity, Sync> owns a struct
+ * iom_buffer and inlines the push and shift fast paths. Drop policy,
+ * capacity and sync mode are template arguments, so the index mask
+ * is a constant and the flag tests of the C calls are resolved at
+ * compile time. The buffer layout is the one of the C library, get()
+ * hands it to every other iom_*() call. Uncommon cases (a full ring
+ * with IOM_HEAD_DROP or IOM_DROP_ALL) fall back to iom_push().
+ *
+ * Only the plain format is covered: 2 byte big endian cookie, no
+ * IOM_VARINT, IOM_NO_SPLIT, IOM_MPSC or IOM_MAGIC_RING. Pushes and
+ * shifts of the template do not post iom_notify_fd() events.
+ */
+
+#ifndef IOMALLOC_HPP
+#define IOMALLOC_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <span>
+#include <system_error>
+#include <utility>
+
+#include "iomalloc.h"
+
+namespace iom {
+
+enum class drop : int {
+	head = IOM_HEAD_DROP,
+	tail = IOM_TAIL_DROP,
+	all  = IOM_DROP_ALL,
+};
+
+enum class sync : unsigned {
+	/* producer and consumer on the same thread */
+	none = 0,
+	/* one producer and one consumer thread */
+	spsc = IOM_SPSC,
+};
+
+/*
+ * Payload of the chunk at tail, second is empty unless the chunk
+ * wraps around the end of the ring
+ */
+struct view {
+	std::span<const std::byte> first;
+	std::span<const std::byte> second;
+
+	std::size_t size() const noexcept
+	{
+		return first.size() + second.size();
+	}
+};
+
+template <drop Policy, std::size_t Capacity, sync Sync = sync::none>
+class ring {
+	static_assert(Capacity >= 4 && (Capacity & (Capacity - 1)) == 0,
+		      "Capacity must be a power of two");
+	static_assert(Capacity <= (std::size_t{1} << 30),
+		      "Capacity exceeds the 32 bit ring index");
+	static_assert(Sync == sync::none || Policy == drop::tail,
+		      "the producer cannot drop for a concurrent consumer");
+
+	static constexpr unsigned int mask = Capacity - 1;
+	static constexpr unsigned int hdr_len = 2;
+
+public:
+	static constexpr std::size_t capacity = Capacity;
+	/* largest payload, limited by the cookie and the ring */
+	static constexpr std::size_t max_chunk =
+		Capacity - hdr_len < USHRT_MAX ? Capacity - hdr_len : USHRT_MAX;
+
+	ring()
+	{
+		int ret = iom_init(Capacity, &b_, static_cast<unsigned>(Sync));
+
+		if (ret)
+			throw std::system_error(ret, std::generic_category(),
+						"iom_init");
+	}
+
+	~ring()
+	{
+		if (b_)
+			iom_free(b_);
+	}
+
+	ring(const ring &) = delete;
+	ring &operator=(const ring &) = delete;
+
+	ring(ring &&other) noexcept : b_(std::exchange(other.b_, nullptr))
+	{
+	}
+
+	ring &operator=(ring &&other) noexcept
+	{
+		if (this != &other) {
+			if (b_)
+				iom_free(b_);
+			b_ = std::exchange(other.b_, nullptr);
+		}
+		return *this;
+	}
+
+	/* the underlying buffer, valid for the C calls; NULL if moved from */
+	struct iom_buffer *get() const noexcept
+	{
+		return b_;
+	}
+
+	/*
+	 * Same contract as iom_push(): EINVAL if data can never fit,
+	 * ENOBUFS if drop::tail finds the ring full
+	 */
+	int push(std::span<const std::byte> data) noexcept
+	{
+		const std::size_t len = data.size();
+		const int head = b_->head;
+
+		if (len > max_chunk)
+			return EINVAL;
+
+		if (prod_space(head, len + hdr_len) < len + hdr_len) {
+			if constexpr (Policy == drop::tail)
+				return ENOBUFS;
+			else
+				return iom_push(b_, reinterpret_cast<unsigned char *>(
+						const_cast<std::byte *>(data.data())),
+						len, static_cast<int>(Policy));
+		}
+
+		b_->buf[head] = static_cast<unsigned char>(len >> 8);
+		b_->buf[(head + 1) & mask] = static_cast<unsigned char>(len);
+		copy_in((head + hdr_len) & mask, data.data(), len);
+
+		head_publish((head + hdr_len + len) & mask);
+
+		return 0;
+	}
+
+	/*
+	 * Same contract as iom_shift(): EINVAL if empty, ENOBUFS if the
+	 * chunk is larger than out. len is set to the payload length.
+	 */
+	int shift(std::span<std::byte> out, std::size_t &len) noexcept
+	{
+		const int tail = b_->tail;
+		unsigned int l;
+
+		if (!cons_cnt(tail))
+			return EINVAL;
+
+		l = chunk_len(tail);
+		if (l > out.size())
+			return ENOBUFS;
+
+		copy_out(out.data(), (tail + hdr_len) & mask, l);
+		len = l;
+
+		tail_publish((tail + hdr_len + l) & mask);
+
+		return 0;
+	}
+
+	/*
+	 * Zero copy access to the chunk at tail, valid until release().
+	 * EINVAL if empty.
+	 */
+	int peek(view &v) noexcept
+	{
+		const int tail = b_->tail;
+		unsigned int l, data, to_end;
+
+		if (!cons_cnt(tail))
+			return EINVAL;
+
+		l = chunk_len(tail);
+		data = (tail + hdr_len) & mask;
+		to_end = Capacity - data;
+		if (l <= to_end) {
+			v.first = {as_bytes(data), l};
+			v.second = {};
+		} else {
+			v.first = {as_bytes(data), to_end};
+			v.second = {as_bytes(0), l - to_end};
+		}
+
+		return 0;
+	}
+
+	/* drop the chunk at tail, EINVAL if empty */
+	int release() noexcept
+	{
+		const int tail = b_->tail;
+
+		if (!cons_cnt(tail))
+			return EINVAL;
+
+		tail_publish((tail + hdr_len + chunk_len(tail)) & mask);
+
+		return 0;
+	}
+
+	unsigned int chunks() const noexcept
+	{
+		return iom_chunks(b_);
+	}
+
+	bool empty() const noexcept
+	{
+		return chunks() == 0;
+	}
+
+private:
+	struct iom_buffer *b_ = nullptr;
+
+	static int load(int &x) noexcept
+	{
+		if constexpr (Sync == sync::none)
+			return x;
+		else
+			return std::atomic_ref<int>(x).load(std::memory_order_acquire);
+	}
+
+	template <typename T>
+	static void store(T &x, T v) noexcept
+	{
+		if constexpr (Sync == sync::none)
+			x = v;
+		else
+			std::atomic_ref<T>(x).store(v, std::memory_order_release);
+	}
+
+	/* see iom_prod_space(), the consumer index is read if needed */
+	unsigned int prod_space(int head, std::size_t need) noexcept
+	{
+		unsigned int space = (b_->tail_cache - (head + 1)) & mask;
+
+		if (space >= need)
+			return space;
+
+		b_->tail_cache = load(b_->tail);
+		return (b_->tail_cache - (head + 1)) & mask;
+	}
+
+	/* see iom_cons_cnt() */
+	unsigned int cons_cnt(int tail) noexcept
+	{
+		unsigned int cnt = (b_->head_cache - tail) & mask;
+
+		if (cnt)
+			return cnt;
+
+		b_->head_cache = load(b_->head);
+		return (b_->head_cache - tail) & mask;
+	}
+
+	unsigned int chunk_len(int pos) const noexcept
+	{
+		return (b_->buf[pos] << 8) | b_->buf[(pos + 1) & mask];
+	}
+
+	const std::byte *as_bytes(unsigned int pos) const noexcept
+	{
+		return reinterpret_cast<const std::byte *>(&b_->buf[pos]);
+	}
+
+	void copy_in(unsigned int pos, const std::byte *src, std::size_t len) noexcept
+	{
+		const std::size_t to_end = Capacity - pos;
+
+		if (len <= to_end) {
+			std::memcpy(&b_->buf[pos], src, len);
+		} else {
+			std::memcpy(&b_->buf[pos], src, to_end);
+			std::memcpy(&b_->buf[0], src + to_end, len - to_end);
+		}
+	}
+
+	void copy_out(std::byte *dst, unsigned int pos, std::size_t len) const noexcept
+	{
+		const std::size_t to_end = Capacity - pos;
+
+		if (len <= to_end) {
+			std::memcpy(dst, &b_->buf[pos], len);
+		} else {
+			std::memcpy(dst, &b_->buf[pos], to_end);
+			std::memcpy(dst + to_end, &b_->buf[0], len - to_end);
+		}
+	}
+
+	void head_publish(int head) noexcept
+	{
+		store(b_->pushed, b_->pushed + 1);
+		store(b_->head, head);
+	}
+
+	/*
+	 * Single threaded an empty ring starts over at 0 to keep the
+	 * memory references local, like iom_reset_if_empty(). Through
+	 * iom_reset(), so state of the C calls on get() is reset too.
+	 */
+	void tail_publish(int tail) noexcept
+	{
+		if constexpr (Sync == sync::none) {
+			if (tail == b_->head && !b_->fill_pend && !b_->push_pend) {
+				iom_reset(b_);
+				return;
+			}
+		}
+		store(b_->shifted, b_->shifted + 1);
+		store(b_->tail, tail);
+	}
+};
+
+} /* namespace iom */
+
+#endif /* IOMALLOC_HPP */